@@ -4,30 +4,193 @@
 #include "config.hpp"
 #include "contents.hpp"
 #include "packet.hpp"
+#include "view.hpp"
+#include <algorithm>
+#include <array>
 #include <functional>
 #include <iostream>
+#include <list>
 #include <memory>
+#include <optional>
+#include <queue>
 #include <string>
+#include <type_traits>
 #include <variant>
+#include <vector>
 
 namespace cbus {
 
-  inline uint16_t calc_crc(std::string data) {
-    uint16_t crc = 0xFFFF;
-
-    for (uint_fast32_t pos = 0; pos < data.size(); pos++) {
-      crc ^= (uint16_t)((uint8_t)data.at(pos));
-      for (uint_fast8_t i = 8; i != 0; i--) {
-        if ((crc & 0x0001) != 0) {
-          crc >>= 1;
-          crc ^= 0xA001;
-        } else
-          crc >>= 1;
+  /**
+   * \brief lookup table for the modbus crc, one entry per byte value
+   */
+  struct crc_table {
+    constexpr crc_table() : values() {
+      for (uint_fast16_t byte = 0; byte < 256; byte++) {
+        uint16_t crc = byte;
+        for (uint_fast8_t i = 8; i != 0; i--) {
+          if ((crc & 0x0001) != 0) {
+            crc >>= 1;
+            crc ^= 0xA001;
+          } else
+            crc >>= 1;
+        }
+        values[byte] = crc;
       }
     }
+    uint16_t values[256];
+  };
+
+  /**
+   * \brief continue a modbus crc calculation
+   * \param crc the crc of the previous data, 0xFFFF at the start
+   * \param data the data to add
+   * \param size number of bytes in data
+   * \return the new crc, not yet swapped into transmission order
+   */
+  inline uint16_t update_crc(uint16_t crc, const char* data, const size_t size) {
+    static constexpr crc_table table;
+    for (size_t pos = 0; pos < size; pos++)
+      crc = (crc >> 8) ^ table.values[(crc ^ static_cast<uint8_t>(data[pos])) & 0xff];
+    return crc;
+  }
+
+  inline uint16_t calc_crc(const std::string& data) {
+    uint16_t crc = update_crc(0xFFFF, data.data(), data.size());
     return (crc >> 8) | (crc << 8);
   }
 
+  /**
+   * \brief predict the size of a rtu frame from its first bytes
+   * \param data the start of the frame, beginning with the address
+   * \param available number of bytes available at data
+   * \param response if the frame is a response
+   * \return 0 if no supported frame can start here or its byte count exceeds the limit of the function, otherwise the number of bytes needed including the crc.
+   * If the length depends on a byte count which is not yet available, the size needed to read the byte count is returned.
+   */
+  inline size_t predict_rtu_size(const char* data, const size_t available, const bool response) {
+    if (available < 2)
+      return 2;
+    uint8_t function = static_cast<uint8_t>(data[1]);
+    const function_descriptor& desc = describe_function(function);
+    if (!desc.supported)
+      return 0;
+    if (function & 0x80)
+      return response ? 5 : 0;
+    const pdu_layout& layout = response ? desc.response : desc.request;
+    size_t size = 2 + layout.fixed + 2;
+    if (!layout.max_count)
+      return size;
+    if (available < (2u + layout.fixed))
+      return 2 + layout.fixed;
+    uint8_t count = static_cast<uint8_t>(data[1 + layout.fixed]);
+    if (count > layout.max_count)
+      return 0;
+    return size + count;
+  }
+
+  /**
+   * \brief serialize a packet into a complete frame
+   * \param packet the packet to serialize
+   * \param use_tcp_format prepend a MBAP header instead of appending the rtu crc
+   * \return the frame
+   */
+  template <typename packet_type> std::string serialize_frame(const packet_type& packet, const bool use_tcp_format) {
+    std::string output;
+    std::string content = serialize_single_packet<packet_type>(packet);
+    if (use_tcp_format) {
+      output.append(set_u16(packet.transaction_id));
+      output.append(set_u16(0));
+      output.append(set_u16(content.size() + 2));
+      output.append(set_u8(packet.address));
+      output.append(set_u8((uint8_t)packet.function));
+      output.append(content);
+    } else {
+      output.append(set_u8(packet.address));
+      output.append(set_u8((uint8_t)packet.function));
+      output.append(content);
+      output.append(set_u16(calc_crc(output)));
+    }
+    return output;
+  }
+
+  /**
+   * \brief Immutable pre-serialized frame for requests which are sent repeatedly
+   * The crc of rtu frames is calculated once, tcp frames only get their transaction id patched when sent.
+   */
+  class frame_template {
+  public:
+    /**
+     * \brief compile a packet into a template
+     * \param packet the packet to serialize
+     * \param use_tcp_format serialize with MBAP header instead of rtu crc
+     */
+    template <typename packet_type> frame_template(const packet_type& packet, const bool use_tcp_format) : frame_(serialize_frame(packet, use_tcp_format)), tcp_format_(use_tcp_format) {}
+
+    /**
+     * \brief the complete frame as compiled
+     */
+    const std::string& frame() const { return frame_; }
+
+    /**
+     * \brief if the frame was compiled in tcp format
+     */
+    bool tcp_format() const { return tcp_format_; }
+
+    /**
+     * \brief write the frame with a different transaction id into a buffer
+     * \param transaction_id the transaction id to use, ignored in rtu format
+     * \param output buffer to overwrite, reusing its memory
+     */
+    void stamp(const uint16_t transaction_id, std::string& output) const {
+      output.assign(frame_);
+      if (tcp_format_) {
+        output[0] = static_cast<char>(transaction_id >> 8);
+        output[1] = static_cast<char>(transaction_id & 0xff);
+      }
+    }
+
+  private:
+    const std::string frame_;
+    const bool tcp_format_;
+  };
+
+  /**
+   * \brief check if a device can stop reading with pause_receive(bool)
+   */
+  template <typename device_type, typename = void> struct has_pause_receive : std::false_type {};
+  template <typename device_type>
+  struct has_pause_receive<device_type, std::void_t<decltype(std::declval<device_type&>().pause_receive(true))>> : std::true_type {};
+
+  /**
+   * \brief check if a device can pass received data in batches with register_batch_handler
+   */
+  template <typename device_type, typename = void> struct has_batch_handler : std::false_type {};
+  template <typename device_type>
+  struct has_batch_handler<device_type, std::void_t<decltype(std::declval<device_type&>().register_batch_handler(std::function<void(const received_chunk*, size_t)>()))>>
+      : std::true_type {};
+
+  /**
+   * \brief a request and its response seen by a sniffer
+   */
+  struct sniffed_transaction {
+    /**
+     * \brief the request
+     */
+    single_packet request;
+    /**
+     * \brief the response, empty if the request was superseded without one
+     */
+    std::optional<single_packet> response;
+    /**
+     * \brief receive time of the request
+     */
+    int_least64_t request_time;
+    /**
+     * \brief receive time of the response, or of the superseding request
+     */
+    int_least64_t response_time;
+  };
+
   /**
    * \brief Class describing a single bus.
    * This could be a Modbus-TCP Connection or a Modbus-RTU Handle
@@ -42,13 +205,17 @@ namespace cbus {
      */
     bus(const std::weak_ptr<device_type> device, const config& cfg, const std::function<void(const single_packet&)> packet_emission)
         : device_(device), config_(cfg), packet_emission_(packet_emission) {
-      if ((!cfg.is_master) && (!cfg.use_tcp_format)) {
+      if ((!cfg.is_master) && (!cfg.use_tcp_format) && (!cfg.sniffer)) {
         throw std::domain_error("Cannot become RTU-Slave");
       }
       bus_valid_ = std::make_shared<bool>(true);
       init_bus_handler();
     }
-    ~bus() { *bus_valid_ = false; }
+    ~bus() {
+      *bus_valid_ = false;
+      if (config_.shared_budget)
+        config_.shared_budget->reserve(reserved_, 0);
+    }
 
     /**
      * \brief check if bus is still open
@@ -72,30 +239,185 @@ namespace cbus {
      */
     std::string error_string() const { return error_string_; }
 
+    /**
+     * \brief check if the bus uses the Modbus-TCP frame format
+     */
+    bool tcp_format() const { return config_.use_tcp_format; }
+
+    /**
+     * \brief pass several received chunks at once, e.g. from recvmmsg or an io_uring bundle
+     * \param chunks the chunks in receive order
+     * \param count number of chunks
+     * The silence timeout is checked with the timestamps of the chunks, config::now is only called once for chunks without one.
+     * The data is decoded in a single pass after the last chunk, or additionally before a chunk following a silence.
+     */
+    void feed_batch(const received_chunk* chunks, const size_t count) {
+      if (closed_)
+        return;
+      std::optional<int_least64_t> now;
+      bool received = false;
+      bool appended = false;
+      for (size_t i = 0; (i < count) && !closed_; i++) {
+        if (!chunks[i].size)
+          continue;
+        int_least64_t time = chunks[i].timestamp ? *chunks[i].timestamp : (now ? *now : *(now = config_.now()));
+        if (appended && ((time - last_byte_received_time_) > config_.silence_timeout)) {
+          decode();
+          appended = false;
+        }
+        check_silence(time, true);
+        if (!closed_)
+          append(chunks[i].data, chunks[i].size);
+        received = appended = true;
+      }
+      if (!received)
+        refresh_timeouts(false);
+      else if (!closed_)
+        decode();
+    }
+
+    /**
+     * \brief pass several received chunks at once
+     * \param chunks the chunks in receive order
+     */
+    void feed_batch(const std::vector<received_chunk>& chunks) { feed_batch(chunks.data(), chunks.size()); }
+
+    /**
+     * \brief stop decoding received data, e.g. while the queue behind the packet emission is full
+     * Devices providing pause_receive(bool) are told to stop reading. Data arriving anyway is kept within the receive budget and decoded on resume.
+     */
+    void pause_receive() {
+      paused_ = true;
+      pause_device(true);
+    }
+
+    /**
+     * \brief decode the data received while paused and continue receiving
+     */
+    void resume_receive() {
+      paused_ = false;
+      pause_device(false);
+      if (!closed_)
+        decode();
+    }
+
+    /**
+     * \brief check if receiving is paused
+     */
+    bool paused() const { return paused_; }
+
+    /**
+     * \brief number of received bytes not yet decoded
+     */
+    size_t buffered() const { return cache_.size(); }
+
+    /**
+     * \brief counters of received data dropped because of the receive budget
+     */
+    const receive_statistics& statistics() const { return stats_; }
+
+    /**
+     * \brief set a handler for register responses
+     * \param handler Callback receiving the header and a view over the registers still inside the receive buffer
+     * If set, read_holding_registers_response and read_input_registers_response are passed to this handler instead of the packet emission.
+     * No register vector is created for these packets. Pass an empty function to restore the normal behaviour.
+     */
+    void set_register_handler(const std::function<void(const packet&, const register_view&)> handler) { register_handler_ = handler; }
+
+    /**
+     * \brief set a handler for requests matched with their responses, only called in sniffer mode
+     * \param handler Callback receiving a request when its response arrives, or without response when the next request supersedes it
+     * Responses are matched by unit, function and transaction id. On a rtu line the next request supersedes any outstanding one,
+     * on a tcp stream a request with the same transaction id or the oldest one of more than max_sniffed_requests.
+     */
+    void set_transaction_handler(const std::function<void(const sniffed_transaction&)> handler) { transaction_handler_ = handler; }
+
+    /**
+     * \brief number of requests a sniffer keeps waiting for their response on a tcp stream
+     */
+    static constexpr size_t max_sniffed_requests = 64;
+
+    /**
+     * \brief set a typed handler for one packet type
+     * \param handler Callback receiving the decoded packet, an empty function removes it
+     * Packets with a typed handler are decoded directly into their type and not passed to the packet emission.
+     * If the packet emission is empty, packets without a typed handler are skipped after reading the header.
+     * A handler for error_response receives the exceptions of all function codes.
+     */
+    template <typename packet_type> void set_handler(const std::function<void(const packet_type&)>& handler) {
+      becker::bassert(!config_.sniffer, __FILE__, __LINE__, "a sniffer decodes both directions, use the packet emission");
+      becker::bassert(packet_traits<packet_type>::response == config_.is_master, __FILE__, __LINE__, "a master receives responses, a slave requests");
+      typed_handler entry;
+      if (handler)
+        entry = [handler](const packet& header, const std::string& content, uint_least64_t& size) {
+          std::optional<packet_type> out;
+          decode_status status = decode_single_packet<packet_type>(header, content, size, out);
+          if ((status == decode_status::ok) && (size == content.size()))
+            handler(*out);
+          return status;
+        };
+      if (std::is_same<packet_type, error_response>::value) {
+        for (size_t function = 0x81; function < typed_handlers_.size(); function++)
+          typed_handlers_[function] = entry;
+      } else
+        typed_handlers_[static_cast<uint8_t>(packet_traits<packet_type>::function)] = entry;
+    }
+
     /**
      * \brief send a packet
      * \param packet the packet to send
      * The resulting device->send call always receives excatly one complete package.
      */
-    template <typename packet_type> void send(const packet_type& packet) {
-      std::string output;
-      std::string content = serialize_single_packet<packet_type>(packet);
-      if (config_.use_tcp_format) {
-        output.append(set_u16(packet.transaction_id));
-        output.append(set_u16(0));
-        output.append(set_u16(content.size() + 2));
-        output.append(set_u8(packet.address));
-        output.append(set_u8((uint8_t)packet.function));
-        output.append(content);
-      } else {
-        output.append(set_u8(packet.address));
-        output.append(set_u8((uint8_t)packet.function));
-        output.append(serialize_single_packet<packet_type>(packet));
-        output.append(set_u16(calc_crc(output)));
+    template <typename packet_type> void send(const packet_type& packet) { send_frame(serialize(packet)); }
+
+    /**
+     * \brief send a pre-serialized request unchanged
+     * \param request the template to send, has to be compiled for this bus
+     */
+    void send(const frame_template& request) {
+      becker::bassert(request.tcp_format() == config_.use_tcp_format, __FILE__, __LINE__, "frame template compiled for other format");
+      send_frame(request.frame());
+    }
+
+    /**
+     * \brief send a pre-serialized request with a new transaction id
+     * \param request the template to send, has to be compiled for this bus
+     * \param transaction_id the transaction id to patch into the MBAP header, ignored for rtu
+     */
+    void send(const frame_template& request, const uint16_t transaction_id) {
+      becker::bassert(request.tcp_format() == config_.use_tcp_format, __FILE__, __LINE__, "frame template compiled for other format");
+      if (!config_.use_tcp_format) {
+        send_frame(request.frame());
+        return;
       }
+      request.stamp(transaction_id, send_buffer_);
+      send_frame(send_buffer_);
+    }
+
+    /**
+     * \brief compile a packet into a template for this bus
+     * \param packet the packet to compile
+     * \return template for repeated sends
+     */
+    template <typename packet_type> frame_template compile(const packet_type& packet) const { return frame_template(packet, config_.use_tcp_format); }
+
+    /**
+     * \brief serialize a packet into a complete frame for this bus
+     * \param packet the packet to serialize
+     * \return the frame as it would be passed to the device
+     * Only reads the config, so it may be called from any thread.
+     */
+    template <typename packet_type> std::string serialize(const packet_type& packet) const { return serialize_frame(packet, config_.use_tcp_format); }
+
+    /**
+     * \brief send already serialized data
+     * \param frames one complete frame, or several on a tcp bus
+     * The data is passed to the device in a single device->send call. Several rtu frames would lose their inter-frame gap.
+     */
+    void send_frame(const std::string& frames) {
       std::shared_ptr<device_type> device = device_.lock();
       if (device)
-        device->send(output);
+        device->send(frames);
     }
 
   private:
@@ -113,21 +435,132 @@ namespace cbus {
      * \brief Refresh timeouts
      * \param if the last receive time sould be updated
      */
-    void refresh_timeouts(const bool bytes_received) {
-      int_least64_t new_time = config_.now();
+    void refresh_timeouts(const bool bytes_received) { check_silence(config_.now(), bytes_received); }
+
+    /**
+     * \brief Check the silence timeout
+     * \param new_time the current time or the receive time of the data
+     * \param bytes_received if the last receive time sould be updated
+     */
+    void check_silence(const int_least64_t new_time, const bool bytes_received) {
       int_least64_t difference = new_time - last_byte_received_time_;
       if (bytes_received)
         last_byte_received_time_ = new_time;
-      if ((difference > config_.silence_timeout) && (cache_.size() > 0)) {
+      if ((difference > config_.silence_timeout) && (cache_.size() > 0) && !paused_) {
         if (config_.close_on_timeout) {
           close("timeout");
           return;
         } else {
-          cache_.clear();
+          discard_cache();
         }
       }
     }
 
+    /**
+     * \brief discard all received data and the decoder state
+     */
+    void discard_cache() {
+      cache_.clear();
+      cache_base_ = 0;
+      tcp_frame_size_ = 0;
+      rtu_next_candidate_ = 0;
+      rtu_candidates_ = decltype(rtu_candidates_)();
+      skip_ = 0;
+      if (config_.shared_budget)
+        reserved_ = config_.shared_budget->reserve(reserved_, 0);
+    }
+
+    /**
+     * \brief tell the device to stop or continue reading, if it supports it
+     */
+    void pause_device(const bool paused) {
+      if constexpr (has_pause_receive<device_type>::value) {
+        std::shared_ptr<device_type> device = device_.lock();
+        if (device)
+          device->pause_receive(paused);
+      }
+    }
+
+    /**
+     * \brief size of the tcp frame starting at an offset in cache_
+     * \return the size or 0 if its header is incomplete
+     */
+    size_t tcp_frame_at(const size_t offset) const {
+      if (cache_.size() < offset + 6)
+        return 0;
+      return 6 + std::max<size_t>(get_u16(__FILE__, __LINE__, cache_, offset + 4), 2);
+    }
+
+    /**
+     * \brief drop a tcp frame from cache_
+     * \param start offset of the frame, the rest of the frame is skipped when it arrives if it is incomplete
+     * \param frame size of the frame
+     */
+    void drop_tcp_frame(const size_t start, const size_t frame) {
+      size_t end = std::min(start + frame, cache_.size());
+      skip_ += start + frame - end;
+      stats_.frames_dropped++;
+      stats_.bytes_dropped += end - start;
+      cache_.erase(start, end - start);
+      if (start == 0)
+        tcp_frame_size_ = 0;
+    }
+
+    /**
+     * \brief apply the overflow policy until cache_ fits into a limit
+     */
+    void overflow(const size_t limit) {
+      stats_.overflows++;
+      if (config_.overflow == overflow_policy::close) {
+        stats_.bytes_dropped += cache_.size();
+        close("receive buffer overflow");
+        discard_cache();
+        return;
+      }
+      if (!config_.use_tcp_format) {
+        size_t drop = cache_.size() - limit;
+        stats_.bytes_dropped += drop;
+        if (config_.overflow == overflow_policy::drop_oldest_frame) {
+          cache_.erase(0, drop);
+          cache_base_ += drop;
+        } else {
+          cache_.resize(limit);
+          rtu_next_candidate_ = std::min(rtu_next_candidate_, cache_base_ + cache_.size());
+        }
+        return;
+      }
+      if (config_.overflow == overflow_policy::drop_oldest_frame) {
+        while (cache_.size() > limit)
+          drop_tcp_frame(0, tcp_frame_at(0));
+        return;
+      }
+      std::vector<size_t> starts;
+      for (size_t offset = 0, frame = 1; (offset < cache_.size()) && frame; offset += frame) {
+        starts.push_back(offset);
+        frame = tcp_frame_at(offset);
+      }
+      // a trailing fragment of a header is kept, it is needed to find the end of its frame
+      for (; (cache_.size() > limit) && !starts.empty(); starts.pop_back())
+        if (size_t frame = tcp_frame_at(starts.back()))
+          drop_tcp_frame(starts.back(), frame);
+    }
+
+    /**
+     * \brief keep cache_ within the receive budget and the shared budget
+     */
+    void enforce_budget() {
+      size_t limit = config_.receive_budget;
+      if (config_.shared_budget)
+        limit = std::min(limit, reserved_ = config_.shared_budget->reserve(reserved_, cache_.size()));
+      // the start of a tcp header is always kept to stay in sync with the stream
+      if (config_.use_tcp_format)
+        limit = std::max<size_t>(limit, 8);
+      if (cache_.size() > limit)
+        overflow(limit);
+      if (config_.shared_budget)
+        reserved_ = config_.shared_budget->reserve(reserved_, cache_.size());
+    }
+
     /**
      * \register the receive handler into the bus
      */
@@ -139,79 +572,127 @@ namespace cbus {
           if (*bus_valid)
             feed(data);
         });
+      if constexpr (has_batch_handler<device_type>::value) {
+        if (device)
+          device->register_batch_handler([bus_valid, this](const received_chunk* chunks, const size_t count) {
+            if (*bus_valid)
+              feed_batch(chunks, count);
+          });
+      }
     }
 
     /**
      * \brief parse a single packet
      * \param header the header of the packet
      * \param conhtent the content to use
+     * \param response decode the packet as response instead of request
      */
-    single_packet parse_packet(const packet& header, const std::string& content, uint_least64_t& size) {
-      if (config_.is_master) {
-        if (static_cast<uint8_t>(header.function) & 0x80) {
-          cbus::function_code fc = static_cast<cbus::function_code>(static_cast<uint8_t>(header.function) & 0x7f);
-          if ((fc == function_code::read_coils) || (fc == function_code::read_holding_registers) || (fc == function_code::write_holding_registers) ||
-              (fc == function_code::write_single_holding_register) || (fc == function_code::write_single_holding_register_devaddr) || (fc == function_code::read_input_registers)) {
-            size = 1;
-            if (content.size())
-              return error_response(header, static_cast<error_code>(content.at(0)));
-            else
-              return packet_error(header);
-          }
-        }
-        switch (header.function) {
-        case function_code::read_coils:
-          return parse_single_packet<read_coils_response>(header, content, size);
-        case function_code::read_holding_registers:
-          return parse_single_packet<read_holding_registers_response>(header, content, size);
-        case function_code::write_holding_registers:
-          return parse_single_packet<write_holding_registers_response>(header, content, size);
-        case function_code::write_single_holding_register:
-          return parse_single_packet<write_single_holding_register_response>(header, content, size);
-        case function_code::write_single_holding_register_devaddr:
-          return parse_single_packet<write_single_holding_register_devaddr_response>(header, content, size);
-        case function_code::read_input_registers:
-          return parse_single_packet<read_input_registers_response>(header, content, size);
-        default:
+    single_packet parse_packet(const packet& header, const std::string& content, uint_least64_t& size, const bool response) {
+      uint8_t function = static_cast<uint8_t>(header.function);
+      const function_descriptor& desc = describe_function(function);
+      if (!desc.supported)
+        return packet_error(header);
+      if (function & 0x80) {
+        if (!response)
           return packet_error(header);
-        }
-      } else {
-        switch (header.function) {
-        case function_code::read_coils:
-          return parse_single_packet<read_coils_request>(header, content, size);
-        case function_code::read_input_registers:
-          return parse_single_packet<read_input_registers_request>(header, content, size);
-        case function_code::read_holding_registers:
-          return parse_single_packet<read_holding_registers_request>(header, content, size);
-        case function_code::write_holding_registers:
-          return parse_single_packet<write_holding_registers_request>(header, content, size);
-        case function_code::write_single_holding_register:
-          return parse_single_packet<write_single_holding_register_request>(header, content, size);
-        case function_code::write_single_holding_register_devaddr:
-          return parse_single_packet<write_single_holding_register_devaddr_request>(header, content, size);
-        default:
+        size = 1;
+        if (content.size())
+          return error_response(header, static_cast<error_code>(content.at(0)));
+        else
           return packet_error(header);
-        }
       }
-      return packet_error(header);
+      return (response ? desc.response.parse : desc.request.parse)(header, content, size);
+    }
+
+    /**
+     * \brief check if a packet is a response
+     * \param header the header of the packet
+     * A sniffer takes a packet as response if it matches an outstanding request.
+     */
+    bool receives_response(const packet& header) { return config_.sniffer ? (find_sniffed_request(header) != sniffed_requests_.end()) : config_.is_master; }
+
+    /**
+     * \brief check if a packet for an address is processed
+     */
+    bool accepts_address(const uint8_t address) const { return config_.is_master || config_.sniffer || (address == config_.address) || !config_.address; }
+
+    /**
+     * \brief check if a packet should be passed to the register handler
+     * \param header the header of the packet
+     */
+    bool is_streamed(const packet& header) const {
+      return register_handler_ && config_.is_master && !config_.sniffer &&
+             ((header.function == function_code::read_holding_registers) || (header.function == function_code::read_input_registers));
+    }
+
+    /**
+     * \brief check if a packet has to be decoded, because it passes the filter and anybody receives it
+     * \param header the header of the packet
+     */
+    bool is_wanted(const packet& header) const {
+      uint8_t function = static_cast<uint8_t>(header.function);
+      return config_.filter.allows(header.address, function) && (packet_emission_ || transaction_handler_ || typed_handlers_[function] || is_streamed(header));
+    }
+
+    /**
+     * \brief decode a packet with its typed handler
+     * \param header the header of the packet
+     * \param content the content, the handler is only called if it is decoded completely
+     * \param size set to the decoded size
+     * \return the status or nothing if there is no typed handler
+     */
+    std::optional<decode_status> decode_typed(const packet& header, const std::string& content, uint_least64_t& size) {
+      const typed_handler& handler = typed_handlers_[static_cast<uint8_t>(header.function)];
+      if (!handler)
+        return std::nullopt;
+      return handler(header, content, size);
     }
 
     /**
      * \brief process single received tcp packet
      * \param pkg the header
      * \param content content string
+     * \param response decode the packet as response instead of request
      * \return true to continue, false to abort reading
      */
-    bool process_received_tcp_packet(const packet& pkg, const std::string& content) {
+    bool process_received_tcp_packet(const packet& pkg, const std::string& content, const bool response) {
       uint_least64_t read_size = 0;
-      if (config_.is_master || (pkg.address == config_.address) || !config_.address) {
-        single_packet result = parse_packet(pkg, content, read_size);
+      if (accepts_address(pkg.address)) {
+        register_view registers;
+        if (is_streamed(pkg) && find_register_payload(content, read_size, registers)) {
+          if (read_size != content.size()) {
+            close("not enough data read: " + std::to_string(read_size) + "/" + std::to_string(content.size()));
+            return false;
+          }
+          register_handler_(pkg, registers);
+          return true;
+        }
+        if (std::optional<decode_status> status = decode_typed(pkg, content, read_size)) {
+          if (*status == decode_status::not_enough_data)
+            return false;
+          if (*status != decode_status::ok) {
+            if (config_.close_on_error) {
+              close("packet error");
+              return false;
+            }
+            if (packet_emission_)
+              packet_emission_(packet_error(pkg));
+            return true;
+          }
+          if (read_size != content.size()) {
+            close("not enough data read: " + std::to_string(read_size) + "/" + std::to_string(content.size()));
+            return false;
+          }
+          return true;
+        }
+        single_packet result = parse_packet(pkg, content, read_size, response);
         if (std::holds_alternative<packet_error>(result)) {
           if (config_.close_on_error) {
             close("packet error");
             return false;
           } else {
-            packet_emission_(result);
+            if (packet_emission_)
+              packet_emission_(result);
             return true;
           }
         }
@@ -222,82 +703,263 @@ namespace cbus {
           close("not enough data read: " + std::to_string(read_size) + "/" + std::to_string(content.size()));
           return false;
         }
-        packet_emission_(result);
+        if (config_.sniffer)
+          sniffed(pkg, response, result, -1);
+        if (packet_emission_)
+          packet_emission_(result);
       }
       return true;
     }
 
     /**
      * \brief extract single received tcp packet
+     * \param offset position of the frame in cache_, moved behind the frame if it was complete
      * \return true to continue, false to abort reading
+     * The MBAP header is only parsed once per frame, even if the frame arrives in several chunks.
      */
-    bool extract_single_tcp_packet() {
-      if (cache_.size() < 8)
-        return false;
-      uint16_t transaction_id = get_u16(__FILE__, __LINE__, cache_, 0);
-      uint16_t protocol_id = get_u16(__FILE__, __LINE__, cache_, 2);
-      if (protocol_id != 0) {
-        close("invalid protocol id");
-        return false;
+    bool extract_single_tcp_packet(size_t& offset) {
+      size_t available = cache_.size() - offset;
+      if (!tcp_frame_size_) {
+        if (available < 8)
+          return false;
+        uint16_t transaction_id = get_u16(__FILE__, __LINE__, cache_, offset);
+        uint16_t protocol_id = get_u16(__FILE__, __LINE__, cache_, offset + 2);
+        if (protocol_id != 0) {
+          close("invalid protocol id");
+          return false;
+        }
+        uint16_t length = get_u16(__FILE__, __LINE__, cache_, offset + 4);
+        if (length < 2) {
+          close("invalid length");
+          return false;
+        }
+        uint8_t address = cache_.at(offset + 6);
+        function_code function = (function_code)cache_.at(offset + 7);
+        tcp_header_.emplace(transaction_id, address, function);
+        tcp_frame_size_ = 6 + length;
       }
-      uint16_t length = get_u16(__FILE__, __LINE__, cache_, 4);
-      if (length < 2) {
-        close("invalid length");
+      if (available < tcp_frame_size_)
         return false;
+      const bool response = receives_response(*tcp_header_);
+      if (!is_wanted(*tcp_header_)) {
+        if (config_.sniffer)
+          sniffed(*tcp_header_, response, std::nullopt, -1);
+        offset += tcp_frame_size_;
+        tcp_frame_size_ = 0;
+        return true;
       }
-      length -= 2;
-      uint8_t address = cache_.at(6);
-      function_code function = (function_code)cache_.at(7);
-      packet pkg(transaction_id, address, function);
-      if (cache_.size() < (length + 8))
-        return false;
-      std::string content = cache_.substr(8, length);
-      cache_ = cache_.substr(8 + length);
-      if (!process_received_tcp_packet(pkg, content))
+      std::string content = cache_.substr(offset + 8, tcp_frame_size_ - 8);
+      offset += tcp_frame_size_;
+      tcp_frame_size_ = 0;
+      if (config_.sniffer) {
+        process_sniffed_tcp_packet(*tcp_header_, content, response);
+        return true;
+      }
+      if (!process_received_tcp_packet(*tcp_header_, content, response))
         return false;
       return true;
     }
 
     /**
-     * \brief process single received tcp packet
+     * \brief decode a tcp packet seen by a sniffer in either direction
      * \param pkg the header
-     * \param content content string
-     * \return true to continue, false to abort reading
+     * \param content content string, complete as given by the MBAP length
+     * \param response if the packet matches an outstanding request, it is decoded as response first
+     * A sniffer may attach mid-stream or see a request repeated with the same transaction id, so a packet not fitting the
+     * expected direction is decoded in the other one. A packet fitting neither is skipped and passed as packet_error.
+     */
+    void process_sniffed_tcp_packet(const packet& pkg, const std::string& content, const bool response) {
+      for (const bool direction : {response, !response}) {
+        uint_least64_t read_size = 0;
+        single_packet result = parse_packet(pkg, content, read_size, direction);
+        if (std::holds_alternative<packet_error>(result) || std::holds_alternative<not_enough_data>(result) || (read_size != content.size()))
+          continue;
+        sniffed(pkg, direction, result, -1);
+        if (packet_emission_)
+          packet_emission_(result);
+        return;
+      }
+      if (packet_emission_)
+        packet_emission_(packet_error(pkg));
+    }
+
+    /**
+     * \brief result of checking a possible rtu frame start
+     */
+    enum class rtu_candidate { rejected, incomplete, accepted };
+
+    /**
+     * \brief check if a rtu frame starts at a position in the received data
+     * \param position absolute position of the possible frame start
+     * \param needed set to the absolute position the received data has to reach before checking again
+     * \return if the frame was rejected, is incomplete or was accepted and emitted
      */
-    uint_fast64_t process_received_rtu_packet(const packet& pkg, std::string cache_) {
+    rtu_candidate check_rtu_candidate(const uint_least64_t position, uint_least64_t& needed) {
+      const size_t offset = position - cache_base_;
+      const size_t available = cache_.size() - offset;
+      const char* data = cache_.data() + offset;
+      size_t size = predict_rtu_size(data, available, config_.is_master);
+      if (!size)
+        return rtu_candidate::rejected;
+      if (available < size) {
+        needed = position + size;
+        return rtu_candidate::incomplete;
+      }
+      packet pkg(0, static_cast<uint8_t>(data[0]), static_cast<function_code>(static_cast<uint8_t>(data[1])));
+      if (!accepts_address(pkg.address))
+        return rtu_candidate::rejected;
+      uint16_t crc = update_crc(0xFFFF, data, size - 2);
+      if (static_cast<uint16_t>((crc >> 8) | (crc << 8)) != get_u16(__FILE__, __LINE__, cache_, offset + size - 2))
+        return rtu_candidate::rejected;
+      needed = position + size;
+      if (!is_wanted(pkg))
+        return rtu_candidate::accepted;
       uint_least64_t read_size = 0;
-      if (config_.is_master || (pkg.address == config_.address) || !config_.address) {
-        single_packet result = parse_packet(pkg, cache_.substr(2), read_size);
-        if (std::holds_alternative<packet_error>(result)) {
-          return 0;
-        }
-        if (std::holds_alternative<not_enough_data>(result)) {
-          return 0;
-        }
-        if (cache_.size() < (2 + read_size + 2)) {
-          return 0;
+      std::string content = cache_.substr(offset + 2, size - 4);
+      register_view registers;
+      if (is_streamed(pkg) && find_register_payload(content, read_size, registers)) {
+        if (read_size != content.size())
+          return rtu_candidate::rejected;
+        register_handler_(pkg, registers);
+      } else if (std::optional<decode_status> status = decode_typed(pkg, content, read_size)) {
+        if ((*status != decode_status::ok) || (read_size != content.size()))
+          return rtu_candidate::rejected;
+      } else {
+        single_packet result = parse_packet(pkg, content, read_size, config_.is_master);
+        if (std::holds_alternative<packet_error>(result) || std::holds_alternative<not_enough_data>(result) || (read_size != content.size()))
+          return rtu_candidate::rejected;
+        if (packet_emission_)
+          packet_emission_(result);
+      }
+      return rtu_candidate::accepted;
+    }
+
+    /**
+     * \brief check if a rtu frame in either direction starts at a position in the received data
+     * \param position absolute position of the possible frame start
+     * \param needed set to the absolute position the received data has to reach before checking again
+     * \return if the frame was rejected, is incomplete or was accepted and emitted
+     * A frame matching the outstanding request is checked as response first, its byte count has to fit the request.
+     * A complete frame in one direction is taken even if the other direction would need more data, so an unanswered request
+     * followed by the next one is not held back by a response length predicted from the wrong bytes.
+     */
+    rtu_candidate check_sniffed_rtu_candidate(const uint_least64_t position, uint_least64_t& needed) {
+      const size_t offset = position - cache_base_;
+      const size_t available = cache_.size() - offset;
+      const char* data = cache_.data() + offset;
+      if (available < 2) {
+        needed = position + 2;
+        return rtu_candidate::incomplete;
+      }
+      packet pkg(0, static_cast<uint8_t>(data[0]), static_cast<function_code>(static_cast<uint8_t>(data[1])));
+      auto outstanding = find_sniffed_request(pkg);
+      needed = 0;
+      for (const bool response : {true, false}) {
+        if (response && (outstanding == sniffed_requests_.end()))
+          continue;
+        size_t size = predict_rtu_size(data, available, response);
+        if (!size)
+          continue;
+        if (available < size) {
+          needed = needed ? std::min<uint_least64_t>(needed, position + size) : position + size;
+          continue;
         }
-        uint16_t read_crc = get_u16(__FILE__, __LINE__, cache_, 2 + read_size);
-        if (read_crc != calc_crc(cache_.substr(0, 2 + read_size))) {
-          return 0;
+        if (response && !(static_cast<uint8_t>(data[1]) & 0x80) && (outstanding->byte_count >= 0) && (static_cast<uint8_t>(data[2]) != outstanding->byte_count))
+          continue;
+        uint16_t crc = update_crc(0xFFFF, data, size - 2);
+        if (static_cast<uint16_t>((crc >> 8) | (crc << 8)) != get_u16(__FILE__, __LINE__, cache_, offset + size - 2))
+          continue;
+        std::string content = cache_.substr(offset + 2, size - 4);
+        std::optional<single_packet> result;
+        if (is_wanted(pkg)) {
+          uint_least64_t read_size = 0;
+          result.emplace(parse_packet(pkg, content, read_size, response));
+          if (std::holds_alternative<packet_error>(*result) || std::holds_alternative<not_enough_data>(*result) || (read_size != content.size()))
+            continue;
         }
-        packet_emission_(result);
-        return 2 + read_size + 2;
+        needed = position + size;
+        sniffed(pkg, response, result, response ? -1 : expected_byte_count(pkg, content));
+        if (result && packet_emission_)
+          packet_emission_(*result);
+        return rtu_candidate::accepted;
       }
-      return 0;
+      return needed ? rtu_candidate::incomplete : rtu_candidate::rejected;
     }
 
     /**
-     * \brief extract single received rtu packet
-     * \return true to continue, false to abort reading
+     * \brief byte count of the response to a request, -1 if the response has none or the request is too short
      */
-    bool extract_single_rtu_packet(std::string cache_) {
-      if (cache_.size() < 2)
-        return false;
-      uint8_t address = cache_.at(0);
-      function_code function = (function_code)cache_.at(1);
-      packet pkg(0, address, function);
-      return process_received_rtu_packet(pkg, cache_);
+    static int expected_byte_count(const packet& header, const std::string& content) {
+      if (content.size() < 4)
+        return -1;
+      int count = get_u16(__FILE__, __LINE__, content, 2);
+      switch (header.function) {
+      case function_code::read_coils:
+      case function_code::read_discrete_inputs:
+        return (count + 7) / 8;
+      case function_code::read_holding_registers:
+      case function_code::read_input_registers:
+      case function_code::read_write_registers:
+        return 2 * count;
+      default:
+        return -1;
+      }
+    }
+
+    /**
+     * \brief request seen by a sniffer, waiting for its response
+     */
+    struct sniffed_request {
+      packet header;
+      int byte_count;
+      int_least64_t time;
+      /**
+       * \brief the decoded request, empty if nobody receives it
+       */
+      std::optional<single_packet> request;
+    };
+
+    /**
+     * \brief find the outstanding request a packet answers
+     */
+    typename std::list<sniffed_request>::iterator find_sniffed_request(const packet& header) {
+      uint8_t function = static_cast<uint8_t>(header.function) & 0x7f;
+      return std::find_if(sniffed_requests_.begin(), sniffed_requests_.end(), [&header, function](const sniffed_request& r) {
+        return (r.header.transaction_id == header.transaction_id) && (r.header.address == header.address) && (static_cast<uint8_t>(r.header.function) == function);
+      });
+    }
+
+    /**
+     * \brief drop an outstanding request, passing it without response to the transaction handler
+     */
+    typename std::list<sniffed_request>::iterator supersede(const typename std::list<sniffed_request>::iterator it) {
+      if (it->request && transaction_handler_)
+        transaction_handler_(sniffed_transaction{*it->request, std::nullopt, it->time, last_byte_received_time_});
+      return sniffed_requests_.erase(it);
+    }
+
+    /**
+     * \brief track a packet decoded by a sniffer and pass completed transactions to the transaction handler
+     * \param header the header of the packet
+     * \param response if the packet is a response, its request may not have been seen
+     * \param result the decoded packet, empty if nobody receives it
+     * \param byte_count byte count of the expected response, -1 if unknown
+     */
+    void sniffed(const packet& header, const bool response, std::optional<single_packet> result, const int byte_count) {
+      if (response) {
+        auto it = find_sniffed_request(header);
+        if (it == sniffed_requests_.end())
+          return;
+        if (it->request && transaction_handler_)
+          transaction_handler_(sniffed_transaction{*it->request, std::move(result), it->time, last_byte_received_time_});
+        sniffed_requests_.erase(it);
+        return;
+      }
+      for (auto it = sniffed_requests_.begin(); it != sniffed_requests_.end();)
+        it = (!config_.use_tcp_format || (it->header.transaction_id == header.transaction_id)) ? supersede(it) : std::next(it);
+      if (sniffed_requests_.size() >= max_sniffed_requests)
+        supersede(sniffed_requests_.begin());
+      sniffed_requests_.push_back(sniffed_request{header, byte_count, last_byte_received_time_, std::move(result)});
     }
 
     /**
@@ -306,29 +968,45 @@ namespace cbus {
     void read_tcp_packets() {
       becker::bassert(config_.use_tcp_format, __FILE__, __LINE__, "calling tcp in rtu mode");
       becker::bassert(cache_.size() > 0, __FILE__, __LINE__, "cache empty");
-      while (cache_.size() > 0) {
-        if (!extract_single_tcp_packet())
+      size_t offset = 0;
+      while (offset < cache_.size()) {
+        if (!extract_single_tcp_packet(offset))
           break;
       }
+      if (!closed_)
+        cache_.erase(0, offset);
     }
 
     /**
      * \brief Read all available rtu packets
+     * Every position in the received data is a possible frame start. Each one is only checked again once enough data for the next step arrived,
+     * so feeding a frame in small chunks does not rescan the whole cache.
      */
     void read_rtu_packets() {
       becker::bassert(!config_.use_tcp_format, __FILE__, __LINE__, "calling rtu in tcp mode");
       becker::bassert(cache_.size() > 0, __FILE__, __LINE__, "cache empty");
-      while (true) {
-        bool found = false;
-        for (uint_fast64_t offset = 0; offset < cache_.size(); offset++) {
-          uint_fast64_t read_offset = extract_single_rtu_packet(cache_.substr(offset));
-          if (read_offset) {
-            cache_ = cache_.substr(offset + read_offset);
-            found = true;
-          }
-        }
-        if (!found)
+      const uint_least64_t received = cache_base_ + cache_.size();
+      if (rtu_next_candidate_ < cache_base_)
+        rtu_next_candidate_ = cache_base_;
+      for (; rtu_next_candidate_ < received; rtu_next_candidate_++)
+        rtu_candidates_.emplace(rtu_next_candidate_ + 2, rtu_next_candidate_);
+      while (!rtu_candidates_.empty() && (rtu_candidates_.top().first <= received) && !closed_) {
+        uint_least64_t position = rtu_candidates_.top().second;
+        rtu_candidates_.pop();
+        if (position < cache_base_)
+          continue;
+        uint_least64_t needed = 0;
+        switch (config_.sniffer ? check_sniffed_rtu_candidate(position, needed) : check_rtu_candidate(position, needed)) {
+        case rtu_candidate::rejected:
           break;
+        case rtu_candidate::incomplete:
+          rtu_candidates_.emplace(needed, position);
+          break;
+        case rtu_candidate::accepted:
+          cache_.erase(0, needed - cache_base_);
+          cache_base_ = needed;
+          break;
+        }
       }
     }
 
@@ -342,24 +1020,57 @@ namespace cbus {
       refresh_timeouts(data.size() > 0);
       if (closed_)
         return;
-      cache_.append(data);
-      if (cache_.size() > 8192) //! TODO: Config
-        cache_ = cache_.substr(cache_.size() - 8192);
-      if (cache_.size() > 0) {
+      append(data.data(), data.size());
+      decode();
+    }
+
+    /**
+     * \brief append received data to the cache, skipping the rest of a dropped frame
+     */
+    void append(const char* data, const size_t size) {
+      size_t skipped = std::min(skip_, size);
+      skip_ -= skipped;
+      stats_.bytes_dropped += skipped;
+      cache_.append(data + skipped, size - skipped);
+    }
+
+    /**
+     * \brief decode the received data unless paused, the rest is kept within the budget
+     */
+    void decode() {
+      if (!paused_ && (cache_.size() > 0)) {
         if (config_.use_tcp_format)
           read_tcp_packets();
         else
           read_rtu_packets();
       }
+      if (!closed_)
+        enforce_budget();
     }
 
     std::string cache_;
+    uint_least64_t cache_base_ = 0;
+    size_t tcp_frame_size_ = 0;
+    std::optional<packet> tcp_header_;
+    uint_least64_t rtu_next_candidate_ = 0;
+    std::priority_queue<std::pair<uint_least64_t, uint_least64_t>, std::vector<std::pair<uint_least64_t, uint_least64_t>>, std::greater<std::pair<uint_least64_t, uint_least64_t>>>
+        rtu_candidates_;
+    size_t skip_ = 0;
+    size_t reserved_ = 0;
+    bool paused_ = false;
+    receive_statistics stats_;
     bool closed_ = false;
     std::shared_ptr<bool> bus_valid_;
     std::weak_ptr<device_type> device_;
     config config_;
     int_least64_t last_byte_received_time_;
     std::string error_string_;
+    std::string send_buffer_;
     const std::function<void(const single_packet&)> packet_emission_;
+    std::function<void(const packet&, const register_view&)> register_handler_;
+    using typed_handler = std::function<decode_status(const packet&, const std::string&, uint_least64_t&)>;
+    std::array<typed_handler, 256> typed_handlers_;
+    std::function<void(const sniffed_transaction&)> transaction_handler_;
+    std::list<sniffed_request> sniffed_requests_;
   };
 } // namespace cbus
@@ -2,6 +2,18 @@
 
 #include "becker.hpp"
 #include "bus.hpp"
+#include "interval_set.hpp"
+#include "poll_controller.hpp"
+#include "rtu_scheduler.hpp"
+#include "response_cache.hpp"
+#include "send_queue.hpp"
+#include "snapshot.hpp"
+#include "spsc_queue.hpp"
+#include "timeseries.hpp"
+#include "trace_analyzer.hpp"
+#include "unit_mux.hpp"
+#include "values.hpp"
+#include "write_combiner.hpp"
 #include <functional>
 #include <memory>
 #include <string>
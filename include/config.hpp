@@ -1,12 +1,148 @@
 #pragma once
 
 #include "becker.hpp"
+#include <algorithm>
+#include <atomic>
+#include <bitset>
 #include <functional>
 #include <memory>
 #include <string>
 #include <variant>
 
 namespace cbus {
+  /**
+   * \brief allow list of units and function codes, checked on the raw header before a frame is decoded
+   * Error responses pass if their function code passes.
+   */
+  class packet_filter {
+  public:
+    /**
+     * \brief construct new filter letting everything pass
+     */
+    packet_filter() {
+      units_.set();
+      functions_.set();
+    }
+
+    /**
+     * \brief block all units and function codes, allow the wanted ones afterwards
+     */
+    packet_filter& block_all() {
+      units_.reset();
+      functions_.reset();
+      return *this;
+    }
+
+    /**
+     * \brief let frames of a unit pass
+     * \param unit the unit id
+     */
+    packet_filter& allow_unit(const uint8_t unit) {
+      units_.set(unit);
+      return *this;
+    }
+
+    /**
+     * \brief let frames with a function code pass
+     * \param function the function code
+     */
+    packet_filter& allow_function(const uint8_t function) {
+      functions_.set(function & 0x7f);
+      return *this;
+    }
+
+    /**
+     * \brief check a header
+     * \param unit the unit id of the frame
+     * \param function the function code of the frame
+     * \return if the frame has to be decoded
+     */
+    bool allows(const uint8_t unit, const uint8_t function) const { return units_.test(unit) && functions_.test(function & 0x7f); }
+
+  private:
+    std::bitset<256> units_;
+    std::bitset<128> functions_;
+  };
+
+  /**
+   * \brief what a bus does when received data exceeds its budget
+   */
+  enum class overflow_policy {
+    /**
+     * \brief close the bus
+     */
+    close,
+    /**
+     * \brief drop the oldest frames, for rtu the oldest bytes as frames are not known before they are complete
+     */
+    drop_oldest_frame,
+    /**
+     * \brief drop the newest frames, for rtu the newest bytes
+     */
+    drop_newest
+  };
+
+  /**
+   * \brief counters of dropped received data
+   */
+  struct receive_statistics {
+    /**
+     * \brief number of times the budget was exceeded
+     */
+    uint_least64_t overflows = 0;
+    /**
+     * \brief number of dropped frames, only counted for tcp
+     */
+    uint_least64_t frames_dropped = 0;
+    /**
+     * \brief number of dropped bytes, including the rest of dropped frames received later
+     */
+    uint_least64_t bytes_dropped = 0;
+  };
+
+  /**
+   * \brief memory budget shared by several buses, thread safe
+   */
+  class memory_budget {
+  public:
+    /**
+     * \brief construct new budget
+     * \param limit number of bytes all buses together may keep
+     */
+    explicit memory_budget(const size_t limit) : limit_(limit) {}
+
+    /**
+     * \brief change a reservation
+     * \param reserved the number of bytes currently reserved by the caller
+     * \param wanted the number of bytes the caller wants to have reserved
+     * \return the new reservation, less than wanted if the budget is exhausted
+     */
+    size_t reserve(const size_t reserved, const size_t wanted) {
+      size_t used = used_.load(std::memory_order_relaxed);
+      size_t granted;
+      size_t others;
+      do {
+        others = used - reserved;
+        granted = std::min(wanted, (limit_ > others) ? limit_ - others : 0);
+      } while (!used_.compare_exchange_weak(used, others + granted, std::memory_order_relaxed));
+      return granted;
+    }
+
+    /**
+     * \brief number of reserved bytes
+     */
+    size_t used() const { return used_.load(std::memory_order_relaxed); }
+
+    /**
+     * \brief the limit
+     */
+    size_t limit() const { return limit_; }
+
+  private:
+    const size_t limit_;
+    std::atomic<size_t> used_{0};
+  };
+
   /**
    * \brief a modbus bus config
    */
@@ -36,6 +172,12 @@ namespace cbus {
      */
     bool is_master = false;
 
+    /**
+     * \brief Passively decode requests and responses of a shared line or mirrored port, is_master and address are ignored then
+     * A sniffer never closes because of a frame it can not decode in the expected direction, it skips the frame instead.
+     */
+    bool sniffer = false;
+
     /**
      * \brief address of this node
      */
@@ -45,5 +187,25 @@ namespace cbus {
      * \brief Close socket if any kind of error occurs
      */
     bool close_on_error=false;
+
+    /**
+     * \brief Frames not passing the filter are skipped without decoding, in master and slave mode
+     */
+    packet_filter filter;
+
+    /**
+     * \brief Bytes of received data a bus keeps while waiting for the rest of a frame or while receiving is paused
+     */
+    size_t receive_budget = 8192;
+
+    /**
+     * \brief What to do if the received data exceeds the budget
+     */
+    overflow_policy overflow = overflow_policy::drop_oldest_frame;
+
+    /**
+     * \brief Optional budget shared with other buses, limiting the received data of all of them in addition
+     */
+    std::shared_ptr<memory_budget> shared_budget;
   };
 } // namespace cbus
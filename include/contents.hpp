@@ -7,6 +7,7 @@
 #include <memory>
 #include <string.h>
 #include <string>
+#include <type_traits>
 #include <variant>
 
 namespace cbus {
@@ -334,6 +335,279 @@ namespace cbus {
     uint16_t register_value;
   };
 
+  /**
+   * \brief request for function code 2 read discrete inputs
+   */
+  struct read_discrete_inputs_request : packet {
+    /**
+     * \brief create new discrete inputs request
+     * \param transaction_id The id of the transaction
+     * \param address The address of the target
+     * \param first_input index of the first input
+     * \param input_count number of inputs to read
+     */
+    read_discrete_inputs_request(const uint16_t transaction_id, uint8_t address, uint16_t first_input, uint16_t input_count)
+        : packet(transaction_id, address, function_code::read_discrete_inputs), first_input(first_input), input_count(input_count) {}
+    /**
+     * \brief construct new read_discrete_inputs_request
+     * \param header containing header stuff
+     * \param first_input index of the first input
+     * \param input_count number of inputs to read
+     */
+    read_discrete_inputs_request(const packet& header, const uint16_t first_input, const uint16_t input_count) : packet(header), first_input(first_input), input_count(input_count) {}
+    /**
+     * \brief First input index
+     */
+    uint16_t first_input;
+    /**
+     * \brief Number of inputs
+     */
+    uint16_t input_count;
+  };
+
+  /**
+   * \brief response for function code 2 read discrete inputs
+   */
+  struct read_discrete_inputs_response : packet {
+    /**
+     * \brief create new discrete inputs response
+     * \param transaction_id The id of the transaction
+     * \param address The address of the target
+     * \param input_data The content, padded to whole bytes when received
+     */
+    read_discrete_inputs_response(const uint16_t transaction_id, uint8_t address, std::vector<bool> input_data)
+        : packet(transaction_id, address, function_code::read_discrete_inputs), input_data(input_data) {}
+    /**
+     * \brief construct new read_discrete_inputs_response
+     * \param header containing header stuff
+     * \param input_data the state of the inputs
+     */
+    read_discrete_inputs_response(const packet& header, std::vector<bool> input_data) : packet(header), input_data(input_data) {}
+    /**
+     * \brief the state of the inputs
+     */
+    std::vector<bool> input_data;
+  };
+
+  /**
+   * \brief request for function code 5 write single coil
+   */
+  struct write_single_coil_request : packet {
+    /**
+     * \brief create new single coil request
+     * \param transaction_id The id of the transaction
+     * \param address The address of the target
+     * \param coil_index index of the coil
+     * \param coil_value the value to write
+     */
+    write_single_coil_request(const uint16_t transaction_id, uint8_t address, uint16_t coil_index, bool coil_value)
+        : packet(transaction_id, address, function_code::write_single_coil), coil_index(coil_index), coil_value(coil_value) {}
+    /**
+     * \brief construct new write_single_coil_request
+     * \param header containing header stuff
+     * \param coil_index index of the coil
+     * \param coil_value the value to write
+     */
+    write_single_coil_request(const packet& header, uint16_t coil_index, bool coil_value) : packet(header), coil_index(coil_index), coil_value(coil_value) {}
+    uint16_t coil_index;
+    bool coil_value;
+  };
+
+  /**
+   * \brief response for function code 5 write single coil, an echo of the request
+   */
+  struct write_single_coil_response : packet {
+    /**
+     * \brief create new single coil response
+     * \param transaction_id The id of the transaction
+     * \param address The address of the target
+     * \param coil_index index of the coil
+     * \param coil_value the written value
+     */
+    write_single_coil_response(const uint16_t transaction_id, uint8_t address, uint16_t coil_index, bool coil_value)
+        : packet(transaction_id, address, function_code::write_single_coil), coil_index(coil_index), coil_value(coil_value) {}
+    /**
+     * \brief construct new write_single_coil_response
+     * \param header containing header stuff
+     * \param coil_index index of the coil
+     * \param coil_value the written value
+     */
+    write_single_coil_response(const packet& header, uint16_t coil_index, bool coil_value) : packet(header), coil_index(coil_index), coil_value(coil_value) {}
+    uint16_t coil_index;
+    bool coil_value;
+  };
+
+  /**
+   * \brief request for function code 15 write multiple coils
+   */
+  struct write_multiple_coils_request : packet {
+    /**
+     * \brief create new multiple coils request
+     * \param transaction_id The id of the transaction
+     * \param address The address of the target
+     * \param first_coil index of the first coil
+     * \param coil_data the values to write
+     */
+    write_multiple_coils_request(const uint16_t transaction_id, uint8_t address, uint16_t first_coil, std::vector<bool> coil_data)
+        : packet(transaction_id, address, function_code::write_multiple_coils), first_coil(first_coil), coil_data(coil_data) {}
+    /**
+     * \brief construct new write_multiple_coils_request
+     * \param header containing header stuff
+     * \param first_coil index of the first coil
+     * \param coil_data the values to write
+     */
+    write_multiple_coils_request(const packet& header, uint16_t first_coil, std::vector<bool> coil_data) : packet(header), first_coil(first_coil), coil_data(coil_data) {}
+    /**
+     * \brief First Coil index
+     */
+    uint16_t first_coil;
+    /**
+     * \brief the values to write
+     */
+    std::vector<bool> coil_data;
+  };
+
+  /**
+   * \brief response for function code 15 write multiple coils
+   */
+  struct write_multiple_coils_response : packet {
+    /**
+     * \brief create new multiple coils response
+     * \param transaction_id The id of the transaction
+     * \param address The address of the target
+     * \param first_coil index of the first coil
+     * \param coil_count number of written coils
+     */
+    write_multiple_coils_response(const uint16_t transaction_id, uint8_t address, uint16_t first_coil, uint16_t coil_count)
+        : packet(transaction_id, address, function_code::write_multiple_coils), first_coil(first_coil), coil_count(coil_count) {}
+    /**
+     * \brief construct new write_multiple_coils_response
+     * \param header containing header stuff
+     * \param first_coil index of the first coil
+     * \param coil_count number of written coils
+     */
+    write_multiple_coils_response(const packet& header, uint16_t first_coil, uint16_t coil_count) : packet(header), first_coil(first_coil), coil_count(coil_count) {}
+    /**
+     * \brief First Coil index
+     */
+    uint16_t first_coil;
+    /**
+     * \brief Number of coils
+     */
+    uint16_t coil_count;
+  };
+
+  /**
+   * \brief request for function code 22 mask write register, the result is (value & and_mask) | (or_mask & ~and_mask)
+   */
+  struct mask_write_register_request : packet {
+    /**
+     * \brief create new mask write request
+     * \param transaction_id The id of the transaction
+     * \param address The address of the target
+     * \param register_index index of the register
+     * \param and_mask bits to keep
+     * \param or_mask bits to set among the ones not kept
+     */
+    mask_write_register_request(const uint16_t transaction_id, uint8_t address, uint16_t register_index, uint16_t and_mask, uint16_t or_mask)
+        : packet(transaction_id, address, function_code::mask_write_register), register_index(register_index), and_mask(and_mask), or_mask(or_mask) {}
+    /**
+     * \brief construct new mask_write_register_request
+     * \param header containing header stuff
+     * \param register_index index of the register
+     * \param and_mask bits to keep
+     * \param or_mask bits to set among the ones not kept
+     */
+    mask_write_register_request(const packet& header, uint16_t register_index, uint16_t and_mask, uint16_t or_mask)
+        : packet(header), register_index(register_index), and_mask(and_mask), or_mask(or_mask) {}
+    uint16_t register_index;
+    uint16_t and_mask;
+    uint16_t or_mask;
+  };
+
+  /**
+   * \brief response for function code 22 mask write register, an echo of the request
+   */
+  struct mask_write_register_response : packet {
+    /**
+     * \brief create new mask write response
+     * \param transaction_id The id of the transaction
+     * \param address The address of the target
+     * \param register_index index of the register
+     * \param and_mask bits kept
+     * \param or_mask bits set among the ones not kept
+     */
+    mask_write_register_response(const uint16_t transaction_id, uint8_t address, uint16_t register_index, uint16_t and_mask, uint16_t or_mask)
+        : packet(transaction_id, address, function_code::mask_write_register), register_index(register_index), and_mask(and_mask), or_mask(or_mask) {}
+    /**
+     * \brief construct new mask_write_register_response
+     * \param header containing header stuff
+     * \param register_index index of the register
+     * \param and_mask bits kept
+     * \param or_mask bits set among the ones not kept
+     */
+    mask_write_register_response(const packet& header, uint16_t register_index, uint16_t and_mask, uint16_t or_mask)
+        : packet(header), register_index(register_index), and_mask(and_mask), or_mask(or_mask) {}
+    uint16_t register_index;
+    uint16_t and_mask;
+    uint16_t or_mask;
+  };
+
+  /**
+   * \brief request for function code 23 read/write multiple registers, the write is done before the read
+   */
+  struct read_write_registers_request : packet {
+    /**
+     * \brief create new read/write request
+     * \param transaction_id The id of the transaction
+     * \param address The address of the target
+     * \param read_first index of the first register to read
+     * \param read_count number of registers to read
+     * \param write_first index of the first register to write
+     * \param write_data the values to write
+     */
+    read_write_registers_request(const uint16_t transaction_id, uint8_t address, uint16_t read_first, uint16_t read_count, uint16_t write_first, std::vector<uint16_t> write_data)
+        : packet(transaction_id, address, function_code::read_write_registers), read_first(read_first), read_count(read_count), write_first(write_first), write_data(write_data) {}
+    /**
+     * \brief construct new read_write_registers_request
+     * \param header containing header stuff
+     * \param read_first index of the first register to read
+     * \param read_count number of registers to read
+     * \param write_first index of the first register to write
+     * \param write_data the values to write
+     */
+    read_write_registers_request(const packet& header, uint16_t read_first, uint16_t read_count, uint16_t write_first, std::vector<uint16_t> write_data)
+        : packet(header), read_first(read_first), read_count(read_count), write_first(write_first), write_data(write_data) {}
+    uint16_t read_first;
+    uint16_t read_count;
+    uint16_t write_first;
+    std::vector<uint16_t> write_data;
+  };
+
+  /**
+   * \brief response for function code 23 read/write multiple registers
+   */
+  struct read_write_registers_response : packet {
+    /**
+     * \brief create new read/write response
+     * \param transaction_id The id of the transaction
+     * \param address The address of the target
+     * \param register_data The read registers
+     */
+    read_write_registers_response(const uint16_t transaction_id, uint8_t address, std::vector<uint16_t> register_data)
+        : packet(transaction_id, address, function_code::read_write_registers), register_data(register_data) {}
+    /**
+     * \brief construct new read_write_registers_response
+     * \param header containing header stuff
+     * \param register_data The read registers
+     */
+    read_write_registers_response(const packet& header, std::vector<uint16_t> register_data) : packet(header), register_data(register_data) {}
+    /**
+     * \brief The read registers
+     */
+    std::vector<uint16_t> register_data;
+  };
+
   /**
    * \brief response for function code 4 read input register
    */
@@ -361,103 +635,131 @@ namespace cbus {
     error_code error;
   };
 
-  template <> inline single_packet parse_single_packet<read_coils_response>(const packet& header, const std::string& content, uint_least64_t& size) {
-    if (content.size() < 1)
-      return not_enough_data{};
-    uint8_t len = get_u8(content, 0);
-    if (content.size() < (1 + len))
-      return not_enough_data{};
-    size = len + 1;
-    std::string raw_reg_data = content.substr(1, len);
-    std::vector<bool> response_data;
-    for (int8_t byte : raw_reg_data) {
+  /**
+   * \brief unpack bits transmitted least significant bit first
+   * \param data the packed bytes
+   * \return one entry per transmitted bit, including the padding of the last byte
+   */
+  inline std::vector<bool> unpack_bits(const std::string& data) {
+    std::vector<bool> bits;
+    bits.reserve(data.size() * 8);
+    for (char byte : data) {
       uint8_t value = byte;
       for (uint_fast8_t i = 0; i < 8; i++)
-        response_data.push_back((value & (1 << i)) != 0);
+        bits.push_back((value & (1 << i)) != 0);
     }
-    return read_coils_response(header, response_data);
+    return bits;
+  }
+
+  /**
+   * \brief pack bits least significant bit first, the last byte is padded with zeros
+   * \param bits the bits to pack
+   */
+  inline std::string pack_bits(const std::vector<bool>& bits) {
+    std::string ret((bits.size() + 7) / 8, '\0');
+    for (size_t i = 0; i < bits.size(); i++)
+      if (bits[i])
+        ret[i / 8] = static_cast<char>(static_cast<uint8_t>(ret[i / 8]) | (1 << (i % 8)));
+    return ret;
+  }
+
+  template <> inline decode_status decode_single_packet<read_coils_response>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<read_coils_response>& out) {
+    if (content.size() < 1)
+      return decode_status::not_enough_data;
+    uint8_t len = get_u8(content, 0);
+    if (content.size() < (1 + static_cast<size_t>(len)))
+      return decode_status::not_enough_data;
+    size = len + 1;
+    out.emplace(header, unpack_bits(content.substr(1, len)));
+    return decode_status::ok;
   }
 
-  template <> inline single_packet parse_single_packet<read_coils_request>(const packet& header, const std::string& content, uint_least64_t& size) {
+  template <> inline decode_status decode_single_packet<read_coils_request>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<read_coils_request>& out) {
     if (content.size() < 4)
-      return not_enough_data{};
+      return decode_status::not_enough_data;
     uint16_t first_coil = get_u16(__FILE__, __LINE__, content, 0);
     uint16_t coil_count = get_u16(__FILE__, __LINE__, content, 2);
     size = 4;
-    return read_coils_request(header, first_coil, coil_count);
+    out.emplace(header, first_coil, coil_count);
+    return decode_status::ok;
   }
 
-  template <> inline single_packet parse_single_packet<read_input_registers_response>(const packet& header, const std::string& content, uint_least64_t& size) {
+  template <> inline decode_status decode_single_packet<read_input_registers_response>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<read_input_registers_response>& out) {
     if (content.size() < 1)
-      return not_enough_data{};
+      return decode_status::not_enough_data;
     uint8_t len = get_u8(content, 0);
-    if (content.size() < (1 + len))
-      return not_enough_data{};
+    if (content.size() < (1 + static_cast<size_t>(len)))
+      return decode_status::not_enough_data;
     if ((len % 2) != 0)
-      return packet_error{header};
+      return decode_status::packet_error;
     size = len + 1;
     std::string u16_arr = content.substr(1, len);
     std::vector<uint16_t> nd;
     for (uint_fast32_t i = 0; i < u16_arr.size(); i += 2) {
       nd.push_back(get_u16(__FILE__, __LINE__, u16_arr, i));
     }
-    return read_input_registers_response(header, nd);
+    out.emplace(header, nd);
+    return decode_status::ok;
   }
 
-  template <> inline single_packet parse_single_packet<read_input_registers_request>(const packet& header, const std::string& content, uint_least64_t& size) {
+  template <> inline decode_status decode_single_packet<read_input_registers_request>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<read_input_registers_request>& out) {
     if (content.size() < 4)
-      return not_enough_data{};
+      return decode_status::not_enough_data;
     uint16_t first_register = get_u16(__FILE__, __LINE__, content, 0);
     uint16_t register_count = get_u16(__FILE__, __LINE__, content, 2);
     size = 4;
-    return read_input_registers_request(header, first_register, register_count);
+    out.emplace(header, first_register, register_count);
+    return decode_status::ok;
   }
 
-  template <> inline single_packet parse_single_packet<read_holding_registers_response>(const packet& header, const std::string& content, uint_least64_t& size) {
+  template <> inline decode_status decode_single_packet<read_holding_registers_response>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<read_holding_registers_response>& out) {
     if (content.size() < 1)
-      return not_enough_data{};
+      return decode_status::not_enough_data;
     uint8_t len = get_u8(content, 0);
-    if (content.size() < (1 + len))
-      return not_enough_data{};
+    if (content.size() < (1 + static_cast<size_t>(len)))
+      return decode_status::not_enough_data;
     if ((len % 2) != 0)
-      return packet_error{header};
+      return decode_status::packet_error;
     size = len + 1;
     std::string u16_arr = content.substr(1, len);
     std::vector<uint16_t> nd;
     for (uint_fast32_t i = 0; i < u16_arr.size(); i += 2) {
       nd.push_back(get_u16(__FILE__, __LINE__, u16_arr, i));
     }
-    return read_holding_registers_response(header, nd);
+    out.emplace(header, nd);
+    return decode_status::ok;
   }
 
-  template <> inline single_packet parse_single_packet<read_holding_registers_request>(const packet& header, const std::string& content, uint_least64_t& size) {
+  template <> inline decode_status decode_single_packet<read_holding_registers_request>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<read_holding_registers_request>& out) {
     if (content.size() < 4)
-      return not_enough_data{};
+      return decode_status::not_enough_data;
     uint16_t first_register = get_u16(__FILE__, __LINE__, content, 0);
     uint16_t register_count = get_u16(__FILE__, __LINE__, content, 2);
     size = 4;
-    return read_holding_registers_request(header, first_register, register_count);
+    out.emplace(header, first_register, register_count);
+    return decode_status::ok;
   }
 
-  template <> inline single_packet parse_single_packet<write_holding_registers_response>(const packet& header, const std::string& content, uint_least64_t& size) {
+  template <> inline decode_status decode_single_packet<write_holding_registers_response>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<write_holding_registers_response>& out) {
     if (content.size() < 4)
-      return not_enough_data{};
+      return decode_status::not_enough_data;
     uint16_t first_register = get_u16(__FILE__, __LINE__, content, 0);
     uint16_t register_count = get_u16(__FILE__, __LINE__, content, 2);
     size = 4;
-    return write_holding_registers_response(header, first_register, register_count);
+    out.emplace(header, first_register, register_count);
+    return decode_status::ok;
   }
 
-  template <> inline single_packet parse_single_packet<write_holding_registers_request>(const packet& header, const std::string& content, uint_least64_t& size) {
+  template <> inline decode_status decode_single_packet<write_holding_registers_request>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<write_holding_registers_request>& out) {
     if (content.size() < 5)
-      return not_enough_data{};
+      return decode_status::not_enough_data;
     uint16_t first_register = get_u16(__FILE__, __LINE__, content, 0);
     uint16_t register_count = get_u16(__FILE__, __LINE__, content, 2);
     uint8_t len = get_u8(content, 4);
     if ((len % 2) != 0)
-      return packet_error{header};
-    if (content.size() < (5 + len))
-      return not_enough_data{};
+      return decode_status::packet_error;
+    if (content.size() < (5 + static_cast<size_t>(len)))
+      return decode_status::not_enough_data;
     size = len + 5;
     std::string u16_arr = content.substr(5, len);
     std::vector<uint16_t> nd;
@@ -465,47 +767,210 @@ namespace cbus {
       nd.push_back(get_u16(__FILE__, __LINE__, u16_arr, i));
     }
     if (register_count != nd.size())
-      return internal_error(header);
-    return write_holding_registers_request(header, first_register, nd);
+      return decode_status::internal_error;
+    out.emplace(header, first_register, nd);
+    return decode_status::ok;
   }
 
-  template <> inline single_packet parse_single_packet<write_single_holding_register_response>(const packet& header, const std::string& content, uint_least64_t& size) {
+  template <> inline decode_status decode_single_packet<write_single_holding_register_response>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<write_single_holding_register_response>& out) {
     if (content.size() < 4)
-      return not_enough_data{};
+      return decode_status::not_enough_data;
     uint16_t first_register = get_u16(__FILE__, __LINE__, content, 0);
     uint16_t register_count = get_u16(__FILE__, __LINE__, content, 2);
     size = 4;
-    return write_single_holding_register_response(header, first_register, register_count);
+    out.emplace(header, first_register, register_count);
+    return decode_status::ok;
   }
 
-  template <> inline single_packet parse_single_packet<write_single_holding_register_request>(const packet& header, const std::string& content, uint_least64_t& size) {
+  template <> inline decode_status decode_single_packet<write_single_holding_register_request>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<write_single_holding_register_request>& out) {
     if (content.size() < 4)
-      return not_enough_data{};
+      return decode_status::not_enough_data;
     uint16_t first_register = get_u16(__FILE__, __LINE__, content, 0);
     uint16_t register_count = get_u16(__FILE__, __LINE__, content, 2);
     size = 4;
-    return write_single_holding_register_request(header, first_register, register_count);
+    out.emplace(header, first_register, register_count);
+    return decode_status::ok;
   }
-  template <> inline single_packet parse_single_packet<write_single_holding_register_devaddr_response>(const packet& header, const std::string& content, uint_least64_t& size) {
+  template <> inline decode_status decode_single_packet<write_single_holding_register_devaddr_response>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<write_single_holding_register_devaddr_response>& out) {
     if (content.size() < 4 + 6)
-      return not_enough_data{};
+      return decode_status::not_enough_data;
     devaddr_t da;
     memcpy(reinterpret_cast<void*>(&da), content.data(), 6);
     uint16_t first_register = get_u16(__FILE__, __LINE__, content, 0 + 6);
     uint16_t register_count = get_u16(__FILE__, __LINE__, content, 2 + 6);
     size = 4 + 6;
-    return write_single_holding_register_devaddr_response(header, da, first_register, register_count);
+    out.emplace(header, da, first_register, register_count);
+    return decode_status::ok;
   }
 
-  template <> inline single_packet parse_single_packet<write_single_holding_register_devaddr_request>(const packet& header, const std::string& content, uint_least64_t& size) {
+  template <> inline decode_status decode_single_packet<write_single_holding_register_devaddr_request>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<write_single_holding_register_devaddr_request>& out) {
     if (content.size() < 4 + 6)
-      return not_enough_data{};
+      return decode_status::not_enough_data;
     devaddr_t da;
     memcpy(reinterpret_cast<void*>(&da), content.data(), 6);
     uint16_t first_register = get_u16(__FILE__, __LINE__, content, 0 + 6);
     uint16_t register_count = get_u16(__FILE__, __LINE__, content, 2 + 6);
     size = 4 + 6;
-    return write_single_holding_register_devaddr_request(header, da, first_register, register_count);
+    out.emplace(header, da, first_register, register_count);
+    return decode_status::ok;
+  }
+
+  template <> inline decode_status decode_single_packet<read_discrete_inputs_response>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<read_discrete_inputs_response>& out) {
+    if (content.size() < 1)
+      return decode_status::not_enough_data;
+    uint8_t len = get_u8(content, 0);
+    if (content.size() < (1 + static_cast<size_t>(len)))
+      return decode_status::not_enough_data;
+    size = len + 1;
+    out.emplace(header, unpack_bits(content.substr(1, len)));
+    return decode_status::ok;
+  }
+
+  template <> inline decode_status decode_single_packet<read_discrete_inputs_request>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<read_discrete_inputs_request>& out) {
+    if (content.size() < 4)
+      return decode_status::not_enough_data;
+    uint16_t first_input = get_u16(__FILE__, __LINE__, content, 0);
+    uint16_t input_count = get_u16(__FILE__, __LINE__, content, 2);
+    size = 4;
+    out.emplace(header, first_input, input_count);
+    return decode_status::ok;
+  }
+
+  /**
+   * \brief decode the coil value of function code 5, which has to be 0xFF00 or 0x0000
+   */
+  inline decode_status decode_coil_value(const std::string& content, uint16_t& coil_index, bool& coil_value) {
+    if (content.size() < 4)
+      return decode_status::not_enough_data;
+    coil_index = get_u16(__FILE__, __LINE__, content, 0);
+    uint16_t value = get_u16(__FILE__, __LINE__, content, 2);
+    if ((value != 0xFF00) && (value != 0))
+      return decode_status::packet_error;
+    coil_value = (value != 0);
+    return decode_status::ok;
+  }
+
+  template <> inline decode_status decode_single_packet<write_single_coil_response>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<write_single_coil_response>& out) {
+    uint16_t coil_index = 0;
+    bool coil_value = false;
+    decode_status status = decode_coil_value(content, coil_index, coil_value);
+    if (status != decode_status::ok)
+      return status;
+    size = 4;
+    out.emplace(header, coil_index, coil_value);
+    return decode_status::ok;
+  }
+
+  template <> inline decode_status decode_single_packet<write_single_coil_request>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<write_single_coil_request>& out) {
+    uint16_t coil_index = 0;
+    bool coil_value = false;
+    decode_status status = decode_coil_value(content, coil_index, coil_value);
+    if (status != decode_status::ok)
+      return status;
+    size = 4;
+    out.emplace(header, coil_index, coil_value);
+    return decode_status::ok;
+  }
+
+  template <> inline decode_status decode_single_packet<write_multiple_coils_response>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<write_multiple_coils_response>& out) {
+    if (content.size() < 4)
+      return decode_status::not_enough_data;
+    uint16_t first_coil = get_u16(__FILE__, __LINE__, content, 0);
+    uint16_t coil_count = get_u16(__FILE__, __LINE__, content, 2);
+    size = 4;
+    out.emplace(header, first_coil, coil_count);
+    return decode_status::ok;
+  }
+
+  template <> inline decode_status decode_single_packet<write_multiple_coils_request>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<write_multiple_coils_request>& out) {
+    if (content.size() < 5)
+      return decode_status::not_enough_data;
+    uint16_t first_coil = get_u16(__FILE__, __LINE__, content, 0);
+    uint16_t coil_count = get_u16(__FILE__, __LINE__, content, 2);
+    uint8_t len = get_u8(content, 4);
+    if (content.size() < (5 + static_cast<size_t>(len)))
+      return decode_status::not_enough_data;
+    if (len != (coil_count + 7) / 8)
+      return decode_status::packet_error;
+    size = len + 5;
+    std::vector<bool> coil_data = unpack_bits(content.substr(5, len));
+    coil_data.resize(coil_count);
+    out.emplace(header, first_coil, coil_data);
+    return decode_status::ok;
+  }
+
+  template <> inline decode_status decode_single_packet<mask_write_register_response>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<mask_write_register_response>& out) {
+    if (content.size() < 6)
+      return decode_status::not_enough_data;
+    size = 6;
+    out.emplace(header, get_u16(__FILE__, __LINE__, content, 0), get_u16(__FILE__, __LINE__, content, 2), get_u16(__FILE__, __LINE__, content, 4));
+    return decode_status::ok;
+  }
+
+  template <> inline decode_status decode_single_packet<mask_write_register_request>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<mask_write_register_request>& out) {
+    if (content.size() < 6)
+      return decode_status::not_enough_data;
+    size = 6;
+    out.emplace(header, get_u16(__FILE__, __LINE__, content, 0), get_u16(__FILE__, __LINE__, content, 2), get_u16(__FILE__, __LINE__, content, 4));
+    return decode_status::ok;
+  }
+
+  template <> inline decode_status decode_single_packet<read_write_registers_response>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<read_write_registers_response>& out) {
+    if (content.size() < 1)
+      return decode_status::not_enough_data;
+    uint8_t len = get_u8(content, 0);
+    if (content.size() < (1 + static_cast<size_t>(len)))
+      return decode_status::not_enough_data;
+    if ((len % 2) != 0)
+      return decode_status::packet_error;
+    size = len + 1;
+    std::vector<uint16_t> nd;
+    for (uint_fast32_t i = 0; i < len; i += 2)
+      nd.push_back(get_u16(__FILE__, __LINE__, content, 1 + i));
+    out.emplace(header, nd);
+    return decode_status::ok;
+  }
+
+  template <> inline decode_status decode_single_packet<read_write_registers_request>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<read_write_registers_request>& out) {
+    if (content.size() < 9)
+      return decode_status::not_enough_data;
+    uint16_t read_first = get_u16(__FILE__, __LINE__, content, 0);
+    uint16_t read_count = get_u16(__FILE__, __LINE__, content, 2);
+    uint16_t write_first = get_u16(__FILE__, __LINE__, content, 4);
+    uint16_t write_count = get_u16(__FILE__, __LINE__, content, 6);
+    uint8_t len = get_u8(content, 8);
+    if (content.size() < (9 + static_cast<size_t>(len)))
+      return decode_status::not_enough_data;
+    if (len != write_count * 2)
+      return decode_status::packet_error;
+    size = len + 9;
+    std::vector<uint16_t> nd;
+    for (uint_fast32_t i = 0; i < len; i += 2)
+      nd.push_back(get_u16(__FILE__, __LINE__, content, 9 + i));
+    out.emplace(header, read_first, read_count, write_first, nd);
+    return decode_status::ok;
+  }
+
+  template <> inline decode_status decode_single_packet<error_response>(const packet& header, const std::string& content, uint_least64_t& size, std::optional<error_response>& out) {
+    if (content.size() < 1)
+      return decode_status::not_enough_data;
+    size = 1;
+    out.emplace(header, static_cast<error_code>(content.at(0)));
+    return decode_status::ok;
+  }
+
+  template <typename T> single_packet parse_single_packet(const packet& header, const std::string& content, uint_least64_t& size) {
+    std::optional<T> out;
+    switch (decode_single_packet<T>(header, content, size, out)) {
+    case decode_status::ok:
+      return std::move(*out);
+    case decode_status::not_enough_data:
+      return not_enough_data{};
+    case decode_status::packet_error:
+      return packet_error(header);
+    default:
+      return internal_error(header);
+    }
   }
 
   template <> inline std::string serialize_single_packet<read_input_registers_request>(const read_input_registers_request& packet) {
@@ -546,17 +1011,231 @@ namespace cbus {
   }
   template <> inline std::string serialize_single_packet<read_coils_request>(const read_coils_request& packet) { return set_u16(packet.first_coil) + set_u16(packet.coil_count); }
   template <> inline std::string serialize_single_packet<read_coils_response>(const read_coils_response& packet) {
-    std::string ret = set_u8((packet.coil_data.size() + 7) / 8);
-    std::vector<bool> data = packet.coil_data;
-    while (data.size() % 8)
-      data.push_back(false);
-    for (uint_least32_t i = 0; i < data.size(); i += 8) {
-      uint8_t b = 0;
-      for (uint8_t j = 0; j < 8; j++)
-        if (data.at(i + j))
-          b |= 1 << j;
-    }
+    std::string data = pack_bits(packet.coil_data);
+    return set_u8(data.size()) + data;
+  }
+  template <> inline std::string serialize_single_packet<read_discrete_inputs_request>(const read_discrete_inputs_request& packet) {
+    return set_u16(packet.first_input) + set_u16(packet.input_count);
+  }
+  template <> inline std::string serialize_single_packet<read_discrete_inputs_response>(const read_discrete_inputs_response& packet) {
+    std::string data = pack_bits(packet.input_data);
+    return set_u8(data.size()) + data;
+  }
+  template <> inline std::string serialize_single_packet<write_single_coil_request>(const write_single_coil_request& packet) {
+    return set_u16(packet.coil_index) + set_u16(packet.coil_value ? 0xFF00 : 0);
+  }
+  template <> inline std::string serialize_single_packet<write_single_coil_response>(const write_single_coil_response& packet) {
+    return set_u16(packet.coil_index) + set_u16(packet.coil_value ? 0xFF00 : 0);
+  }
+  template <> inline std::string serialize_single_packet<write_multiple_coils_request>(const write_multiple_coils_request& packet) {
+    std::string data = pack_bits(packet.coil_data);
+    return set_u16(packet.first_coil) + set_u16(packet.coil_data.size()) + set_u8(data.size()) + data;
+  }
+  template <> inline std::string serialize_single_packet<write_multiple_coils_response>(const write_multiple_coils_response& packet) {
+    return set_u16(packet.first_coil) + set_u16(packet.coil_count);
+  }
+  template <> inline std::string serialize_single_packet<mask_write_register_request>(const mask_write_register_request& packet) {
+    return set_u16(packet.register_index) + set_u16(packet.and_mask) + set_u16(packet.or_mask);
+  }
+  template <> inline std::string serialize_single_packet<mask_write_register_response>(const mask_write_register_response& packet) {
+    return set_u16(packet.register_index) + set_u16(packet.and_mask) + set_u16(packet.or_mask);
+  }
+  template <> inline std::string serialize_single_packet<read_write_registers_request>(const read_write_registers_request& packet) {
+    std::string ret = set_u16(packet.read_first) + set_u16(packet.read_count) + set_u16(packet.write_first) + set_u16(packet.write_data.size()) + set_u8(packet.write_data.size() * 2);
+    for (uint16_t v : packet.write_data)
+      ret += set_u16(v);
+    return ret;
+  }
+  template <> inline std::string serialize_single_packet<read_write_registers_response>(const read_write_registers_response& packet) {
+    std::string ret = set_u8(packet.register_data.size() * 2);
+    for (uint16_t v : packet.register_data)
+      ret += set_u16(v);
     return ret;
   }
   template <> inline std::string serialize_single_packet<error_response>(const error_response& packet) { return set_u8(static_cast<uint8_t>(packet.error)); }
+
+  /**
+   * \brief function code and direction of a packet type
+   */
+  template <typename T> struct packet_traits;
+  template <> struct packet_traits<read_coils_request> {
+    static constexpr function_code function = function_code::read_coils;
+    static constexpr bool response = false;
+  };
+  template <> struct packet_traits<read_coils_response> {
+    static constexpr function_code function = function_code::read_coils;
+    static constexpr bool response = true;
+  };
+  template <> struct packet_traits<read_input_registers_request> {
+    static constexpr function_code function = function_code::read_input_registers;
+    static constexpr bool response = false;
+  };
+  template <> struct packet_traits<read_input_registers_response> {
+    static constexpr function_code function = function_code::read_input_registers;
+    static constexpr bool response = true;
+  };
+  template <> struct packet_traits<read_holding_registers_request> {
+    static constexpr function_code function = function_code::read_holding_registers;
+    static constexpr bool response = false;
+  };
+  template <> struct packet_traits<read_holding_registers_response> {
+    static constexpr function_code function = function_code::read_holding_registers;
+    static constexpr bool response = true;
+  };
+  template <> struct packet_traits<write_single_holding_register_request> {
+    static constexpr function_code function = function_code::write_single_holding_register;
+    static constexpr bool response = false;
+  };
+  template <> struct packet_traits<write_single_holding_register_response> {
+    static constexpr function_code function = function_code::write_single_holding_register;
+    static constexpr bool response = true;
+  };
+  template <> struct packet_traits<write_holding_registers_request> {
+    static constexpr function_code function = function_code::write_holding_registers;
+    static constexpr bool response = false;
+  };
+  template <> struct packet_traits<write_holding_registers_response> {
+    static constexpr function_code function = function_code::write_holding_registers;
+    static constexpr bool response = true;
+  };
+  template <> struct packet_traits<write_single_holding_register_devaddr_request> {
+    static constexpr function_code function = function_code::write_single_holding_register_devaddr;
+    static constexpr bool response = false;
+  };
+  template <> struct packet_traits<write_single_holding_register_devaddr_response> {
+    static constexpr function_code function = function_code::write_single_holding_register_devaddr;
+    static constexpr bool response = true;
+  };
+  template <> struct packet_traits<read_discrete_inputs_request> {
+    static constexpr function_code function = function_code::read_discrete_inputs;
+    static constexpr bool response = false;
+  };
+  template <> struct packet_traits<read_discrete_inputs_response> {
+    static constexpr function_code function = function_code::read_discrete_inputs;
+    static constexpr bool response = true;
+  };
+  template <> struct packet_traits<write_single_coil_request> {
+    static constexpr function_code function = function_code::write_single_coil;
+    static constexpr bool response = false;
+  };
+  template <> struct packet_traits<write_single_coil_response> {
+    static constexpr function_code function = function_code::write_single_coil;
+    static constexpr bool response = true;
+  };
+  template <> struct packet_traits<write_multiple_coils_request> {
+    static constexpr function_code function = function_code::write_multiple_coils;
+    static constexpr bool response = false;
+  };
+  template <> struct packet_traits<write_multiple_coils_response> {
+    static constexpr function_code function = function_code::write_multiple_coils;
+    static constexpr bool response = true;
+  };
+  template <> struct packet_traits<mask_write_register_request> {
+    static constexpr function_code function = function_code::mask_write_register;
+    static constexpr bool response = false;
+  };
+  template <> struct packet_traits<mask_write_register_response> {
+    static constexpr function_code function = function_code::mask_write_register;
+    static constexpr bool response = true;
+  };
+  template <> struct packet_traits<read_write_registers_request> {
+    static constexpr function_code function = function_code::read_write_registers;
+    static constexpr bool response = false;
+  };
+  template <> struct packet_traits<read_write_registers_response> {
+    static constexpr function_code function = function_code::read_write_registers;
+    static constexpr bool response = true;
+  };
+  /**
+   * \brief exceptions of all function codes
+   */
+  template <> struct packet_traits<error_response> {
+    static constexpr function_code function = function_code::invalid;
+    static constexpr bool response = true;
+  };
+
+  /**
+   * \brief layout of the data following the function code in one direction
+   * The data starts with fixed size fields. If max_count is set, the last of them is a byte count of the data following.
+   */
+  struct pdu_layout {
+    /**
+     * \brief number of bytes of the fixed fields
+     */
+    uint8_t fixed = 0;
+    /**
+     * \brief largest byte count allowed by the specification, 0 if the pdu has no byte count
+     */
+    uint8_t max_count = 0;
+    /**
+     * \brief parser of the content
+     */
+    single_packet (*parse)(const packet& header, const std::string& content, uint_least64_t& size) = nullptr;
+  };
+
+  /**
+   * \brief everything the codec needs to know about a function code
+   */
+  struct function_descriptor {
+    bool supported = false;
+    pdu_layout request;
+    pdu_layout response;
+  };
+
+  /**
+   * \brief descriptors of all function codes, indexed by the function code without the exception bit
+   */
+  struct function_table {
+    constexpr function_table() : functions() {
+      add<read_coils_request, read_coils_response>(4, 0, 1, 250);
+      add<read_discrete_inputs_request, read_discrete_inputs_response>(4, 0, 1, 250);
+      add<read_holding_registers_request, read_holding_registers_response>(4, 0, 1, 250);
+      add<read_input_registers_request, read_input_registers_response>(4, 0, 1, 250);
+      add<write_single_coil_request, write_single_coil_response>(4, 0, 4, 0);
+      add<write_single_holding_register_request, write_single_holding_register_response>(4, 0, 4, 0);
+      add<write_multiple_coils_request, write_multiple_coils_response>(5, 246, 4, 0);
+      add<write_holding_registers_request, write_holding_registers_response>(5, 246, 4, 0);
+      add<mask_write_register_request, mask_write_register_response>(6, 0, 6, 0);
+      add<read_write_registers_request, read_write_registers_response>(9, 242, 1, 250);
+      add<write_single_holding_register_devaddr_request, write_single_holding_register_devaddr_response>(10, 0, 10, 0);
+    }
+    template <typename request_type, typename response_type>
+    constexpr void add(const uint8_t request_fixed, const uint8_t request_max_count, const uint8_t response_fixed, const uint8_t response_max_count) {
+      static_assert(packet_traits<request_type>::function == packet_traits<response_type>::function, "request and response of different functions");
+      function_descriptor& desc = functions[static_cast<uint8_t>(packet_traits<request_type>::function)];
+      desc.supported = true;
+      desc.request.fixed = request_fixed;
+      desc.request.max_count = request_max_count;
+      desc.request.parse = &parse_single_packet<request_type>;
+      desc.response.fixed = response_fixed;
+      desc.response.max_count = response_max_count;
+      desc.response.parse = &parse_single_packet<response_type>;
+    }
+    function_descriptor functions[128];
+  };
+
+  /**
+   * \brief look up the descriptor of a function code
+   * \param function the function code, the exception bit is ignored
+   */
+  inline const function_descriptor& describe_function(const uint8_t function) {
+    static constexpr function_table table;
+    return table.functions[function & 0x7f];
+  }
+
+  /**
+   * \brief get the header of a packet
+   * \param pkg the packet
+   * \return pointer to the header or nullptr for not_enough_data
+   */
+  inline const packet* get_header(const single_packet& pkg) {
+    return std::visit(
+        [](const auto& p) -> const packet* {
+          if constexpr (std::is_base_of<packet, typename std::decay<decltype(p)>::type>::value)
+            return &p;
+          else
+            return nullptr;
+        },
+        pkg);
+  }
 } // namespace cbus
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "becker.hpp"
+#include "snapshot.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <vector>
+
+namespace cbus {
+  /**
+   * \brief Set of register or coil addresses stored as disjoint ranges
+   * Overlapping and adjacent ranges are merged on insert, so the set stays as small as the number of separate changed areas.
+   * Inserting costs O(log ranges) plus the ranges merged, draining O(ranges).
+   */
+  class interval_set {
+  public:
+    /**
+     * \brief add a range
+     * \param first address of the first entry
+     * \param count number of entries, the range must end within the 16 bit address space
+     */
+    void insert(const uint16_t first, const size_t count) {
+      becker::bassert(first + count <= 0x10000, __FILE__, __LINE__, "range out of bounds");
+      if (!count)
+        return;
+      uint32_t begin = first;
+      uint32_t end = first + static_cast<uint32_t>(count);
+      // first range ending at or after begin, ranges ending exactly at begin are merged as well
+      auto it = ranges_.upper_bound(begin);
+      if ((it != ranges_.begin()) && (std::prev(it)->second >= begin))
+        --it;
+      while ((it != ranges_.end()) && (it->first <= end)) {
+        begin = std::min(begin, it->first);
+        end = std::max(end, it->second);
+        it = ranges_.erase(it);
+      }
+      ranges_.emplace_hint(it, begin, end);
+    }
+
+    /**
+     * \brief true if the address is inside a range
+     */
+    bool contains(const uint16_t address) const {
+      auto it = ranges_.upper_bound(address);
+      return (it != ranges_.begin()) && (std::prev(it)->second > address);
+    }
+
+    /**
+     * \brief true if no range is stored
+     */
+    bool empty() const { return ranges_.empty(); }
+
+    /**
+     * \brief number of separate ranges
+     */
+    size_t size() const { return ranges_.size(); }
+
+    /**
+     * \brief remove all ranges
+     */
+    void clear() { ranges_.clear(); }
+
+    /**
+     * \brief remove and return all ranges in address order
+     * A range covering the whole address space is returned as two ranges, because changed_range counts only up to 0xffff.
+     */
+    std::vector<changed_range> drain() {
+      std::vector<changed_range> ret;
+      ret.reserve(ranges_.size() + 1);
+      for (const auto& range : ranges_) {
+        uint32_t begin = range.first;
+        while (begin < range.second) {
+          uint32_t count = std::min<uint32_t>(range.second - begin, 0xffff);
+          ret.push_back(changed_range{static_cast<uint16_t>(begin), static_cast<uint16_t>(count)});
+          begin += count;
+        }
+      }
+      ranges_.clear();
+      return ret;
+    }
+
+  private:
+    /**
+     * \brief begin of each range to its end, half open
+     */
+    std::map<uint32_t, uint32_t> ranges_;
+  };
+} // namespace cbus
@@ -3,6 +3,7 @@
 #include "becker.hpp"
 #include <functional>
 #include <memory>
+#include <optional>
 #include <string>
 #include <variant>
 
@@ -24,6 +25,16 @@ namespace cbus {
   struct write_single_holding_register_devaddr_response;
   struct write_holding_registers_request;
   struct write_holding_registers_response;
+  struct read_discrete_inputs_request;
+  struct read_discrete_inputs_response;
+  struct write_single_coil_request;
+  struct write_single_coil_response;
+  struct write_multiple_coils_request;
+  struct write_multiple_coils_response;
+  struct mask_write_register_request;
+  struct mask_write_register_response;
+  struct read_write_registers_request;
+  struct read_write_registers_response;
 
   using single_packet = std::variant<not_enough_data,                        // 0
                                      packet_error,                           // 1
@@ -40,7 +51,18 @@ namespace cbus {
                                      write_single_holding_register_response, // 12
                                      write_holding_registers_request,        // 13
                                      write_holding_registers_response,       // 14
-                                     write_single_holding_register_devaddr_request, write_single_holding_register_devaddr_response>;
+                                     write_single_holding_register_devaddr_request,  // 15
+                                     write_single_holding_register_devaddr_response, // 16
+                                     read_discrete_inputs_request,                   // 17
+                                     read_discrete_inputs_response,                  // 18
+                                     write_single_coil_request,                      // 19
+                                     write_single_coil_response,                     // 20
+                                     write_multiple_coils_request,                   // 21
+                                     write_multiple_coils_response,                  // 22
+                                     mask_write_register_request,                    // 23
+                                     mask_write_register_response,                   // 24
+                                     read_write_registers_request,                   // 25
+                                     read_write_registers_response>;                 // 26
   enum class function_code {
     invalid = 0,
     read_coils = 1,
@@ -51,6 +73,8 @@ namespace cbus {
     write_single_holding_register = 6,
     write_multiple_coils = 15,
     write_holding_registers = 16,
+    mask_write_register = 0x16,
+    read_write_registers = 0x17,
     write_single_holding_register_devaddr = 0x46
   };
 
@@ -140,6 +164,12 @@ namespace cbus {
     return std::string((char*)val, 2);
   }
 
+  /**
+   * \brief result of decoding the content of a packet
+   */
+  enum class decode_status { ok, not_enough_data, packet_error, internal_error };
+
+  template <typename T> decode_status decode_single_packet(const packet& header, const std::string& content, uint_least64_t& size, std::optional<T>& out);
   template <typename T> single_packet parse_single_packet(const packet& header, const std::string& content, uint_least64_t& size);
   template <typename T> std::string serialize_single_packet(const T& packet);
 } // namespace cbus
@@ -0,0 +1,508 @@
+#pragma once
+
+#include "becker.hpp"
+#include "contents.hpp"
+#include "packet.hpp"
+#include "rtu_scheduler.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <map>
+#include <vector>
+
+namespace cbus {
+  /**
+   * \brief config of a poll controller, all times in the time unit of now
+   */
+  struct poll_controller_config {
+    /**
+     * \brief A lambda returning the current time, in the arbitrary time unit used by all times of this config and the poll ranges
+     */
+    std::function<int_least64_t()> now;
+
+    /**
+     * \brief fraction of the line time polls may use, the rest is left for writes and other traffic
+     */
+    double utilisation = 0.8;
+
+    /**
+     * \brief weight of a new observation in the moving averages
+     */
+    double smoothing = 0.2;
+
+    /**
+     * \brief line time assumed for a poll before its first response
+     */
+    int_least64_t initial_cost = 50;
+
+    /**
+     * \brief line time of a timed out poll, usually the response timeout of the scheduler
+     */
+    int_least64_t timeout_cost = 1000;
+  };
+
+  /**
+   * \brief a register range polled by the controller
+   */
+  struct poll_range {
+    uint8_t unit = 1;
+    /**
+     * \brief poll input registers instead of holding registers
+     */
+    bool input_registers = false;
+    uint16_t first = 0;
+    uint16_t count = 1;
+    /**
+     * \brief bounds of the poll interval
+     */
+    int_least64_t min_interval = 100;
+    int_least64_t max_interval = 10000;
+  };
+
+  /**
+   * \brief observations and current interval of a range
+   */
+  struct poll_range_stats {
+    /**
+     * \brief current poll interval
+     */
+    int_least64_t interval = 0;
+    /**
+     * \brief average time from submit to response
+     */
+    double round_trip = 0;
+    /**
+     * \brief average fraction of polls timing out
+     */
+    double timeout_rate = 0;
+    /**
+     * \brief estimated changes of the range per time unit
+     */
+    double change_rate = 0;
+    uint_least64_t polls = 0;
+    uint_least64_t changes = 0;
+  };
+
+  /**
+   * \brief Adaptive poll rate controller on top of a master scheduler
+   * Each range is polled with its own interval within its bounds. The line time of a poll is estimated from the round trip time and
+   * the timeout rate, the change rate from the fraction of polls returning changed data. The intervals are set by the square root rule,
+   * interval proportional to sqrt(cost / change rate), scaled so that all polls together use the configured utilisation of the line,
+   * which minimises the average time until a change is seen for that line time.
+   * At most one poll of the controller is queued at the scheduler, so writes submitted to the scheduler are not delayed by a poll backlog
+   * and the round trip time is not inflated by queueing. poll has to be called regularly, next_due tells when it is needed next.
+   * \tparam scheduler_type rtu_scheduler or a type providing the same submit and callback_type, e.g. poll_simulation
+   */
+  template <typename scheduler_type> class poll_controller {
+  public:
+    /**
+     * \brief callback receiving the registers of a range
+     */
+    using data_callback = std::function<void(const std::vector<uint16_t>&)>;
+
+    /**
+     * \brief construct new controller
+     * \param scheduler the scheduler to submit polls to, has to outlive the controller
+     * \param cfg the config to use
+     */
+    poll_controller(scheduler_type& scheduler, const poll_controller_config& cfg) : scheduler_(scheduler), config_(cfg) {}
+
+    /**
+     * \brief add a range, it is polled for the first time on the next poll
+     * \param range the range
+     * \param callback receives the registers of every successful poll
+     * \return id of the range
+     */
+    size_t add(const poll_range& range, const data_callback& callback) {
+      becker::bassert((range.min_interval > 0) && (range.min_interval <= range.max_interval), __FILE__, __LINE__, "invalid interval bounds");
+      ranges_.emplace_back(range, callback, config_.now());
+      ranges_.back().stats.interval = range.max_interval;
+      reallocate();
+      return ranges_.size() - 1;
+    }
+
+    /**
+     * \brief submit the most overdue range if no poll is outstanding
+     */
+    void poll() {
+      if (in_flight_)
+        return;
+      int_least64_t now = config_.now();
+      entry* due = nullptr;
+      for (entry& e : ranges_)
+        if ((e.next_due <= now) && (!due || (e.next_due < due->next_due)))
+          due = &e;
+      if (!due)
+        return;
+      in_flight_ = true;
+      due->sent = now;
+      size_t id = static_cast<size_t>(due - ranges_.data());
+      auto callback = [this, id](const request_status status, const single_packet& pkg) { completed(id, status, pkg); };
+      if (due->range.input_registers)
+        scheduler_.submit(read_input_registers_request(0, due->range.unit, due->range.first, due->range.count), callback);
+      else
+        scheduler_.submit(read_holding_registers_request(0, due->range.unit, due->range.first, due->range.count), callback);
+    }
+
+    /**
+     * \brief earliest time a range is due, the maximum value if a poll is outstanding or there are no ranges
+     */
+    int_least64_t next_due() const {
+      int_least64_t ret = std::numeric_limits<int_least64_t>::max();
+      if (!in_flight_)
+        for (const entry& e : ranges_)
+          ret = std::min(ret, e.next_due);
+      return ret;
+    }
+
+    /**
+     * \brief observations of a range
+     * \param id the id returned by add
+     */
+    const poll_range_stats& stats(const size_t id) const { return ranges_.at(id).stats; }
+
+    /**
+     * \brief estimated fraction of the line time used by all polls with the current intervals
+     */
+    double utilisation() const {
+      double ret = 0;
+      for (const entry& e : ranges_)
+        ret += cost(e) / e.stats.interval;
+      return ret;
+    }
+
+  private:
+    struct entry {
+      entry(const poll_range& p_range, const data_callback& p_callback, const int_least64_t now) : range(p_range), callback(p_callback), next_due(now) {}
+      poll_range range;
+      data_callback callback;
+      int_least64_t next_due;
+      int_least64_t sent = 0;
+      int_least64_t last_ok = 0;
+      /**
+       * \brief average fraction of successful polls returning changed data, unknown at the start
+       */
+      double change_probability = 0.5;
+      /**
+       * \brief average time between successful polls
+       */
+      double observed_interval = 0;
+      std::vector<uint16_t> data;
+      poll_range_stats stats;
+    };
+
+    double cost(const entry& e) const {
+      double round_trip = e.stats.polls ? e.stats.round_trip : static_cast<double>(config_.initial_cost);
+      return (1 - e.stats.timeout_rate) * round_trip + e.stats.timeout_rate * config_.timeout_cost;
+    }
+
+    void completed(const size_t id, const request_status status, const single_packet& pkg) {
+      in_flight_ = false;
+      entry& e = ranges_[id];
+      int_least64_t now = config_.now();
+      const double a = config_.smoothing;
+      if (status != request_status::skipped) {
+        e.stats.timeout_rate += a * (((status == request_status::timeout) ? 1 : 0) - e.stats.timeout_rate);
+        if (status == request_status::ok)
+          e.stats.round_trip = e.stats.polls ? e.stats.round_trip + a * ((now - e.sent) - e.stats.round_trip) : static_cast<double>(now - e.sent);
+        e.stats.polls++;
+      }
+      const std::vector<uint16_t>* data = nullptr;
+      if (const read_holding_registers_response* response = std::get_if<read_holding_registers_response>(&pkg))
+        data = &response->register_data;
+      else if (const read_input_registers_response* response = std::get_if<read_input_registers_response>(&pkg))
+        data = &response->register_data;
+      if ((status == request_status::ok) && data) {
+        if (!e.data.empty()) {
+          bool changed = (*data != e.data);
+          e.stats.changes += changed;
+          e.change_probability += a * ((changed ? 1 : 0) - e.change_probability);
+          double elapsed = static_cast<double>(now - e.last_ok);
+          e.observed_interval = e.observed_interval ? e.observed_interval + a * (elapsed - e.observed_interval) : elapsed;
+          // changes of a poisson process seen by polls every observed_interval
+          double p = std::min(e.change_probability, 0.99);
+          e.stats.change_rate = -std::log(1 - p) / std::max(e.observed_interval, 1.0);
+        }
+        e.data = *data;
+        e.last_ok = now;
+        if (e.callback)
+          e.callback(e.data);
+      }
+      reallocate();
+      e.next_due = e.sent + e.stats.interval;
+    }
+
+    /**
+     * \brief set the intervals of all ranges by the square root rule, ranges hitting a bound are fixed there and the rest is redistributed
+     */
+    void reallocate() {
+      std::vector<entry*> free;
+      double remaining = config_.utilisation;
+      for (entry& e : ranges_) {
+        double rate = e.stats.change_rate;
+        if (!e.data.empty() && (e.observed_interval > 0) && (rate > 0))
+          free.push_back(&e);
+        else if (e.data.empty() || (e.observed_interval == 0)) {
+          // not enough observations yet, start in the middle of the bounds
+          e.stats.interval = (e.range.min_interval + e.range.max_interval) / 2;
+          remaining -= cost(e) / e.stats.interval;
+        } else {
+          e.stats.interval = e.range.max_interval;
+          remaining -= cost(e) / e.stats.interval;
+        }
+      }
+      while (!free.empty()) {
+        double weights = 0;
+        for (entry* e : free)
+          weights += std::sqrt(cost(*e) * e->stats.change_rate);
+        double scale = (remaining > 0) ? weights / remaining : std::numeric_limits<double>::infinity();
+        std::vector<entry*> next;
+        bool clamped = false;
+        for (entry* e : free) {
+          double interval = scale * std::sqrt(cost(*e) / e->stats.change_rate);
+          if ((interval >= e->range.max_interval) || (interval <= e->range.min_interval)) {
+            e->stats.interval = (interval >= e->range.max_interval) ? e->range.max_interval : e->range.min_interval;
+            remaining -= cost(*e) / e->stats.interval;
+            clamped = true;
+          } else {
+            e->stats.interval = static_cast<int_least64_t>(interval);
+            next.push_back(e);
+          }
+        }
+        if (!clamped)
+          break;
+        free.swap(next);
+      }
+    }
+
+    scheduler_type& scheduler_;
+    const poll_controller_config config_;
+    std::vector<entry> ranges_;
+    bool in_flight_ = false;
+  };
+
+  /**
+   * \brief Deterministic simulation of a rtu line with slaves, for testing poll strategies
+   * It provides the submit interface of rtu_scheduler and a virtual clock. Requests are served one after another, each occupying the line
+   * for the transmission of request and response plus the latency of the slave, or the timeout. Registers change as poisson processes,
+   * all randomness comes from a seeded generator, so a run is fully reproducible.
+   * Only read holding and read input registers requests are supported, both read the same registers.
+   */
+  class poll_simulation {
+  public:
+    using callback_type = std::function<void(request_status, const single_packet&)>;
+
+    /**
+     * \brief construct new simulation
+     * \param character_time time of one character on the line
+     * \param timeout time until a request without response fails
+     * \param seed seed of the random generator
+     */
+    poll_simulation(const int_least64_t character_time, const int_least64_t timeout, const uint_least64_t seed = 1)
+        : character_time_(character_time), timeout_(timeout), random_state_(seed ? seed : 1) {}
+
+    /**
+     * \brief set the behaviour of a slave
+     * \param unit the slave address
+     * \param latency time between the end of the request and the start of the response
+     * \param timeout_rate probability of a request not being answered
+     */
+    void set_slave(const uint8_t unit, const int_least64_t latency, const double timeout_rate) {
+      slaves_[unit].latency = latency;
+      slaves_[unit].timeout_rate = timeout_rate;
+    }
+
+    /**
+     * \brief let a block of registers change
+     * \param unit the slave address
+     * \param first first register of the block
+     * \param count number of registers in the block
+     * \param rate changes of the block per time unit
+     */
+    void set_change_rate(const uint8_t unit, const uint16_t first, const uint16_t count, const double rate) {
+      becker::bassert(rate > 0, __FILE__, __LINE__, "change rate has to be positive");
+      blocks_.push_back(block{unit, first, count, rate, now_ + exponential(rate)});
+    }
+
+    /**
+     * \brief the virtual time
+     */
+    int_least64_t now() const { return now_; }
+
+    /**
+     * \brief queue a read request
+     * \param request the request
+     * \param callback called when the request completes
+     */
+    template <typename packet_type> void submit(const packet_type& request, const callback_type& callback) {
+      constexpr bool supported = std::is_same<packet_type, read_holding_registers_request>::value || std::is_same<packet_type, read_input_registers_request>::value;
+      static_assert(supported, "only register reads are simulated");
+      queue_.push_back(pending{request.address, request.function, request.first_register, request.register_count, callback});
+      start();
+    }
+
+    /**
+     * \brief advance the virtual time, processing all changes and completions on the way
+     * \param time the time to advance to
+     */
+    void advance(const int_least64_t time) {
+      while (true) {
+        int_least64_t next = std::min(busy_ ? done_ : std::numeric_limits<int_least64_t>::max(), next_change());
+        if (next > time)
+          break;
+        now_ = next;
+        if (busy_ && (done_ == now_))
+          complete();
+        else
+          change();
+      }
+      now_ = std::max(now_, time);
+    }
+
+    /**
+     * \brief run a controller until a time
+     * \param controller the controller submitting to this simulation
+     * \param until end of the run
+     */
+    template <typename controller_type> void run(controller_type& controller, const int_least64_t until) {
+      while (now_ < until) {
+        controller.poll();
+        int_least64_t next = std::min({controller.next_due(), busy_ ? done_ : until, next_change(), until});
+        advance(std::max(next, now_ + (busy_ ? 0 : 1)));
+      }
+    }
+
+    /**
+     * \brief fraction of the time the line was busy
+     */
+    double line_utilisation() const { return now_ ? static_cast<double>(busy_time_) / now_ : 0; }
+
+    /**
+     * \brief average time from the first unseen change of a block to the poll seeing it
+     */
+    double detection_delay() const { return detections_ ? static_cast<double>(delay_sum_) / detections_ : 0; }
+
+    /**
+     * \brief number of register changes
+     */
+    uint_least64_t changes() const { return changes_; }
+
+  private:
+    struct slave {
+      int_least64_t latency = 0;
+      double timeout_rate = 0;
+      std::map<uint16_t, uint16_t> registers;
+    };
+    struct block {
+      uint8_t unit;
+      uint16_t first;
+      uint16_t count;
+      double rate;
+      int_least64_t next;
+      /**
+       * \brief time of the first change not yet seen by a poll, -1 if none
+       */
+      int_least64_t unseen = -1;
+    };
+    struct pending {
+      uint8_t unit;
+      function_code function;
+      uint16_t first;
+      uint16_t count;
+      callback_type callback;
+    };
+
+    /**
+     * \brief xorshift64* generator
+     */
+    uint_least64_t random() {
+      random_state_ ^= random_state_ >> 12;
+      random_state_ ^= random_state_ << 25;
+      random_state_ ^= random_state_ >> 27;
+      return random_state_ * 0x2545F4914F6CDD1DULL;
+    }
+
+    double uniform() { return static_cast<double>(random() >> 11) / 9007199254740992.0; }
+
+    int_least64_t exponential(const double rate) { return 1 + static_cast<int_least64_t>(-std::log(1 - uniform()) / rate); }
+
+    int_least64_t next_change() const {
+      int_least64_t ret = std::numeric_limits<int_least64_t>::max();
+      for (const block& b : blocks_)
+        ret = std::min(ret, b.next);
+      return ret;
+    }
+
+    void change() {
+      for (block& b : blocks_) {
+        if (b.next != now_)
+          continue;
+        uint16_t index = static_cast<uint16_t>(b.first + random() % b.count);
+        slaves_[b.unit].registers[index]++;
+        if (b.unseen < 0)
+          b.unseen = now_;
+        changes_++;
+        b.next = now_ + exponential(b.rate);
+      }
+    }
+
+    void start() {
+      if (busy_ || queue_.empty())
+        return;
+      const pending& p = queue_.front();
+      busy_ = true;
+      timed_out_ = uniform() < slaves_[p.unit].timeout_rate;
+      // request of 8 bytes, response of 5 bytes plus the registers
+      int_least64_t duration = timed_out_ ? timeout_ : (8 + 5 + 2 * p.count) * character_time_ + slaves_[p.unit].latency;
+      done_ = now_ + duration;
+      busy_time_ += duration;
+    }
+
+    void complete() {
+      pending p = std::move(queue_.front());
+      queue_.pop_front();
+      busy_ = false;
+      packet header(0, p.unit, p.function);
+      if (timed_out_)
+        p.callback(request_status::timeout, packet_error(header));
+      else {
+        std::vector<uint16_t> data(p.count);
+        slave& s = slaves_[p.unit];
+        for (uint16_t i = 0; i < p.count; i++) {
+          auto it = s.registers.find(static_cast<uint16_t>(p.first + i));
+          data[i] = (it == s.registers.end()) ? 0 : it->second;
+        }
+        for (block& b : blocks_)
+          if ((b.unit == p.unit) && (b.unseen >= 0) && (b.first >= p.first) && (b.first + b.count <= p.first + p.count)) {
+            delay_sum_ += now_ - b.unseen;
+            detections_++;
+            b.unseen = -1;
+          }
+        if (p.function == function_code::read_input_registers)
+          p.callback(request_status::ok, read_input_registers_response(header, data));
+        else
+          p.callback(request_status::ok, read_holding_registers_response(header, data));
+      }
+      start();
+    }
+
+    const int_least64_t character_time_;
+    const int_least64_t timeout_;
+    uint_least64_t random_state_;
+    int_least64_t now_ = 0;
+    std::array<slave, 256> slaves_;
+    std::vector<block> blocks_;
+    std::deque<pending> queue_;
+    bool busy_ = false;
+    bool timed_out_ = false;
+    int_least64_t done_ = 0;
+    int_least64_t busy_time_ = 0;
+    int_least64_t delay_sum_ = 0;
+    uint_least64_t detections_ = 0;
+    uint_least64_t changes_ = 0;
+  };
+} // namespace cbus
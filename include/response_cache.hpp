@@ -0,0 +1,195 @@
+#pragma once
+
+#include "becker.hpp"
+#include "bus.hpp"
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace cbus {
+  /**
+   * \brief key of a cached read request
+   */
+  struct cache_key {
+    uint8_t unit;
+    function_code function;
+    uint16_t start;
+    uint16_t count;
+
+    bool operator<(const cache_key& other) const { return std::tie(unit, function, start, count) < std::tie(other.unit, other.function, other.start, other.count); }
+  };
+
+  /**
+   * \brief result of a cache lookup
+   */
+  enum class cache_result {
+    /**
+     * \brief answered from the cache
+     */
+    hit,
+    /**
+     * \brief an identical request is already forwarded, the reply follows with its response
+     */
+    joined,
+    /**
+     * \brief the request has to be forwarded, complete or fail have to be called afterwards
+     */
+    miss,
+    /**
+     * \brief the request can not be cached and has to be forwarded without the cache
+     */
+    uncacheable
+  };
+
+  /**
+   * \brief Read-through response cache for gateways between tcp clients and field devices
+   * Responses are stored as tcp frames and re-stamped with the transaction id of each client.
+   * Identical requests arriving while one is forwarded wait for the same response instead of being forwarded again.
+   * Every reply gets its own frame, so a reply callback may call lookup or complete again.
+   */
+  class response_cache {
+  public:
+    /**
+     * \brief callback receiving the complete tcp frame to send to the client
+     */
+    using reply_type = std::function<void(const std::string&)>;
+
+    /**
+     * \brief construct new cache
+     * \param now A lambda returning the current time, in the arbitrary time unit of ttl
+     * \param ttl time a response is served from the cache
+     */
+    response_cache(const std::function<int_least64_t()> now, const int_least64_t ttl) : now_(now), ttl_(ttl) {}
+
+    /**
+     * \brief get the cache key of a request
+     * \param request a request received from a client
+     * \return the key or nothing if the request is not a cacheable read
+     */
+    static std::optional<cache_key> key_of(const single_packet& request) {
+      if (const read_holding_registers_request* r = std::get_if<read_holding_registers_request>(&request))
+        return cache_key{r->address, r->function, r->first_register, r->register_count};
+      if (const read_input_registers_request* r = std::get_if<read_input_registers_request>(&request))
+        return cache_key{r->address, r->function, r->first_register, r->register_count};
+      if (const read_coils_request* r = std::get_if<read_coils_request>(&request))
+        return cache_key{r->address, r->function, r->first_coil, r->coil_count};
+      return std::nullopt;
+    }
+
+    /**
+     * \brief look up a client request
+     * \param request the request received from a client
+     * \param reply called with the response frame, immediately on a hit or once the forwarded request completes
+     * \return what happened to the request
+     */
+    cache_result lookup(const single_packet& request, const reply_type& reply) {
+      std::optional<cache_key> key = key_of(request);
+      if (!key)
+        return cache_result::uncacheable;
+      uint16_t transaction_id = get_header(request)->transaction_id;
+      auto cached = entries_.find(*key);
+      if (cached != entries_.end()) {
+        if (now_() - cached->second.time < ttl_) {
+          std::string frame;
+          cached->second.response.stamp(transaction_id, frame);
+          reply(frame);
+          return cache_result::hit;
+        }
+        entries_.erase(cached);
+      }
+      auto pending = in_flight_.find(*key);
+      if (pending != in_flight_.end()) {
+        pending->second.emplace_back(transaction_id, reply);
+        return cache_result::joined;
+      }
+      in_flight_[*key].emplace_back(transaction_id, reply);
+      return cache_result::miss;
+    }
+
+    /**
+     * \brief pass the response of a forwarded request
+     * \param key the key of the forwarded request
+     * \param response the response received from the field device
+     * Error responses are passed to all waiting clients but not cached.
+     */
+    void complete(const cache_key& key, const single_packet& response) {
+      std::optional<frame_template> frame;
+      if (const read_holding_registers_response* r = std::get_if<read_holding_registers_response>(&response))
+        frame.emplace(*r, true);
+      else if (const read_input_registers_response* r = std::get_if<read_input_registers_response>(&response))
+        frame.emplace(*r, true);
+      else if (const read_coils_response* r = std::get_if<read_coils_response>(&response))
+        frame.emplace(*r, true);
+      else if (const error_response* r = std::get_if<error_response>(&response))
+        frame.emplace(*r, true);
+      else
+        return fail(key);
+      if (!std::holds_alternative<error_response>(response)) {
+        entries_.erase(key);
+        entries_.emplace(key, entry{*frame, now_()});
+      }
+      deliver(key, *frame);
+    }
+
+    /**
+     * \brief give up a forwarded request, the waiting clients get a gateway_no_response error
+     * \param key the key of the forwarded request
+     */
+    void fail(const cache_key& key) { deliver(key, frame_template(error_response(0, key.unit, key.function, error_code::gateway_no_response), true)); }
+
+    /**
+     * \brief drop all cached responses of a unit, e.g. after forwarding a write
+     * \param unit the unit id
+     */
+    void invalidate(const uint8_t unit) {
+      auto it = entries_.lower_bound(cache_key{unit, function_code::invalid, 0, 0});
+      while ((it != entries_.end()) && (it->first.unit == unit))
+        it = entries_.erase(it);
+    }
+
+    /**
+     * \brief drop all expired responses
+     */
+    void purge() {
+      int_least64_t now = now_();
+      for (auto it = entries_.begin(); it != entries_.end();) {
+        if (now - it->second.time >= ttl_)
+          it = entries_.erase(it);
+        else
+          it++;
+      }
+    }
+
+    /**
+     * \brief number of cached responses
+     */
+    size_t size() const { return entries_.size(); }
+
+  private:
+    struct entry {
+      frame_template response;
+      int_least64_t time;
+    };
+
+    void deliver(const cache_key& key, const frame_template& frame) {
+      auto pending = in_flight_.find(key);
+      if (pending == in_flight_.end())
+        return;
+      std::vector<std::pair<uint16_t, reply_type>> waiters = std::move(pending->second);
+      in_flight_.erase(pending);
+      for (const std::pair<uint16_t, reply_type>& waiter : waiters) {
+        std::string reply;
+        frame.stamp(waiter.first, reply);
+        waiter.second(reply);
+      }
+    }
+
+    const std::function<int_least64_t()> now_;
+    const int_least64_t ttl_;
+    std::map<cache_key, entry> entries_;
+    std::map<cache_key, std::vector<std::pair<uint16_t, reply_type>>> in_flight_;
+  };
+} // namespace cbus
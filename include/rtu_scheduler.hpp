@@ -0,0 +1,219 @@
+#pragma once
+
+#include "becker.hpp"
+#include "bus.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <optional>
+
+namespace cbus {
+  /**
+   * \brief config of a rtu master scheduler, all times in the time unit of now
+   */
+  struct scheduler_config {
+    /**
+     * \brief A lambda returning the current time, in the arbitrary time unit used by all times of this config
+     */
+    std::function<int_least64_t()> now;
+
+    /**
+     * \brief time to wait for a response if no timeout is set for the slave
+     */
+    int_least64_t response_timeout = 1000;
+
+    /**
+     * \brief silence on the line between the end of a transaction and the next request
+     */
+    int_least64_t turnaround_gap = 5;
+
+    /**
+     * \brief time a slave is skipped after its first timeout, doubled for each further timeout
+     */
+    int_least64_t backoff_base = 1000;
+
+    /**
+     * \brief maximum time a slave is skipped
+     */
+    int_least64_t backoff_max = 60000;
+  };
+
+  /**
+   * \brief result of a scheduled request
+   */
+  enum class request_status {
+    /**
+     * \brief response received
+     */
+    ok,
+    /**
+     * \brief no response within the timeout
+     */
+    timeout,
+    /**
+     * \brief not sent because the slave is in back-off after failures
+     */
+    skipped
+  };
+
+  /**
+   * \brief Scheduler for a rtu master line
+   * Only one request is outstanding at a time. Writes go to a high priority lane which is always served before queued polls.
+   * Slaves that timed out are skipped with an exponential back-off, so dead slaves do not block the line.
+   * All packets received by the bus have to be passed to received, poll has to be called regularly.
+   */
+  template <typename device_type> class rtu_scheduler {
+  public:
+    /**
+     * \brief callback receiving the result and the response, a packet_error with the request header if there is no response
+     */
+    using callback_type = std::function<void(request_status, const single_packet&)>;
+
+    /**
+     * \brief construct new scheduler
+     * \param target the bus to send on, has to outlive the scheduler
+     * \param cfg the config to use
+     */
+    rtu_scheduler(bus<device_type>& target, const scheduler_config& cfg) : bus_(target), config_(cfg) {}
+
+    /**
+     * \brief set the response timeout of a single slave
+     * \param unit the slave address
+     * \param timeout the timeout, 0 to use the default
+     */
+    void set_timeout(const uint8_t unit, const int_least64_t timeout) { slaves_[unit].timeout = timeout; }
+
+    /**
+     * \brief queue a request
+     * \param request the request to send
+     * \param callback called once with the result
+     * Writes are queued into the high priority lane, everything else is a poll.
+     */
+    template <typename packet_type> void submit(const packet_type& request, const callback_type& callback) {
+      submit(request, is_write(request.function), callback);
+    }
+
+    /**
+     * \brief queue a request into a specific lane
+     * \param request the request to send
+     * \param high_priority queue into the lane preempting polls
+     * \param callback called once with the result
+     */
+    template <typename packet_type> void submit(const packet_type& request, const bool high_priority, const callback_type& callback) {
+      (high_priority ? high_ : normal_).emplace_back(bus_.compile(request), request.address, request.function, callback);
+      poll();
+    }
+
+    /**
+     * \brief pass a packet received by the bus
+     * \param pkg the received packet
+     */
+    void received(const single_packet& pkg) {
+      const packet* header = get_header(pkg);
+      if (!outstanding_ || !header)
+        return;
+      if ((header->address != outstanding_->unit) || ((static_cast<uint8_t>(header->function) & 0x7f) != static_cast<uint8_t>(outstanding_->function)))
+        return;
+      slaves_[outstanding_->unit].failures = 0;
+      finish(request_status::ok, pkg);
+      poll();
+    }
+
+    /**
+     * \brief check timeouts and send the next request if the line is free
+     */
+    void poll() {
+      int_least64_t now = config_.now();
+      if (outstanding_) {
+        if (now - sent_time_ < timeout(outstanding_->unit))
+          return;
+        slave& s = slaves_[outstanding_->unit];
+        int_least64_t backoff = config_.backoff_base;
+        for (uint_least32_t i = 0; (i < s.failures) && (backoff < config_.backoff_max); i++)
+          backoff *= 2;
+        s.failures++;
+        s.backoff_until = now + std::min(backoff, config_.backoff_max);
+        finish(request_status::timeout, packet_error(packet(0, outstanding_->unit, outstanding_->function)));
+      }
+      while (!outstanding_ && (now - idle_since_ >= config_.turnaround_gap)) {
+        std::deque<request>& lane = high_.empty() ? normal_ : high_;
+        if (lane.empty())
+          return;
+        request next = std::move(lane.front());
+        lane.pop_front();
+        if (slaves_[next.unit].failures && (now < slaves_[next.unit].backoff_until)) {
+          next.callback(request_status::skipped, packet_error(packet(0, next.unit, next.function)));
+          continue;
+        }
+        outstanding_.emplace(std::move(next));
+        sent_time_ = now;
+        bus_.send(outstanding_->frame, transaction_id_++);
+      }
+    }
+
+    /**
+     * \brief check if a request is waiting for its response
+     */
+    bool busy() const { return outstanding_.has_value(); }
+
+    /**
+     * \brief number of queued requests, not including the outstanding one
+     */
+    size_t pending() const { return high_.size() + normal_.size(); }
+
+  private:
+    struct request {
+      request(const frame_template& p_frame, const uint8_t p_unit, const function_code p_function, const callback_type& p_callback)
+          : frame(p_frame), unit(p_unit), function(p_function), callback(p_callback) {}
+      frame_template frame;
+      uint8_t unit;
+      function_code function;
+      callback_type callback;
+    };
+
+    struct slave {
+      int_least64_t timeout = 0;
+      uint_least32_t failures = 0;
+      int_least64_t backoff_until = 0;
+    };
+
+    static bool is_write(const function_code function) {
+      switch (function) {
+      case function_code::write_single_coil:
+      case function_code::write_single_holding_register:
+      case function_code::write_multiple_coils:
+      case function_code::write_holding_registers:
+      case function_code::mask_write_register:
+      case function_code::read_write_registers:
+      case function_code::write_single_holding_register_devaddr:
+        return true;
+      default:
+        return false;
+      }
+    }
+
+    int_least64_t timeout(const uint8_t unit) const { return slaves_[unit].timeout ? slaves_[unit].timeout : config_.response_timeout; }
+
+    /**
+     * \brief complete the outstanding request and free the line
+     */
+    void finish(const request_status status, const single_packet& pkg) {
+      callback_type callback = outstanding_->callback;
+      outstanding_.reset();
+      idle_since_ = config_.now();
+      callback(status, pkg);
+    }
+
+    bus<device_type>& bus_;
+    const scheduler_config config_;
+    std::deque<request> high_;
+    std::deque<request> normal_;
+    std::optional<request> outstanding_;
+    std::array<slave, 256> slaves_;
+    int_least64_t sent_time_ = 0;
+    int_least64_t idle_since_ = INT_LEAST64_MIN / 2;
+    uint16_t transaction_id_ = 0;
+  };
+} // namespace cbus
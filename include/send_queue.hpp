@@ -0,0 +1,103 @@
+#pragma once
+
+#include "becker.hpp"
+#include "bus.hpp"
+#include <atomic>
+#include <string>
+
+namespace cbus {
+  /**
+   * \brief Multi-producer send queue for a single bus
+   * Any thread can enqueue packets without taking a lock, the packets are serialized on the calling thread.
+   * The thread owning the bus calls flush to write all queued frames. On tcp they are joined into a single device->send call,
+   * on rtu every frame gets its own call so the device can keep the inter-frame gap.
+   */
+  template <typename device_type> class send_queue {
+  public:
+    /**
+     * \brief construct new send queue
+     * \param target the bus to send on, has to outlive the queue
+     */
+    explicit send_queue(bus<device_type>& target) : bus_(target) {}
+    ~send_queue() { free_list(head_.exchange(nullptr, std::memory_order_acquire)); }
+    send_queue(const send_queue&) = delete;
+    send_queue& operator=(const send_queue&) = delete;
+
+    /**
+     * \brief enqueue a packet, may be called from any thread
+     * \param packet the packet to send
+     */
+    template <typename packet_type> void enqueue(const packet_type& packet) { enqueue_frame(bus_.serialize(packet)); }
+
+    /**
+     * \brief enqueue an already serialized frame, may be called from any thread
+     * \param frame complete frame for the bus
+     */
+    void enqueue_frame(std::string frame) {
+      node* n = new node{std::move(frame), head_.load(std::memory_order_relaxed)};
+      while (!head_.compare_exchange_weak(n->next, n, std::memory_order_release, std::memory_order_relaxed)) {
+      }
+    }
+
+    /**
+     * \brief write all queued frames, may only be called by the thread owning the bus
+     * \return number of written frames
+     */
+    size_t flush() {
+      node* list = head_.exchange(nullptr, std::memory_order_acquire);
+      if (!list)
+        return 0;
+      node* ordered = nullptr;
+      size_t count = 0;
+      size_t bytes = 0;
+      while (list) {
+        node* next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+        count++;
+        bytes += ordered->frame.size();
+      }
+      if (!bus_.tcp_format()) {
+        for (node* n = ordered; n; n = n->next)
+          bus_.send_frame(n->frame);
+        free_list(ordered);
+        return count;
+      }
+      buffer_.clear();
+      buffer_.reserve(bytes);
+      for (node* n = ordered; n; n = n->next)
+        buffer_.append(n->frame);
+      free_list(ordered);
+      bus_.send_frame(buffer_);
+      return count;
+    }
+
+    /**
+     * \brief check if frames are waiting for flush
+     */
+    bool empty() const { return head_.load(std::memory_order_relaxed) == nullptr; }
+
+  private:
+    struct node {
+      std::string frame;
+      node* next;
+    };
+
+    /**
+     * \brief delete a list of nodes
+     * \param list first node
+     */
+    static void free_list(node* list) {
+      while (list) {
+        node* next = list->next;
+        delete list;
+        list = next;
+      }
+    }
+
+    bus<device_type>& bus_;
+    std::atomic<node*> head_{nullptr};
+    std::string buffer_;
+  };
+} // namespace cbus
@@ -0,0 +1,297 @@
+#pragma once
+
+#include "becker.hpp"
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <functional>
+#include <linux/serial.h>
+#include <poll.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <system_error>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace cbus {
+  /**
+   * \brief parity of a serial line
+   */
+  enum class parity { none, even, odd };
+
+  /**
+   * \brief config of a serial device
+   */
+  struct serial_config {
+    /**
+     * \brief baud rate, has to be a standard rate
+     */
+    uint_least32_t baud = 19200;
+
+    /**
+     * \brief parity bit
+     */
+    cbus::parity parity = parity::even;
+
+    /**
+     * \brief number of stop bits, 1 or 2
+     */
+    uint8_t stop_bits = 1;
+
+    /**
+     * \brief request ASYNC_LOW_LATENCY from the driver, ignored if the driver does not support it
+     */
+    bool low_latency = true;
+
+    /**
+     * \brief let the driver switch the RS-485 transceiver with RTS
+     */
+    bool rs485 = false;
+
+    /**
+     * \brief RTS level while sending, the inverse is used while receiving
+     */
+    bool rts_on_send = true;
+
+    /**
+     * \brief delay between enabling the transmitter and sending in milliseconds
+     */
+    uint32_t rs485_delay_before_send = 0;
+
+    /**
+     * \brief delay between the end of sending and disabling the transmitter in milliseconds
+     */
+    uint32_t rs485_delay_after_send = 0;
+
+    /**
+     * \brief keep reading until the line is silent for 1.5 characters, so a frame is passed in one piece
+     */
+    bool coalesce = true;
+  };
+
+  /**
+   * \brief Device for a serial line, usually carrying modbus rtu
+   * The line is put into raw mode with 8 data bits. Received data is read in bulk from a non-blocking descriptor,
+   * by default until the inter character timeout passed, so the bus sees whole frames instead of single bytes.
+   * The device is driven by calling poll, it is not thread safe.
+   * Linux only, so it is not part of cbus.hpp and has to be included directly.
+   */
+  class serial_device {
+  public:
+    /**
+     * \brief open a serial port
+     * \param path path of the tty
+     * \param cfg the config to use
+     */
+    serial_device(const std::string& path, const serial_config& cfg) : serial_device(open_tty(path), cfg) {}
+
+    /**
+     * \brief use an already opened tty, e.g. the slave side of a pty
+     * \param fd the descriptor, the device takes ownership
+     * \param cfg the config to use
+     */
+    serial_device(const int fd, const serial_config& cfg) : fd_(fd), config_(cfg), gap_ns_(inter_character_timeout(cfg)) {
+      try {
+        setup();
+      } catch (...) {
+        ::close(fd_);
+        throw;
+      }
+    }
+
+    serial_device(const serial_device&) = delete;
+    serial_device& operator=(const serial_device&) = delete;
+
+    ~serial_device() { ::close(fd_); }
+
+    /**
+     * \brief register the handler receiving data, called from poll
+     * \param handler the handler
+     */
+    void register_handler(std::function<void(const std::string&)> handler) { handler_ = handler; }
+
+    /**
+     * \brief write data, waits until the driver accepted all of it
+     * \param data the data
+     */
+    void send(std::string data) {
+      size_t offset = 0;
+      while (open_ && (offset < data.size())) {
+        ssize_t ret = ::write(fd_, data.data() + offset, data.size() - offset);
+        if (ret > 0)
+          offset += static_cast<size_t>(ret);
+        else if ((ret < 0) && (errno == EAGAIN)) {
+          pollfd out{fd_, POLLOUT, 0};
+          ::poll(&out, 1, -1);
+        } else if ((ret >= 0) || (errno != EINTR))
+          open_ = false;
+      }
+    }
+
+    /**
+     * \brief wait for received data and pass it to the handler
+     * \param timeout_ms time to wait for data, 0 to not block, -1 to wait forever
+     * \return false if the device is closed
+     */
+    bool poll(const int timeout_ms = 0) {
+      if (!open_)
+        return false;
+      pollfd in{fd_, static_cast<short>(paused_ ? 0 : POLLIN), 0};
+      int ret = ::poll(&in, 1, timeout_ms);
+      if ((ret < 0) && (errno != EINTR))
+        open_ = false;
+      if ((ret <= 0) || !open_ || paused_)
+        return open_;
+      data_.clear();
+      while (read_available() && config_.coalesce && (data_.size() < 256)) {
+        timespec gap{0, static_cast<long>(gap_ns_)};
+        if (ppoll(&in, 1, &gap, nullptr) <= 0)
+          break;
+      }
+      if (!data_.empty() && handler_)
+        handler_(data_);
+      return open_;
+    }
+
+    /**
+     * \brief stop or continue reading, the driver buffers the data meanwhile
+     * \param paused true to stop reading
+     */
+    void pause_receive(const bool paused) { paused_ = paused; }
+
+    /**
+     * \brief check if the device is still usable
+     */
+    bool open() const { return open_; }
+
+    /**
+     * \brief check if the driver accepted ASYNC_LOW_LATENCY
+     */
+    bool low_latency() const { return low_latency_; }
+
+    /**
+     * \brief time of a single character on the line in nanoseconds
+     * \param cfg the config of the line
+     */
+    static int_least64_t character_time(const serial_config& cfg) {
+      int_least64_t bits = 1 + 8 + ((cfg.parity == parity::none) ? 0 : 1) + cfg.stop_bits;
+      return (bits * 1000000000 + cfg.baud - 1) / cfg.baud;
+    }
+
+    /**
+     * \brief silence ending a frame in nanoseconds, 1.5 characters and fixed above 19200 baud as required by modbus rtu
+     * \param cfg the config of the line
+     */
+    static int_least64_t inter_character_timeout(const serial_config& cfg) {
+      return (cfg.baud > 19200) ? 750000 : (character_time(cfg) * 3 + 1) / 2;
+    }
+
+  private:
+    static int open_tty(const std::string& path) {
+      int fd = ::open(path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+      if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "open " + path);
+      return fd;
+    }
+
+    static speed_t speed(const uint_least32_t baud) {
+      switch (baud) {
+      case 1200:
+        return B1200;
+      case 2400:
+        return B2400;
+      case 4800:
+        return B4800;
+      case 9600:
+        return B9600;
+      case 19200:
+        return B19200;
+      case 38400:
+        return B38400;
+      case 57600:
+        return B57600;
+      case 115200:
+        return B115200;
+      case 230400:
+        return B230400;
+      case 460800:
+        return B460800;
+      case 921600:
+        return B921600;
+      default:
+        throw std::system_error(EINVAL, std::generic_category(), "unsupported baud rate " + std::to_string(baud));
+      }
+    }
+
+    void setup() {
+      becker::bassert((config_.stop_bits == 1) || (config_.stop_bits == 2), __FILE__, __LINE__, "invalid number of stop bits");
+      int flags = fcntl(fd_, F_GETFL);
+      if ((flags < 0) || (fcntl(fd_, F_SETFL, flags | O_NONBLOCK) != 0))
+        throw std::system_error(errno, std::generic_category(), "fcntl");
+      termios tio;
+      if (tcgetattr(fd_, &tio) != 0)
+        throw std::system_error(errno, std::generic_category(), "tcgetattr");
+      cfmakeraw(&tio);
+      tio.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS);
+      tio.c_cflag |= CS8 | CLOCAL | CREAD;
+      if (config_.parity != parity::none)
+        tio.c_cflag |= PARENB | ((config_.parity == parity::odd) ? PARODD : 0);
+      if (config_.stop_bits == 2)
+        tio.c_cflag |= CSTOPB;
+      // frame timing is done with ppoll as VTIME only has a resolution of 100ms, VMIN 1 makes an empty read fail with EAGAIN instead of 0
+      tio.c_cc[VMIN] = 1;
+      tio.c_cc[VTIME] = 0;
+      speed_t rate = speed(config_.baud);
+      if ((cfsetispeed(&tio, rate) != 0) || (cfsetospeed(&tio, rate) != 0) || (tcsetattr(fd_, TCSANOW, &tio) != 0))
+        throw std::system_error(errno, std::generic_category(), "tcsetattr");
+      tcflush(fd_, TCIOFLUSH);
+      if (config_.low_latency) {
+        serial_struct serial;
+        if (ioctl(fd_, TIOCGSERIAL, &serial) == 0) {
+          serial.flags |= ASYNC_LOW_LATENCY;
+          low_latency_ = (ioctl(fd_, TIOCSSERIAL, &serial) == 0);
+        }
+      }
+      if (config_.rs485) {
+        serial_rs485 rs485{};
+        rs485.flags = SER_RS485_ENABLED | (config_.rts_on_send ? SER_RS485_RTS_ON_SEND : SER_RS485_RTS_AFTER_SEND);
+        rs485.delay_rts_before_send = config_.rs485_delay_before_send;
+        rs485.delay_rts_after_send = config_.rs485_delay_after_send;
+        if (ioctl(fd_, TIOCSRS485, &rs485) != 0)
+          throw std::system_error(errno, std::generic_category(), "TIOCSRS485");
+      }
+    }
+
+    /**
+     * \brief read everything the driver has buffered
+     * \return false if nothing was read
+     */
+    bool read_available() {
+      bool any = false;
+      char buffer[4096];
+      while (true) {
+        ssize_t ret = ::read(fd_, buffer, sizeof(buffer));
+        if (ret > 0) {
+          data_.append(buffer, static_cast<size_t>(ret));
+          any = true;
+        } else if ((ret < 0) && (errno == EINTR))
+          continue;
+        else {
+          if ((ret == 0) || (errno != EAGAIN))
+            open_ = false;
+          return any && open_;
+        }
+      }
+    }
+
+    const int fd_;
+    const serial_config config_;
+    const int_least64_t gap_ns_;
+    bool open_ = true;
+    bool paused_ = false;
+    bool low_latency_ = false;
+    std::function<void(const std::string&)> handler_;
+    std::string data_;
+  };
+} // namespace cbus
@@ -0,0 +1,398 @@
+#pragma once
+
+#include "becker.hpp"
+#include "contents.hpp"
+#include "interval_set.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+namespace cbus {
+  /**
+   * \brief Register and coil image in POSIX shared memory
+   * One process owns the image, writes it directly and answers requests of a slave bus from it.
+   * Any number of other processes can map the same image, read it without locks and queue writes which the owner applies.
+   * Reads are protected by one sequence lock per block of 64 registers or 512 coils, so each block is read consistently.
+   * The owner tracks the ranges written by requests and queued writes, so it can propagate them without scanning the image.
+   * Needs POSIX shared memory, so it is not part of cbus.hpp and has to be included directly.
+   */
+  class shm_image {
+  public:
+    /**
+     * \brief number of registers per sequence lock
+     */
+    static constexpr size_t registers_per_block = 64;
+    /**
+     * \brief number of coils per sequence lock
+     */
+    static constexpr size_t coils_per_block = 512;
+    /**
+     * \brief number of queued writes which fit into the image
+     */
+    static constexpr size_t queue_size = 256;
+    /**
+     * \brief maximum number of registers or coils in a single queued write
+     */
+    static constexpr size_t max_queued_values = 123;
+
+    /**
+     * \brief tables inside the image
+     */
+    enum class table : uint16_t { coils, discrete_inputs, input_registers, holding_registers };
+
+    /**
+     * \brief map a shared memory image
+     * \param name name of the shared memory object, starting with a slash
+     * \param owner create and initialize the image, the owner has to be created first
+     */
+    shm_image(const std::string& name, const bool owner) : name_(name), owner_(owner) {
+      int fd = shm_open(name.c_str(), owner ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0660);
+      if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "shm_open " + name);
+      if (owner && (ftruncate(fd, sizeof(layout)) != 0)) {
+        int error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), "ftruncate " + name);
+      }
+      void* memory = mmap(nullptr, sizeof(layout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      int error = errno;
+      ::close(fd);
+      if (memory == MAP_FAILED)
+        throw std::system_error(error, std::generic_category(), "mmap " + name);
+      image_ = static_cast<layout*>(memory);
+      if (owner) {
+        for (size_t i = 0; i < queue_size; i++)
+          image_->queue[i].sequence.store(i, std::memory_order_relaxed);
+        image_->magic.store(magic_value, std::memory_order_release);
+      } else if (image_->magic.load(std::memory_order_acquire) != magic_value) {
+        munmap(image_, sizeof(layout));
+        throw std::domain_error("shared memory image " + name + " is not initialized");
+      }
+    }
+    ~shm_image() {
+      munmap(image_, sizeof(layout));
+      if (owner_)
+        shm_unlink(name_.c_str());
+    }
+    shm_image(const shm_image&) = delete;
+    shm_image& operator=(const shm_image&) = delete;
+
+    /**
+     * \brief write registers, only allowed for the owner
+     * \param t input_registers or holding_registers
+     * \param first address of the first register
+     * \param values the values to write
+     */
+    void write_registers(const table t, const uint16_t first, const std::vector<uint16_t>& values) {
+      becker::bassert(owner_, __FILE__, __LINE__, "only the owner writes directly");
+      becker::bassert(first + values.size() <= 0x10000, __FILE__, __LINE__, "register range out of bounds");
+      std::atomic<uint16_t>* target = registers(t);
+      std::atomic<uint32_t>* locks = register_locks(t);
+      size_t i = 0;
+      while (i < values.size()) {
+        size_t block = (first + i) / registers_per_block;
+        size_t end = std::min(values.size(), (block + 1) * registers_per_block - first);
+        begin_write(locks[block]);
+        for (; i < end; i++)
+          target[first + i].store(values[i], std::memory_order_relaxed);
+        end_write(locks[block]);
+      }
+    }
+
+    /**
+     * \brief read registers without locking, allowed for any process
+     * \param t input_registers or holding_registers
+     * \param first address of the first register
+     * \param count number of registers
+     * \return the values
+     */
+    std::vector<uint16_t> read_registers(const table t, const uint16_t first, const size_t count) const {
+      becker::bassert(first + count <= 0x10000, __FILE__, __LINE__, "register range out of bounds");
+      const std::atomic<uint16_t>* source = registers(t);
+      const std::atomic<uint32_t>* locks = register_locks(t);
+      std::vector<uint16_t> values(count);
+      size_t i = 0;
+      while (i < count) {
+        size_t block = (first + i) / registers_per_block;
+        size_t end = std::min(count, (block + 1) * registers_per_block - first);
+        uint32_t version;
+        do {
+          version = begin_read(locks[block]);
+          for (size_t j = i; j < end; j++)
+            values[j] = source[first + j].load(std::memory_order_relaxed);
+        } while (!end_read(locks[block], version));
+        i = end;
+      }
+      return values;
+    }
+
+    /**
+     * \brief write coils or discrete inputs, only allowed for the owner
+     * \param t coils or discrete_inputs
+     * \param first address of the first coil
+     * \param values the values to write
+     */
+    void write_coils(const table t, const uint16_t first, const std::vector<bool>& values) {
+      becker::bassert(owner_, __FILE__, __LINE__, "only the owner writes directly");
+      becker::bassert(first + values.size() <= 0x10000, __FILE__, __LINE__, "coil range out of bounds");
+      std::atomic<uint8_t>* target = coils(t);
+      std::atomic<uint32_t>* locks = coil_locks(t);
+      size_t i = 0;
+      while (i < values.size()) {
+        size_t block = (first + i) / coils_per_block;
+        size_t end = std::min(values.size(), (block + 1) * coils_per_block - first);
+        begin_write(locks[block]);
+        for (; i < end; i++) {
+          size_t address = first + i;
+          uint8_t byte = target[address / 8].load(std::memory_order_relaxed);
+          if (values[i])
+            byte |= 1 << (address % 8);
+          else
+            byte &= ~(1 << (address % 8));
+          target[address / 8].store(byte, std::memory_order_relaxed);
+        }
+        end_write(locks[block]);
+      }
+    }
+
+    /**
+     * \brief read coils or discrete inputs without locking, allowed for any process
+     * \param t coils or discrete_inputs
+     * \param first address of the first coil
+     * \param count number of coils
+     * \return the values
+     */
+    std::vector<bool> read_coils(const table t, const uint16_t first, const size_t count) const {
+      becker::bassert(first + count <= 0x10000, __FILE__, __LINE__, "coil range out of bounds");
+      const std::atomic<uint8_t>* source = coils(t);
+      const std::atomic<uint32_t>* locks = coil_locks(t);
+      std::vector<bool> values(count);
+      size_t i = 0;
+      while (i < count) {
+        size_t block = (first + i) / coils_per_block;
+        size_t end = std::min(count, (block + 1) * coils_per_block - first);
+        uint32_t version;
+        do {
+          version = begin_read(locks[block]);
+          for (size_t j = i; j < end; j++) {
+            size_t address = first + j;
+            values[j] = (source[address / 8].load(std::memory_order_relaxed) >> (address % 8)) & 1;
+          }
+        } while (!end_read(locks[block], version));
+        i = end;
+      }
+      return values;
+    }
+
+    /**
+     * \brief queue a register write for the owner, allowed for any process
+     * \param t input_registers or holding_registers
+     * \param first address of the first register
+     * \param values the values to write, at most max_queued_values
+     * \return false if the queue is full
+     */
+    bool queue_write(const table t, const uint16_t first, const std::vector<uint16_t>& values) {
+      becker::bassert((t == table::input_registers) || (t == table::holding_registers), __FILE__, __LINE__, "not a register table");
+      return enqueue(t, first, values.size(), [&values](uint16_t* target) {
+        for (size_t i = 0; i < values.size(); i++)
+          target[i] = values[i];
+      });
+    }
+
+    /**
+     * \brief queue a coil write for the owner, allowed for any process
+     * \param t coils or discrete_inputs
+     * \param first address of the first coil
+     * \param values the values to write, at most max_queued_values
+     * \return false if the queue is full
+     */
+    bool queue_write(const table t, const uint16_t first, const std::vector<bool>& values) {
+      becker::bassert((t == table::coils) || (t == table::discrete_inputs), __FILE__, __LINE__, "not a coil table");
+      return enqueue(t, first, values.size(), [&values](uint16_t* target) {
+        for (size_t i = 0; i < values.size(); i++)
+          target[i] = values[i];
+      });
+    }
+
+    /**
+     * \brief apply all queued writes, only allowed for the owner
+     * \return the number of applied writes
+     */
+    size_t apply_queued_writes() {
+      becker::bassert(owner_, __FILE__, __LINE__, "only the owner applies writes");
+      size_t applied = 0;
+      while (true) {
+        uint64_t position = image_->queue_tail.load(std::memory_order_relaxed);
+        queued_write& slot = image_->queue[position % queue_size];
+        if (slot.sequence.load(std::memory_order_acquire) != position + 1)
+          break;
+        table t = static_cast<table>(slot.target);
+        if ((t == table::coils) || (t == table::discrete_inputs))
+          write_coils(t, slot.first, std::vector<bool>(slot.values, slot.values + slot.count));
+        else
+          write_registers(t, slot.first, std::vector<uint16_t>(slot.values, slot.values + slot.count));
+        dirty_[slot.target].insert(slot.first, slot.count);
+        slot.sequence.store(position + queue_size, std::memory_order_release);
+        image_->queue_tail.store(position + 1, std::memory_order_relaxed);
+        applied++;
+      }
+      return applied;
+    }
+
+    /**
+     * \brief answer a request of a slave bus from the image
+     * \param request the received packet
+     * \param respond called with the concrete response packet
+     * \return false if the packet is no request handled by the image
+     * Writes are applied directly, so this is only allowed for the owner.
+     */
+    template <typename F> bool answer(const single_packet& request, F&& respond) {
+      if (const read_holding_registers_request* r = std::get_if<read_holding_registers_request>(&request)) {
+        if (!valid_range(r->first_register, r->register_count, 125))
+          respond(error_response(r->transaction_id, r->address, r->function, error_code::illegal_data_address));
+        else
+          respond(read_holding_registers_response(*r, read_registers(table::holding_registers, r->first_register, r->register_count)));
+        return true;
+      }
+      if (const read_input_registers_request* r = std::get_if<read_input_registers_request>(&request)) {
+        if (!valid_range(r->first_register, r->register_count, 125))
+          respond(error_response(r->transaction_id, r->address, r->function, error_code::illegal_data_address));
+        else
+          respond(read_input_registers_response(*r, read_registers(table::input_registers, r->first_register, r->register_count)));
+        return true;
+      }
+      if (const read_coils_request* r = std::get_if<read_coils_request>(&request)) {
+        if (!valid_range(r->first_coil, r->coil_count, 2000))
+          respond(error_response(r->transaction_id, r->address, r->function, error_code::illegal_data_address));
+        else
+          respond(read_coils_response(*r, read_coils(table::coils, r->first_coil, r->coil_count)));
+        return true;
+      }
+      if (const write_single_holding_register_request* r = std::get_if<write_single_holding_register_request>(&request)) {
+        write_registers(table::holding_registers, r->register_index, {r->register_value});
+        dirty_[static_cast<size_t>(table::holding_registers)].insert(r->register_index, 1);
+        respond(write_single_holding_register_response(*r, r->register_index, r->register_value));
+        return true;
+      }
+      if (const write_holding_registers_request* r = std::get_if<write_holding_registers_request>(&request)) {
+        if (!valid_range(r->first_register, r->register_content.size(), 123)) {
+          respond(error_response(r->transaction_id, r->address, r->function, error_code::illegal_data_address));
+        } else {
+          write_registers(table::holding_registers, r->first_register, r->register_content);
+          dirty_[static_cast<size_t>(table::holding_registers)].insert(r->first_register, r->register_content.size());
+          respond(write_holding_registers_response(*r, r->first_register, r->register_content.size()));
+        }
+        return true;
+      }
+      return false;
+    }
+
+    /**
+     * \brief true if a table was written by a request or a queued write since the last drain, only allowed for the owner
+     * \param t the table
+     */
+    bool dirty(const table t) const { return !dirty_[static_cast<size_t>(t)].empty(); }
+
+    /**
+     * \brief take the ranges of a table written by requests and queued writes since the last drain, only allowed for the owner
+     * \param t the table
+     * \return the written ranges in address order, merged if they overlap or touch
+     * Direct writes of the owner are not tracked. Ranges are tracked when written, even if the values did not change.
+     */
+    std::vector<changed_range> drain_dirty(const table t) {
+      becker::bassert(owner_, __FILE__, __LINE__, "only the owner tracks written ranges");
+      return dirty_[static_cast<size_t>(t)].drain();
+    }
+
+  private:
+    static constexpr uint32_t magic_value = 0x63627573;
+    static constexpr size_t register_blocks = 0x10000 / registers_per_block;
+    static constexpr size_t coil_blocks = 0x10000 / coils_per_block;
+
+    static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free, "shared memory needs lock free atomics");
+
+    struct queued_write {
+      std::atomic<uint64_t> sequence;
+      uint16_t target;
+      uint16_t first;
+      uint16_t count;
+      uint16_t values[max_queued_values];
+    };
+
+    struct layout {
+      std::atomic<uint32_t> magic;
+      std::atomic<uint32_t> register_locks[2][register_blocks];
+      std::atomic<uint32_t> coil_locks[2][coil_blocks];
+      std::atomic<uint16_t> registers[2][0x10000];
+      std::atomic<uint8_t> coils[2][0x10000 / 8];
+      alignas(64) std::atomic<uint64_t> queue_head;
+      alignas(64) std::atomic<uint64_t> queue_tail;
+      queued_write queue[queue_size];
+    };
+
+    static bool valid_range(const uint16_t first, const size_t count, const size_t limit) { return (count > 0) && (count <= limit) && (first + count <= 0x10000); }
+
+    std::atomic<uint16_t>* registers(const table t) const { return image_->registers[t == table::holding_registers]; }
+    std::atomic<uint32_t>* register_locks(const table t) const { return image_->register_locks[t == table::holding_registers]; }
+    std::atomic<uint8_t>* coils(const table t) const { return image_->coils[t == table::discrete_inputs]; }
+    std::atomic<uint32_t>* coil_locks(const table t) const { return image_->coil_locks[t == table::discrete_inputs]; }
+
+    static void begin_write(std::atomic<uint32_t>& lock) {
+      lock.store(lock.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+    static void end_write(std::atomic<uint32_t>& lock) { lock.store(lock.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+    static uint32_t begin_read(const std::atomic<uint32_t>& lock) {
+      uint32_t version;
+      while ((version = lock.load(std::memory_order_acquire)) & 1) {
+      }
+      return version;
+    }
+    static bool end_read(const std::atomic<uint32_t>& lock, const uint32_t version) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return lock.load(std::memory_order_relaxed) == version;
+    }
+
+    /**
+     * \brief claim a queue slot and fill it
+     */
+    template <typename F> bool enqueue(const table t, const uint16_t first, const size_t count, F&& fill) {
+      becker::bassert(count <= max_queued_values, __FILE__, __LINE__, "too many values for a queued write");
+      becker::bassert(first + count <= 0x10000, __FILE__, __LINE__, "range out of bounds");
+      uint64_t position = image_->queue_head.load(std::memory_order_relaxed);
+      while (true) {
+        queued_write& slot = image_->queue[position % queue_size];
+        uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence == position) {
+          if (image_->queue_head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+            slot.target = static_cast<uint16_t>(t);
+            slot.first = first;
+            slot.count = static_cast<uint16_t>(count);
+            fill(slot.values);
+            slot.sequence.store(position + 1, std::memory_order_release);
+            return true;
+          }
+        } else if (sequence < position) {
+          return false;
+        } else {
+          position = image_->queue_head.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    const std::string name_;
+    const bool owner_;
+    layout* image_;
+    /**
+     * \brief written ranges per table, local to the owner process
+     */
+    interval_set dirty_[4];
+  };
+} // namespace cbus
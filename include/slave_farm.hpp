@@ -0,0 +1,479 @@
+#pragma once
+
+#include "becker.hpp"
+#include "bus.hpp"
+#include <array>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+namespace cbus {
+  /**
+   * \brief faults injected by a simulated slave, all rates are probabilities per request
+   */
+  struct fault_config {
+    /**
+     * \brief answer with an error_response
+     */
+    double error_rate = 0;
+
+    /**
+     * \brief error code of injected error responses
+     */
+    error_code error = error_code::slave_device_failure;
+
+    /**
+     * \brief flip a bit in the last byte of the frame, the crc for rtu
+     */
+    double corrupt_rate = 0;
+
+    /**
+     * \brief send only a random prefix of the frame
+     */
+    double truncate_rate = 0;
+
+    /**
+     * \brief do not answer at all
+     */
+    double drop_rate = 0;
+  };
+
+  /**
+   * \brief config of a simulated slave, times in the time unit of the farm
+   */
+  struct simulated_slave_config {
+    /**
+     * \brief unit id the slave answers to
+     */
+    uint8_t unit = 1;
+
+    /**
+     * \brief number of holding and of input registers
+     */
+    uint16_t registers = 1024;
+
+    /**
+     * \brief number of coils
+     */
+    uint16_t coils = 1024;
+
+    /**
+     * \brief minimum time between request and response
+     */
+    int_least64_t delay = 0;
+
+    /**
+     * \brief maximum random time added to the delay
+     */
+    int_least64_t jitter = 0;
+
+    /**
+     * \brief maximum change of each input register per drift step
+     */
+    uint16_t drift = 0;
+
+    /**
+     * \brief injected faults
+     */
+    fault_config faults;
+  };
+
+  /**
+   * \brief Register image of a single simulated slave answering request pdus
+   * Supports read coils, read holding and input registers and writing single and multiple holding registers.
+   */
+  class simulated_slave {
+  public:
+    /**
+     * \brief construct new slave with all values zero
+     * \param cfg the config to use
+     */
+    explicit simulated_slave(const simulated_slave_config& cfg)
+        : config_(cfg), holding_registers_(cfg.registers), input_registers_(cfg.registers), coils_(cfg.coils) {}
+
+    /**
+     * \brief the config of the slave
+     */
+    const simulated_slave_config& config() const { return config_; }
+
+    /**
+     * \brief the holding registers, writable by the master
+     */
+    std::vector<uint16_t>& holding_registers() { return holding_registers_; }
+
+    /**
+     * \brief the input registers, changed by drift
+     */
+    std::vector<uint16_t>& input_registers() { return input_registers_; }
+
+    /**
+     * \brief the coils
+     */
+    std::vector<bool>& coils() { return coils_; }
+
+    /**
+     * \brief number of answered requests
+     */
+    uint_least64_t requests() const { return requests_; }
+
+    /**
+     * \brief answer a request
+     * \param pdu function code and data of the request
+     * \param size size of the pdu
+     * \param out the response pdu is appended
+     */
+    void answer(const char* pdu, const size_t size, std::string& out) {
+      requests_++;
+      uint8_t function = static_cast<uint8_t>(pdu[0]);
+      uint16_t first = (size >= 5) ? u16(pdu + 1) : 0;
+      uint16_t count = (size >= 5) ? u16(pdu + 3) : 0;
+      if ((size < 5) && supported(function))
+        return error(function, error_code::illegal_data_value, out);
+      switch (static_cast<function_code>(function)) {
+      case function_code::read_holding_registers:
+      case function_code::read_input_registers: {
+        const std::vector<uint16_t>& table = (function == static_cast<uint8_t>(function_code::read_holding_registers)) ? holding_registers_ : input_registers_;
+        if ((count == 0) || (count > 125))
+          return error(function, error_code::illegal_data_value, out);
+        if (first + count > table.size())
+          return error(function, error_code::illegal_data_address, out);
+        out.push_back(static_cast<char>(function));
+        out.push_back(static_cast<char>(count * 2));
+        for (size_t i = first; i < first + count; i++) {
+          out.push_back(static_cast<char>(table[i] >> 8));
+          out.push_back(static_cast<char>(table[i]));
+        }
+        return;
+      }
+      case function_code::read_coils: {
+        if ((count == 0) || (count > 2000))
+          return error(function, error_code::illegal_data_value, out);
+        if (first + count > coils_.size())
+          return error(function, error_code::illegal_data_address, out);
+        out.push_back(static_cast<char>(function));
+        out.push_back(static_cast<char>((count + 7) / 8));
+        for (size_t i = 0; i < count; i += 8) {
+          uint8_t byte = 0;
+          for (size_t bit = 0; (bit < 8) && (i + bit < count); bit++)
+            byte |= coils_[first + i + bit] << bit;
+          out.push_back(static_cast<char>(byte));
+        }
+        return;
+      }
+      case function_code::write_single_holding_register:
+        if (first >= holding_registers_.size())
+          return error(function, error_code::illegal_data_address, out);
+        holding_registers_[first] = count;
+        out.append(pdu, 5);
+        return;
+      case function_code::write_holding_registers: {
+        if ((size < 6) || (count == 0) || (count > 123) || (static_cast<uint8_t>(pdu[5]) != count * 2) || (size < 6 + count * 2u))
+          return error(function, error_code::illegal_data_value, out);
+        if (first + count > holding_registers_.size())
+          return error(function, error_code::illegal_data_address, out);
+        for (size_t i = 0; i < count; i++)
+          holding_registers_[first + i] = u16(pdu + 6 + i * 2);
+        out.append(pdu, 5);
+        return;
+      }
+      default:
+        return error(function, error_code::illegal_function, out);
+      }
+    }
+
+    /**
+     * \brief random walk of all input registers by at most the configured drift
+     * \param random source of random numbers
+     */
+    template <typename F> void drift(F&& random) {
+      if (!config_.drift)
+        return;
+      for (uint16_t& value : input_registers_)
+        value = static_cast<uint16_t>(value + static_cast<int_least32_t>(random() % (2u * config_.drift + 1)) - config_.drift);
+    }
+
+    /**
+     * \brief append an exception response
+     * \param function the function code of the request
+     * \param code the error code
+     * \param out the response pdu is appended
+     */
+    static void error(const uint8_t function, const error_code code, std::string& out) {
+      out.push_back(static_cast<char>(function | 0x80));
+      out.push_back(static_cast<char>(code));
+    }
+
+  private:
+    static bool supported(const uint8_t function) {
+      switch (static_cast<function_code>(function)) {
+      case function_code::read_coils:
+      case function_code::read_holding_registers:
+      case function_code::read_input_registers:
+      case function_code::write_single_holding_register:
+      case function_code::write_holding_registers:
+        return true;
+      default:
+        return false;
+      }
+    }
+
+    static uint16_t u16(const char* data) { return static_cast<uint16_t>((static_cast<uint8_t>(data[0]) << 8) | static_cast<uint8_t>(data[1])); }
+
+    const simulated_slave_config config_;
+    std::vector<uint16_t> holding_registers_;
+    std::vector<uint16_t> input_registers_;
+    std::vector<bool> coils_;
+    uint_least64_t requests_ = 0;
+  };
+
+  /**
+   * \brief Farm of simulated slaves behind any number of devices for load testing masters
+   * Each device is a tcp connection or a rtu line carrying any number of units. Requests are framed and answered
+   * directly from the received bytes without building packets, so a single thread serves several 100k requests per second.
+   * Delayed responses are sent by poll, which has to be called regularly if delays are configured.
+   * Only meant for testing, so it is not part of cbus.hpp and has to be included directly.
+   */
+  class slave_farm {
+  public:
+    /**
+     * \brief construct new farm
+     * \param now A lambda returning the current time, in the arbitrary time unit of the delays and jitter of the slaves
+     * \param seed seed of the random numbers driving jitter, faults and drift
+     */
+    slave_farm(const std::function<int_least64_t()> now, const uint_least64_t seed = 1) : now_(now), random_state_(seed ? seed : 1) {}
+
+    /**
+     * \brief attach a device
+     * \param device the device, the farm only keeps a weak reference but has to outlive it or detach it
+     * \param tcp use tcp framing, rtu otherwise
+     * \return id of the endpoint to add slaves to
+     */
+    template <typename device_type> size_t attach(const std::shared_ptr<device_type>& device, const bool tcp) {
+      size_t id = endpoints_.size();
+      std::weak_ptr<device_type> weak = device;
+      endpoints_.push_back(std::make_unique<endpoint>());
+      endpoint& e = *endpoints_.back();
+      e.id = id;
+      e.tcp = tcp;
+      e.send = [weak](const std::string& data) {
+        std::shared_ptr<device_type> target = weak.lock();
+        if (target)
+          target->send(data);
+      };
+      e.units.fill(nullptr);
+      device->register_handler([this, id](const std::string& data) { feed(id, data); });
+      return id;
+    }
+
+    /**
+     * \brief add a slave behind an endpoint, replacing one with the same unit id
+     * \param endpoint_id the endpoint returned by attach
+     * \param cfg the config of the slave
+     * \return the slave, valid as long as the farm
+     */
+    simulated_slave& add_slave(const size_t endpoint_id, const simulated_slave_config& cfg) {
+      becker::bassert(endpoint_id < endpoints_.size(), __FILE__, __LINE__, "invalid endpoint");
+      slaves_.emplace_back(cfg);
+      endpoints_[endpoint_id]->units[cfg.unit] = &slaves_.back();
+      return slaves_.back();
+    }
+
+    /**
+     * \brief serve an existing slave behind another endpoint as well, e.g. for every connection of a listener
+     * \param endpoint_id the endpoint returned by attach
+     * \param slave a slave of this farm
+     */
+    void add_slave(const size_t endpoint_id, simulated_slave& slave) {
+      becker::bassert(endpoint_id < endpoints_.size(), __FILE__, __LINE__, "invalid endpoint");
+      endpoints_[endpoint_id]->units[slave.config().unit] = &slave;
+    }
+
+    /**
+     * \brief detach an endpoint whose device was closed, its delayed responses are dropped
+     * \param endpoint_id the endpoint returned by attach
+     */
+    void detach(const size_t endpoint_id) { endpoints_.at(endpoint_id).reset(); }
+
+    /**
+     * \brief pass received data of an endpoint, called by the device handler
+     * \param endpoint_id the endpoint
+     * \param data the received data
+     */
+    void feed(const size_t endpoint_id, const std::string& data) {
+      if (!endpoints_[endpoint_id])
+        return;
+      endpoint& e = *endpoints_[endpoint_id];
+      e.cache.append(data);
+      size_t offset = 0;
+      while (offset < e.cache.size()) {
+        size_t used = e.tcp ? frame_tcp(e, offset) : frame_rtu(e, offset);
+        if (!used)
+          break;
+        offset += used;
+      }
+      e.cache.erase(0, offset);
+      if (!pending_.empty())
+        poll();
+    }
+
+    /**
+     * \brief send all delayed responses that are due
+     */
+    void poll() {
+      int_least64_t now = now_();
+      while (!pending_.empty() && (pending_.top().due <= now)) {
+        const delayed& next = pending_.top();
+        if (endpoints_[next.endpoint])
+          endpoints_[next.endpoint]->send(next.frame);
+        pending_.pop();
+      }
+    }
+
+    /**
+     * \brief apply one drift step to all slaves
+     */
+    void drift() {
+      for (simulated_slave& slave : slaves_)
+        slave.drift([this] { return random(); });
+    }
+
+    /**
+     * \brief number of delayed responses not sent yet
+     */
+    size_t pending() const { return pending_.size(); }
+
+    /**
+     * \brief number of answered requests over all slaves
+     */
+    uint_least64_t requests() const {
+      uint_least64_t sum = 0;
+      for (const simulated_slave& slave : slaves_)
+        sum += slave.requests();
+      return sum;
+    }
+
+  private:
+    struct endpoint {
+      size_t id;
+      bool tcp;
+      std::string cache;
+      std::function<void(const std::string&)> send;
+      std::array<simulated_slave*, 256> units;
+    };
+
+    struct delayed {
+      int_least64_t due;
+      uint_least64_t sequence;
+      size_t endpoint;
+      std::string frame;
+      bool operator<(const delayed& other) const { return (due != other.due) ? (due > other.due) : (sequence > other.sequence); }
+    };
+
+    /**
+     * \brief frame a tcp request
+     * \return the bytes used or 0 if more data is needed
+     */
+    size_t frame_tcp(endpoint& e, const size_t offset) {
+      if (e.cache.size() - offset < 8)
+        return 0;
+      const char* data = e.cache.data() + offset;
+      size_t length = (static_cast<uint8_t>(data[4]) << 8) | static_cast<uint8_t>(data[5]);
+      if ((length < 2) || (length > 254))
+        return e.cache.size() - offset;
+      if (e.cache.size() - offset < 6 + length)
+        return 0;
+      simulated_slave* slave = e.units[static_cast<uint8_t>(data[6])];
+      if (slave) {
+        response_.assign(data, 7);
+        slave->answer(data + 7, length - 1, response_);
+        response_[4] = static_cast<char>((response_.size() - 6) >> 8);
+        response_[5] = static_cast<char>(response_.size() - 6);
+        respond(e, *slave);
+      }
+      return 6 + length;
+    }
+
+    /**
+     * \brief frame a rtu request, resynchronizing byte by byte on garbage
+     * \return the bytes used or 0 if more data is needed
+     */
+    size_t frame_rtu(endpoint& e, const size_t offset) {
+      const char* data = e.cache.data() + offset;
+      size_t available = e.cache.size() - offset;
+      size_t size = predict_rtu_size(data, available, false);
+      if (!size)
+        return 1;
+      if (available < size)
+        return 0;
+      uint16_t crc = update_crc(0xFFFF, data, size - 2);
+      if ((static_cast<uint8_t>(data[size - 2]) != (crc & 0xff)) || (static_cast<uint8_t>(data[size - 1]) != (crc >> 8)))
+        return 1;
+      simulated_slave* slave = e.units[static_cast<uint8_t>(data[0])];
+      if (slave) {
+        response_.assign(data, 1);
+        slave->answer(data + 1, size - 3, response_);
+        crc = update_crc(0xFFFF, response_.data(), response_.size());
+        response_.push_back(static_cast<char>(crc & 0xff));
+        response_.push_back(static_cast<char>(crc >> 8));
+        respond(e, *slave);
+      }
+      return size;
+    }
+
+    /**
+     * \brief inject faults into the response and send or schedule it
+     */
+    void respond(endpoint& e, const simulated_slave& slave) {
+      const simulated_slave_config& cfg = slave.config();
+      const fault_config& faults = cfg.faults;
+      if ((faults.drop_rate > 0) && (chance() < faults.drop_rate))
+        return;
+      if ((faults.error_rate > 0) && (chance() < faults.error_rate)) {
+        size_t header = e.tcp ? 7 : 1;
+        uint8_t function = static_cast<uint8_t>(response_[header]) & 0x7f;
+        response_.resize(header);
+        simulated_slave::error(function, faults.error, response_);
+        if (e.tcp) {
+          response_[4] = 0;
+          response_[5] = 3;
+        } else {
+          uint16_t crc = update_crc(0xFFFF, response_.data(), response_.size());
+          response_.push_back(static_cast<char>(crc & 0xff));
+          response_.push_back(static_cast<char>(crc >> 8));
+        }
+      }
+      if ((faults.corrupt_rate > 0) && (chance() < faults.corrupt_rate))
+        response_.back() = static_cast<char>(response_.back() ^ (1 << (random() % 8)));
+      if ((faults.truncate_rate > 0) && (chance() < faults.truncate_rate))
+        response_.resize(1 + random() % (response_.size() - 1));
+      int_least64_t delay = cfg.delay + (cfg.jitter ? static_cast<int_least64_t>(random() % static_cast<uint_least64_t>(cfg.jitter + 1)) : 0);
+      if (delay)
+        pending_.push(delayed{now_() + delay, sequence_++, e.id, response_});
+      else
+        e.send(response_);
+    }
+
+    /**
+     * \brief xorshift64* generator, deterministic for a seed
+     */
+    uint_least64_t random() {
+      random_state_ ^= random_state_ >> 12;
+      random_state_ ^= random_state_ << 25;
+      random_state_ ^= random_state_ >> 27;
+      return random_state_ * 0x2545F4914F6CDD1DULL;
+    }
+
+    double chance() { return static_cast<double>(random() >> 11) * (1.0 / 9007199254740992.0); }
+
+    const std::function<int_least64_t()> now_;
+    uint_least64_t random_state_;
+    std::vector<std::unique_ptr<endpoint>> endpoints_;
+    std::deque<simulated_slave> slaves_;
+    std::priority_queue<delayed> pending_;
+    uint_least64_t sequence_ = 0;
+    std::string response_;
+  };
+} // namespace cbus
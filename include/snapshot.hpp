@@ -0,0 +1,298 @@
+#pragma once
+
+#include "becker.hpp"
+#include "values.hpp"
+#include "view.hpp"
+#include <cmath>
+#include <map>
+#include <string.h>
+#include <tuple>
+#include <vector>
+
+namespace cbus {
+  /**
+   * \brief modbus data table
+   */
+  enum class register_table { coils, discrete_inputs, input_registers, holding_registers };
+
+  /**
+   * \brief key of a polled block
+   */
+  struct block_key {
+    /**
+     * \brief unit id of the slave
+     */
+    uint8_t unit;
+    /**
+     * \brief table the block was read from
+     */
+    register_table table;
+    /**
+     * \brief address of the first register or coil in the block
+     */
+    uint16_t start;
+
+    bool operator<(const block_key& other) const { return std::tie(unit, table, start) < std::tie(other.unit, other.table, other.start); }
+  };
+
+  /**
+   * \brief range of changed registers or coils
+   */
+  struct changed_range {
+    /**
+     * \brief address of the first changed entry
+     */
+    uint16_t first;
+    /**
+     * \brief number of changed entries
+     */
+    uint16_t count;
+
+    bool operator==(const changed_range& other) const { return (first == other.first) && (count == other.count); }
+  };
+
+  /**
+   * \brief type of a value spanning one or more registers
+   */
+  enum class value_type { int16, uint16, int32, uint32, float32, int64, uint64, float64 };
+
+  /**
+   * \brief typed value inside a block which is only reported if it changed more than a deadband
+   */
+  struct deadband_tag {
+    /**
+     * \brief register offset of the value inside the block
+     */
+    uint16_t offset;
+    /**
+     * \brief type of the value
+     */
+    value_type type;
+    /**
+     * \brief byte order of the value
+     */
+    word_order order = word_order::abcd;
+    /**
+     * \brief minimum change to report
+     */
+    double band = 0;
+    /**
+     * \brief interpret band as percent of the last reported value instead of an absolute value
+     */
+    bool percent = false;
+  };
+
+  /**
+   * \brief Detects changes in polled blocks
+   * Each block is compared against the last reported content, only changed ranges are returned.
+   * Registers covered by a deadband tag keep their last reported value until the tag exceeds its deadband.
+   */
+  class change_detector {
+  public:
+    /**
+     * \brief add a deadband tag to a register block
+     * \param key the block
+     * \param tag the tag configuration
+     */
+    void add_deadband(const block_key& key, const deadband_tag& tag) { blocks_[key].tags.push_back(tag); }
+
+    /**
+     * \brief compare a new register payload with the previous one
+     * \param key the block the registers were read from
+     * \param registers the register_data of the response
+     * \return the changed ranges with absolute addresses, everything if the block is new or changed its size
+     */
+    std::vector<changed_range> update(const block_key& key, const std::vector<uint16_t>& registers) {
+      becker::bassert((key.table == register_table::input_registers) || (key.table == register_table::holding_registers), __FILE__, __LINE__, "not a register table");
+      block& b = blocks_[key];
+      std::vector<changed_range> result;
+      if (!b.valid || (b.registers.size() != registers.size())) {
+        b.registers = registers;
+        b.valid = true;
+        if (registers.size())
+          result.push_back(changed_range{key.start, static_cast<uint16_t>(registers.size())});
+        return result;
+      }
+      changed_.assign(registers.size(), 0);
+      bool any = mark_changed_registers(b.registers.data(), registers.data(), registers.size());
+      if (!any)
+        return result;
+      for (const deadband_tag& tag : b.tags)
+        apply_deadband(tag, b.registers, registers);
+      for (size_t i = 0; i < registers.size(); i++) {
+        if (changed_[i])
+          b.registers[i] = registers[i];
+      }
+      collect_ranges(key.start, result);
+      return result;
+    }
+
+    /**
+     * \brief compare a new register payload with the previous one
+     * \param key the block the registers were read from
+     * \param registers view over the registers
+     * \return the changed ranges with absolute addresses
+     */
+    std::vector<changed_range> update(const block_key& key, const register_view& registers) {
+      scratch_.resize(registers.size());
+      registers.copy_to(scratch_.begin());
+      return update(key, scratch_);
+    }
+
+    /**
+     * \brief compare a new coil payload with the previous one
+     * \param key the block the coils were read from
+     * \param coils the coil_data of the response
+     * \return the changed ranges with absolute addresses
+     */
+    std::vector<changed_range> update(const block_key& key, const std::vector<bool>& coils) {
+      becker::bassert((key.table == register_table::coils) || (key.table == register_table::discrete_inputs), __FILE__, __LINE__, "not a coil table");
+      block& b = blocks_[key];
+      std::vector<changed_range> result;
+      if (!b.valid || (b.coils.size() != coils.size())) {
+        b.coils = coils;
+        b.valid = true;
+        if (coils.size())
+          result.push_back(changed_range{key.start, static_cast<uint16_t>(coils.size())});
+        return result;
+      }
+      if (b.coils == coils)
+        return result;
+      changed_.assign(coils.size(), 0);
+      for (size_t i = 0; i < coils.size(); i++)
+        changed_[i] = b.coils[i] != coils[i];
+      b.coils = coils;
+      collect_ranges(key.start, result);
+      return result;
+    }
+
+    /**
+     * \brief forget a block, the next update reports it completely
+     * \param key the block
+     */
+    void reset(const block_key& key) {
+      auto it = blocks_.find(key);
+      if (it != blocks_.end())
+        it->second.valid = false;
+    }
+
+  private:
+    struct block {
+      bool valid = false;
+      std::vector<uint16_t> registers;
+      std::vector<bool> coils;
+      std::vector<deadband_tag> tags;
+    };
+
+    /**
+     * \brief compare two register arrays, skipping equal 64 bit words
+     * \return if any register differs
+     */
+    bool mark_changed_registers(const uint16_t* old_values, const uint16_t* new_values, const size_t count) {
+      bool any = false;
+      size_t i = 0;
+      for (; i + 4 <= count; i += 4) {
+        uint64_t a, b;
+        memcpy(&a, old_values + i, 8);
+        memcpy(&b, new_values + i, 8);
+        if (a == b)
+          continue;
+        for (size_t j = i; j < i + 4; j++)
+          changed_[j] = old_values[j] != new_values[j];
+        any = true;
+      }
+      for (; i < count; i++) {
+        changed_[i] = old_values[i] != new_values[i];
+        any = any || changed_[i];
+      }
+      return any;
+    }
+
+    /**
+     * \brief decode a tag value as double
+     */
+    static double tag_value(const deadband_tag& tag, const std::vector<uint16_t>& registers) {
+      switch (tag.type) {
+      case value_type::int16:
+        return decode_single<int16_t>(tag, registers);
+      case value_type::uint16:
+        return decode_single<uint16_t>(tag, registers);
+      case value_type::int32:
+        return decode_single<int32_t>(tag, registers);
+      case value_type::uint32:
+        return decode_single<uint32_t>(tag, registers);
+      case value_type::float32:
+        return decode_single<float>(tag, registers);
+      case value_type::int64:
+        return static_cast<double>(decode_single<int64_t>(tag, registers));
+      case value_type::uint64:
+        return static_cast<double>(decode_single<uint64_t>(tag, registers));
+      case value_type::float64:
+        return decode_single<double>(tag, registers);
+      }
+      return 0;
+    }
+
+    template <typename T> static T decode_single(const deadband_tag& tag, const std::vector<uint16_t>& registers) {
+      T value;
+      decode_values<T>(registers, tag.offset, 1, tag.order, &value);
+      return value;
+    }
+
+    static size_t tag_width(const value_type type) {
+      switch (type) {
+      case value_type::int16:
+      case value_type::uint16:
+        return 1;
+      case value_type::int32:
+      case value_type::uint32:
+      case value_type::float32:
+        return 2;
+      default:
+        return 4;
+      }
+    }
+
+    /**
+     * \brief clear the changed flags of a tag if it stayed inside its deadband
+     */
+    void apply_deadband(const deadband_tag& tag, const std::vector<uint16_t>& reported, const std::vector<uint16_t>& registers) {
+      const size_t width = tag_width(tag.type);
+      if (tag.offset + width > registers.size())
+        return;
+      bool touched = false;
+      for (size_t i = tag.offset; i < tag.offset + width; i++)
+        touched = touched || changed_[i];
+      if (!touched)
+        return;
+      double last = tag_value(tag, reported);
+      double current = tag_value(tag, registers);
+      double limit = tag.percent ? std::fabs(last) * tag.band / 100.0 : tag.band;
+      if (std::fabs(current - last) > limit || (std::isnan(current) != std::isnan(last)))
+        return;
+      for (size_t i = tag.offset; i < tag.offset + width; i++)
+        changed_[i] = 0;
+    }
+
+    /**
+     * \brief merge the changed flags into ranges
+     */
+    void collect_ranges(const uint16_t start, std::vector<changed_range>& result) const {
+      size_t i = 0;
+      while (i < changed_.size()) {
+        if (!changed_[i]) {
+          i++;
+          continue;
+        }
+        size_t first = i;
+        while ((i < changed_.size()) && changed_[i])
+          i++;
+        result.push_back(changed_range{static_cast<uint16_t>(start + first), static_cast<uint16_t>(i - first)});
+      }
+    }
+
+    std::map<block_key, block> blocks_;
+    std::vector<uint8_t> changed_;
+    std::vector<uint16_t> scratch_;
+  };
+} // namespace cbus
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "becker.hpp"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace cbus {
+  /**
+   * \brief Bounded lock-free single-producer/single-consumer ring
+   * Used to hand decoded packets from the thread calling feed to an application thread.
+   * Exactly one thread may push and exactly one thread may drain at a time.
+   */
+  template <typename T> class spsc_queue {
+  public:
+    /**
+     * \brief construct new queue
+     * \param capacity number of elements, rounded up to the next power of two
+     */
+    explicit spsc_queue(const size_t capacity) {
+      becker::bassert(capacity > 0, __FILE__, __LINE__, "queue capacity must not be zero");
+      size_t size = 1;
+      while (size < capacity)
+        size <<= 1;
+      mask_ = size - 1;
+      slots_.reset(new slot[size]);
+    }
+    ~spsc_queue() { drain([](T&) {}); }
+    spsc_queue(const spsc_queue&) = delete;
+    spsc_queue& operator=(const spsc_queue&) = delete;
+
+    /**
+     * \brief push an element, may only be called by the producer
+     * \param value the element to push
+     * \return false if the queue is full, the element is dropped and counted then
+     */
+    template <typename U> bool push(U&& value) {
+      const size_t head = head_.load(std::memory_order_relaxed);
+      if ((head - cached_tail_) > mask_) {
+        cached_tail_ = tail_.load(std::memory_order_acquire);
+        if ((head - cached_tail_) > mask_) {
+          dropped_.fetch_add(1, std::memory_order_relaxed);
+          return false;
+        }
+      }
+      new (&slots_[head & mask_].storage) T(std::forward<U>(value));
+      head_.store(head + 1, std::memory_order_release);
+      return true;
+    }
+
+    /**
+     * \brief consume a batch of elements, may only be called by the consumer
+     * \param consumer callback receiving each element, the element is destroyed afterwards
+     * \param max_count maximum number of elements to consume
+     * \return the number of consumed elements
+     */
+    template <typename F> size_t drain(F&& consumer, const size_t max_count = SIZE_MAX) {
+      const size_t tail = tail_.load(std::memory_order_relaxed);
+      size_t count = head_.load(std::memory_order_acquire) - tail;
+      if (count > max_count)
+        count = max_count;
+      for (size_t i = 0; i < count; i++) {
+        T* element = std::launder(reinterpret_cast<T*>(&slots_[(tail + i) & mask_].storage));
+        consumer(*element);
+        element->~T();
+      }
+      tail_.store(tail + count, std::memory_order_release);
+      return count;
+    }
+
+    /**
+     * \brief number of elements currently queued, exact only on the consumer side
+     */
+    size_t size() const { return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire); }
+
+    /**
+     * \brief check if the next push would fail
+     * Producers can use this to stop reading from the device until the consumer caught up.
+     */
+    bool full() const { return size() > mask_; }
+
+    /**
+     * \brief maximum number of queued elements
+     */
+    size_t capacity() const { return mask_ + 1; }
+
+    /**
+     * \brief number of elements pushed successfully since construction
+     */
+    uint_least64_t pushed() const { return head_.load(std::memory_order_relaxed); }
+
+    /**
+     * \brief number of elements dropped because the queue was full
+     */
+    uint_least64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+  private:
+    struct slot {
+      typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    std::unique_ptr<slot[]> slots_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> head_{0};
+    size_t cached_tail_ = 0;
+    std::atomic<uint_least64_t> dropped_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+  };
+
+  /**
+   * \brief create a packet emission callback publishing into a queue
+   * \param queue the queue to publish into, shared with the consuming thread
+   * \return callback usable as packet_emission of a bus
+   */
+  template <typename T> std::function<void(const T&)> make_queue_emission(const std::shared_ptr<spsc_queue<T>>& queue) {
+    return [queue](const T& value) { queue->push(value); };
+  }
+} // namespace cbus
@@ -0,0 +1,215 @@
+#pragma once
+
+#include "becker.hpp"
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace cbus {
+  /**
+   * \brief single sample of a register
+   */
+  struct sample {
+    /**
+     * \brief time of the sample in the time unit of the application
+     */
+    int_least64_t timestamp;
+    /**
+     * \brief register value
+     */
+    uint16_t value;
+  };
+
+  /**
+   * \brief Columnar in-memory store for polled register values
+   * Each tag gets its own column made of blocks. Timestamps are stored as delta-of-delta and values as delta, both as zigzag varints,
+   * so a register polled at a fixed rate with a slowly changing value needs about two bytes per sample.
+   * Tag ids index a vector, so they should be dense.
+   */
+  class timeseries_store {
+  public:
+    /**
+     * \brief construct new store
+     * \param block_size number of samples per block, smaller blocks make range queries skip more data
+     */
+    explicit timeseries_store(const uint_least32_t block_size = 1024) : block_size_(block_size) { becker::bassert(block_size > 1, __FILE__, __LINE__, "block size too small"); }
+
+    /**
+     * \brief append a sample
+     * \param tag the tag id
+     * \param timestamp time of the sample, has to be at least the time of the previous sample of this tag
+     * \param value register value
+     */
+    void append(const uint_least32_t tag, const int_least64_t timestamp, const uint16_t value) {
+      if (tag >= columns_.size())
+        columns_.resize(tag + 1);
+      columns_[tag].append(timestamp, value, block_size_);
+    }
+
+    /**
+     * \brief append a polled register block
+     * \param first_tag tag id of the first register, the following registers use the following tag ids
+     * \param timestamp time of the poll
+     * \param registers the register_data of the response
+     */
+    void append(const uint_least32_t first_tag, const int_least64_t timestamp, const std::vector<uint16_t>& registers) {
+      if (first_tag + registers.size() > columns_.size())
+        columns_.resize(first_tag + registers.size());
+      for (size_t i = 0; i < registers.size(); i++)
+        columns_[first_tag + i].append(timestamp, registers[i], block_size_);
+    }
+
+    /**
+     * \brief read all samples of a tag inside a time range
+     * \param tag the tag id
+     * \param from first time to include
+     * \param to last time to include
+     * \param consumer called for each sample in time order
+     */
+    void query(const uint_least32_t tag, const int_least64_t from, const int_least64_t to, const std::function<void(const sample&)>& consumer) const {
+      if (tag >= columns_.size())
+        return;
+      for (const block& b : columns_[tag].blocks) {
+        if ((b.last_timestamp < from) || (b.first_timestamp > to))
+          continue;
+        b.decode([&](const sample& s) {
+          if ((s.timestamp >= from) && (s.timestamp <= to))
+            consumer(s);
+        });
+      }
+    }
+
+    /**
+     * \brief read all samples of a tag inside a time range
+     * \param tag the tag id
+     * \param from first time to include
+     * \param to last time to include
+     * \return the samples in time order
+     */
+    std::vector<sample> query(const uint_least32_t tag, const int_least64_t from, const int_least64_t to) const {
+      std::vector<sample> result;
+      query(tag, from, to, [&result](const sample& s) { result.push_back(s); });
+      return result;
+    }
+
+    /**
+     * \brief export all stored samples
+     * \param consumer called for each tag with all its samples in time order
+     */
+    void export_all(const std::function<void(uint_least32_t, const std::vector<sample>&)>& consumer) const {
+      std::vector<sample> samples;
+      for (size_t tag = 0; tag < columns_.size(); tag++) {
+        if (columns_[tag].blocks.empty())
+          continue;
+        samples.clear();
+        for (const block& b : columns_[tag].blocks)
+          b.decode([&samples](const sample& s) { samples.push_back(s); });
+        consumer(static_cast<uint_least32_t>(tag), samples);
+      }
+    }
+
+    /**
+     * \brief remove all samples
+     */
+    void clear() { columns_.clear(); }
+
+    /**
+     * \brief number of stored samples
+     */
+    uint_least64_t size() const {
+      uint_least64_t count = 0;
+      for (const column& c : columns_)
+        for (const block& b : c.blocks)
+          count += b.count;
+      return count;
+    }
+
+    /**
+     * \brief bytes used by the encoded samples
+     */
+    uint_least64_t encoded_size() const {
+      uint_least64_t bytes = 0;
+      for (const column& c : columns_)
+        for (const block& b : c.blocks)
+          bytes += b.timestamps.size() + b.values.size() + sizeof(block);
+      return bytes;
+    }
+
+  private:
+    /**
+     * \brief encoded samples of one tag
+     */
+    struct block {
+      int_least64_t first_timestamp;
+      int_least64_t last_timestamp;
+      int_least64_t last_delta = 0;
+      uint16_t last_value = 0;
+      uint_least32_t count = 0;
+      std::string timestamps;
+      std::string values;
+
+      template <typename F> void decode(F&& consumer) const {
+        size_t ts_pos = 0;
+        size_t value_pos = 0;
+        int_least64_t timestamp = first_timestamp;
+        int_least64_t delta = 0;
+        uint16_t value = 0;
+        for (uint_least32_t i = 0; i < count; i++) {
+          if (i == 1)
+            delta = read_varint(timestamps, ts_pos);
+          else if (i > 1)
+            delta += read_varint(timestamps, ts_pos);
+          timestamp += (i > 0) ? delta : 0;
+          value = static_cast<uint16_t>(value + read_varint(values, value_pos));
+          consumer(sample{timestamp, value});
+        }
+      }
+    };
+
+    struct column {
+      std::vector<block> blocks;
+
+      void append(const int_least64_t timestamp, const uint16_t value, const uint_least32_t block_size) {
+        becker::bassert(blocks.empty() || (timestamp >= blocks.back().last_timestamp), __FILE__, __LINE__, "timestamps have to be ascending");
+        if (blocks.empty() || (blocks.back().count >= block_size)) {
+          blocks.emplace_back();
+          blocks.back().first_timestamp = timestamp;
+          blocks.back().last_timestamp = timestamp;
+        }
+        block& b = blocks.back();
+        if (b.count > 0) {
+          int_least64_t delta = timestamp - b.last_timestamp;
+          write_varint(b.timestamps, (b.count == 1) ? delta : (delta - b.last_delta));
+          b.last_delta = delta;
+        }
+        write_varint(b.values, static_cast<int_least64_t>(value) - b.last_value);
+        b.last_timestamp = timestamp;
+        b.last_value = value;
+        b.count++;
+      }
+    };
+
+    static void write_varint(std::string& output, const int_least64_t value) {
+      uint_least64_t zigzag = (static_cast<uint_least64_t>(value) << 1) ^ static_cast<uint_least64_t>(value >> 63);
+      while (zigzag >= 0x80) {
+        output.push_back(static_cast<char>((zigzag & 0x7f) | 0x80));
+        zigzag >>= 7;
+      }
+      output.push_back(static_cast<char>(zigzag));
+    }
+
+    static int_least64_t read_varint(const std::string& input, size_t& pos) {
+      uint_least64_t zigzag = 0;
+      for (uint_fast8_t shift = 0;; shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(input[pos++]);
+        zigzag |= static_cast<uint_least64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+          break;
+      }
+      return static_cast<int_least64_t>(zigzag >> 1) ^ -static_cast<int_least64_t>(zigzag & 1);
+    }
+
+    const uint_least32_t block_size_;
+    std::vector<column> columns_;
+  };
+} // namespace cbus
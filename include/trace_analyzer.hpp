@@ -0,0 +1,558 @@
+#pragma once
+
+#include "becker.hpp"
+#include "bus.hpp"
+#include "contents.hpp"
+#include "packet.hpp"
+#include "view.hpp"
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace cbus {
+  /**
+   * \brief raw capture of modbus traffic of both directions
+   * The data is not copied, it has to stay valid as long as the analyzer using the capture.
+   */
+  struct trace_capture {
+    /**
+     * \brief the captured bytes, tcp frames with MBAP header or rtu frames with crc
+     */
+    const char* data = nullptr;
+    /**
+     * \brief number of captured bytes
+     */
+    size_t size = 0;
+    /**
+     * \brief if the capture contains tcp frames
+     */
+    bool tcp = true;
+    /**
+     * \brief receive times as pairs of offset and time, sorted by offset
+     * A frame gets the time of the last mark at or before its start.
+     */
+    std::vector<std::pair<uint_least64_t, int_least64_t>> marks;
+  };
+
+  /**
+   * \brief Records received chunks into a capture
+   */
+  class trace_recorder {
+  public:
+    /**
+     * \brief construct new recorder
+     * \param tcp if the recorded traffic is modbus tcp
+     */
+    explicit trace_recorder(const bool tcp) : tcp_(tcp) {}
+
+    /**
+     * \brief record a chunk
+     * \param data the received bytes
+     * \param time the receive time
+     */
+    void record(const std::string& data, const int_least64_t time) {
+      marks_.emplace_back(data_.size(), time);
+      data_.append(data);
+    }
+
+    /**
+     * \brief record a chunk passed to a batch handler, chunks without timestamp get the time of the previous one
+     * \param chunk the chunk
+     */
+    void record(const received_chunk& chunk) {
+      if (chunk.timestamp)
+        marks_.emplace_back(data_.size(), *chunk.timestamp);
+      data_.append(chunk.data, chunk.size);
+    }
+
+    /**
+     * \brief the capture, valid until the next record call
+     */
+    trace_capture capture() const {
+      trace_capture ret;
+      ret.data = data_.data();
+      ret.size = data_.size();
+      ret.tcp = tcp_;
+      ret.marks = marks_;
+      return ret;
+    }
+
+    /**
+     * \brief the recorded bytes, e.g. to write them into a file
+     */
+    const std::string& data() const { return data_; }
+
+  private:
+    const bool tcp_;
+    std::string data_;
+    std::vector<std::pair<uint_least64_t, int_least64_t>> marks_;
+  };
+
+  /**
+   * \brief kind of access of a frame
+   */
+  enum class trace_access { none, read, write };
+
+  /**
+   * \brief data table addressed by a frame
+   */
+  enum class trace_table { none, coils, discrete_inputs, input_registers, holding_registers };
+
+  /**
+   * \brief indexed frame, a request accessing two ranges gets one entry per range
+   * Responses get a single entry without access, table and address, so queries for accesses only count the requests.
+   */
+  struct trace_entry {
+    /**
+     * \brief receive time of the frame
+     */
+    int_least64_t time;
+    /**
+     * \brief offset of the frame in its capture
+     */
+    uint_least64_t offset;
+    /**
+     * \brief index of the capture
+     */
+    uint32_t capture;
+    /**
+     * \brief size of the frame
+     */
+    uint16_t size;
+    uint8_t unit;
+    /**
+     * \brief the function code, including the exception bit
+     */
+    uint8_t function;
+    /**
+     * \brief if the frame was decoded as response
+     */
+    bool response;
+    trace_access access;
+    trace_table table;
+    /**
+     * \brief first address of the range, only valid if count is not 0
+     */
+    uint16_t first;
+    /**
+     * \brief number of addresses, 0 if the frame carries no address
+     */
+    uint16_t count;
+  };
+
+  /**
+   * \brief query for trace entries, unset fields match everything
+   */
+  struct trace_query {
+    std::optional<uint8_t> unit;
+    std::optional<uint8_t> function;
+    std::optional<trace_access> access;
+    std::optional<trace_table> table;
+    /**
+     * \brief address range, entries overlapping it match, entries without address only match the full range
+     */
+    uint16_t first = 0;
+    uint16_t last = 0xffff;
+    /**
+     * \brief time range including both ends
+     */
+    int_least64_t from = std::numeric_limits<int_least64_t>::min();
+    int_least64_t to = std::numeric_limits<int_least64_t>::max();
+  };
+
+  /**
+   * \brief Parallel indexer of captured modbus traffic
+   * A capture is split into one part per thread. Tcp captures are split at MBAP frame boundaries and rtu captures at resync points,
+   * both found by requiring a chain of plausible frames behind the split point. The parts are decoded in parallel, each frame as request
+   * or response depending on which one decodes completely. Frames decoding completely as both, e.g. the echoed single writes, are assigned
+   * in a sequential pass afterwards: on tcp a frame answering an earlier request with the same unit, function and transaction id is a response,
+   * on rtu a frame following a request of the same unit and function.
+   * The entries are indexed per unit and sorted by time, so a query only scans the entries of its units inside its time range.
+   */
+  class trace_analyzer {
+  public:
+    /**
+     * \brief construct new analyzer
+     * \param threads number of threads used to index a capture
+     */
+    explicit trace_analyzer(const unsigned threads = std::max(1u, std::thread::hardware_concurrency())) : threads_(std::max(1u, threads)) {}
+
+    /**
+     * \brief index a capture
+     * \param capture the capture, its data has to outlive the analyzer
+     * \return the index of the capture
+     */
+    uint32_t add(const trace_capture& capture) {
+      const uint32_t id = static_cast<uint32_t>(captures_.size());
+      captures_.push_back(capture);
+      std::vector<size_t> starts = split(capture, threads_);
+      std::vector<indexed_part> parts(starts.size());
+      std::vector<std::thread> workers;
+      for (size_t i = 0; i < starts.size(); i++) {
+        size_t end = (i + 1 < starts.size()) ? starts[i + 1] : capture.size;
+        workers.emplace_back([&capture, &parts, &starts, i, end, id] { parts[i] = index_part(capture, id, starts[i], end); });
+      }
+      for (std::thread& worker : workers)
+        worker.join();
+      assign_directions(capture, parts);
+
+      std::array<std::vector<trace_entry>, 256> added;
+      for (const indexed_part& part : parts)
+        for (const trace_entry& entry : part.entries)
+          added[entry.unit].push_back(entry);
+      auto before = [](const trace_entry& a, const trace_entry& b) { return a.time < b.time; };
+      parallel_units([this, &added, &before](const size_t unit) {
+        std::vector<trace_entry>& bucket = units_[unit];
+        size_t old = bucket.size();
+        std::stable_sort(added[unit].begin(), added[unit].end(), before);
+        bucket.insert(bucket.end(), added[unit].begin(), added[unit].end());
+        std::inplace_merge(bucket.begin(), bucket.begin() + old, bucket.end(), before);
+      });
+      return id;
+    }
+
+    /**
+     * \brief find entries
+     * \param q the query
+     * \return the matching entries sorted by time
+     */
+    std::vector<trace_entry> query(const trace_query& q) const {
+      std::vector<trace_entry> ret;
+      if (q.unit) {
+        query(units_[*q.unit], q, ret);
+        return ret;
+      }
+      for (const std::vector<trace_entry>& bucket : units_) {
+        size_t old = ret.size();
+        query(bucket, q, ret);
+        std::inplace_merge(ret.begin(), ret.begin() + old, ret.end(), [](const trace_entry& a, const trace_entry& b) { return a.time < b.time; });
+      }
+      return ret;
+    }
+
+    /**
+     * \brief decode the frame of an entry again
+     * \param entry the entry
+     */
+    single_packet decode(const trace_entry& entry) const {
+      const trace_capture& capture = captures_.at(entry.capture);
+      uint_least64_t size = 0;
+      return decode_frame(capture.data + entry.offset, entry.size, capture.tcp, entry.response, size);
+    }
+
+    /**
+     * \brief number of indexed entries
+     */
+    size_t size() const {
+      size_t ret = 0;
+      for (const std::vector<trace_entry>& bucket : units_)
+        ret += bucket.size();
+      return ret;
+    }
+
+    /**
+     * \brief split a capture at frame boundaries
+     * \param capture the capture
+     * \param parts wanted number of parts
+     * \return the start offsets of the parts, less than wanted if no boundary was found in a part
+     */
+    static std::vector<size_t> split(const trace_capture& capture, const size_t parts) {
+      std::vector<size_t> starts{0};
+      for (size_t i = 1; i < parts; i++) {
+        size_t start = next_boundary(capture, std::max(starts.back() + 1, capture.size * i / parts));
+        if (start >= capture.size)
+          break;
+        starts.push_back(start);
+      }
+      return starts;
+    }
+
+  private:
+    /**
+     * \brief entries of a part of a capture
+     */
+    struct indexed_part {
+      std::vector<trace_entry> entries;
+      /**
+       * \brief indices of the entries of frames decoding completely as request and as response, indexed as request
+       */
+      std::vector<size_t> ambiguous;
+    };
+
+    /**
+     * \brief number of plausible frames needed behind a split point
+     */
+    static constexpr unsigned chain = 3;
+
+    /**
+     * \brief size of a plausible tcp frame
+     * \return the size or 0
+     */
+    static size_t tcp_frame(const char* data, const size_t available) {
+      if (available < 8)
+        return 0;
+      uint16_t protocol = static_cast<uint16_t>((static_cast<uint8_t>(data[2]) << 8) | static_cast<uint8_t>(data[3]));
+      uint16_t length = static_cast<uint16_t>((static_cast<uint8_t>(data[4]) << 8) | static_cast<uint8_t>(data[5]));
+      if ((protocol != 0) || (length < 2) || (length > 254) || !describe_function(static_cast<uint8_t>(data[7])).supported)
+        return 0;
+      return 6 + length;
+    }
+
+    /**
+     * \brief size of a complete rtu frame with valid crc, as request or response
+     * \return the size or 0
+     */
+    static size_t rtu_frame(const char* data, const size_t available) {
+      for (bool response : {false, true}) {
+        size_t size = predict_rtu_size(data, available, response);
+        if (!size || (size > available) || (size < 4))
+          continue;
+        uint16_t crc = update_crc(0xFFFF, data, size - 2);
+        if ((static_cast<uint8_t>(data[size - 2]) == (crc & 0xff)) && (static_cast<uint8_t>(data[size - 1]) == (crc >> 8)))
+          return size;
+      }
+      return 0;
+    }
+
+    static size_t frame_at(const trace_capture& capture, const size_t offset) {
+      size_t available = capture.size - offset;
+      size_t size = capture.tcp ? tcp_frame(capture.data + offset, available) : rtu_frame(capture.data + offset, available);
+      return (size <= available) ? size : 0;
+    }
+
+    /**
+     * \brief find the first position followed by a chain of plausible frames
+     */
+    static size_t next_boundary(const trace_capture& capture, size_t offset) {
+      for (; offset < capture.size; offset++) {
+        size_t position = offset;
+        unsigned found = 0;
+        while ((found < chain) && (position < capture.size)) {
+          size_t size = frame_at(capture, position);
+          if (!size)
+            break;
+          position += size;
+          found++;
+        }
+        if ((found == chain) || (found && (position == capture.size)))
+          return offset;
+      }
+      return capture.size;
+    }
+
+    /**
+     * \brief check if a frame was decoded completely
+     */
+    static bool decoded_completely(const single_packet& pkg, const uint_least64_t size, const std::string& content) {
+      return (size == content.size()) && !std::holds_alternative<not_enough_data>(pkg) && !std::holds_alternative<packet_error>(pkg) &&
+             !std::holds_alternative<internal_error>(pkg);
+    }
+
+    /**
+     * \brief decode a frame as request or response
+     * \param response try the response first instead of the request
+     * \param size set to the decoded content size
+     * \param ambiguous set if the frame decodes completely in both directions
+     */
+    static single_packet decode_frame(const char* data, const size_t frame, const bool tcp, const bool response, uint_least64_t& size,
+                                      bool* ambiguous = nullptr) {
+      size_t header = tcp ? 6 : 0;
+      uint8_t function = static_cast<uint8_t>(data[header + 1]);
+      uint16_t transaction_id = tcp ? static_cast<uint16_t>((static_cast<uint8_t>(data[0]) << 8) | static_cast<uint8_t>(data[1])) : 0;
+      packet pkg(transaction_id, static_cast<uint8_t>(data[header]), static_cast<function_code>(function));
+      std::string content(data + header + 2, frame - header - 2 - (tcp ? 0 : 2));
+      const function_descriptor& desc = describe_function(function);
+      if (!desc.supported)
+        return unknown_packet_error(pkg);
+      if (function & 0x80)
+        return parse_single_packet<error_response>(pkg, content, size);
+      const pdu_layout& first = response ? desc.response : desc.request;
+      const pdu_layout& second = response ? desc.request : desc.response;
+      single_packet ret = first.parse(pkg, content, size);
+      if (decoded_completely(ret, size, content)) {
+        if (ambiguous) {
+          uint_least64_t other = 0;
+          single_packet reverse = second.parse(pkg, content, other);
+          *ambiguous = decoded_completely(reverse, other, content);
+        }
+        return ret;
+      }
+      size = 0;
+      return second.parse(pkg, content, size);
+    }
+
+    /**
+     * \brief add one entry per range accessed by a decoded request, responses get one entry without access
+     */
+    static void add_entries(const single_packet& pkg, trace_entry entry, std::vector<trace_entry>& out) {
+      auto add = [&entry, &out](const trace_access access, const trace_table table, const uint16_t first, const size_t count) {
+        entry.access = access;
+        entry.table = table;
+        entry.first = first;
+        entry.count = static_cast<uint16_t>(count);
+        out.push_back(entry);
+      };
+      std::visit(
+          [&add](const auto& p) {
+            using T = typename std::decay<decltype(p)>::type;
+            if constexpr (std::is_same<T, read_coils_request>::value)
+              add(trace_access::read, trace_table::coils, p.first_coil, p.coil_count);
+            else if constexpr (std::is_same<T, read_discrete_inputs_request>::value)
+              add(trace_access::read, trace_table::discrete_inputs, p.first_input, p.input_count);
+            else if constexpr (std::is_same<T, read_holding_registers_request>::value)
+              add(trace_access::read, trace_table::holding_registers, p.first_register, p.register_count);
+            else if constexpr (std::is_same<T, read_input_registers_request>::value)
+              add(trace_access::read, trace_table::input_registers, p.first_register, p.register_count);
+            else if constexpr (std::is_same<T, write_single_coil_request>::value)
+              add(trace_access::write, trace_table::coils, p.coil_index, 1);
+            else if constexpr (std::is_same<T, write_multiple_coils_request>::value)
+              add(trace_access::write, trace_table::coils, p.first_coil, p.coil_data.size());
+            else if constexpr (std::is_same<T, write_single_holding_register_request>::value ||
+                               std::is_same<T, write_single_holding_register_devaddr_request>::value || std::is_same<T, mask_write_register_request>::value)
+              add(trace_access::write, trace_table::holding_registers, p.register_index, 1);
+            else if constexpr (std::is_same<T, write_holding_registers_request>::value)
+              add(trace_access::write, trace_table::holding_registers, p.first_register, p.register_content.size());
+            else if constexpr (std::is_same<T, read_write_registers_request>::value) {
+              add(trace_access::write, trace_table::holding_registers, p.write_first, p.write_data.size());
+              add(trace_access::read, trace_table::holding_registers, p.read_first, p.read_count);
+            } else
+              add(trace_access::none, trace_table::none, 0, 0);
+          },
+          pkg);
+    }
+
+    /**
+     * \brief decode the frames starting in a part of a capture
+     */
+    static indexed_part index_part(const trace_capture& capture, const uint32_t id, size_t offset, const size_t end) {
+      indexed_part ret;
+      auto mark = std::upper_bound(capture.marks.begin(), capture.marks.end(), std::make_pair(static_cast<uint_least64_t>(offset), std::numeric_limits<int_least64_t>::max()));
+      while (offset < end) {
+        size_t size = frame_at(capture, offset);
+        if (!size) {
+          offset = capture.tcp ? next_boundary(capture, offset + 1) : offset + 1;
+          continue;
+        }
+        while ((mark != capture.marks.end()) && (mark->first <= offset))
+          ++mark;
+        uint_least64_t decoded = 0;
+        bool ambiguous = false;
+        single_packet pkg = decode_frame(capture.data + offset, size, capture.tcp, false, decoded, &ambiguous);
+        const packet* header = get_header(pkg);
+        bool complete = header && (decoded == size - (capture.tcp ? 8 : 4)) && !std::holds_alternative<packet_error>(pkg) &&
+                        !std::holds_alternative<internal_error>(pkg) && !std::holds_alternative<unknown_packet_error>(pkg);
+        if (!complete && !capture.tcp) {
+          offset++;
+          continue;
+        }
+        if (complete) {
+          trace_entry entry{};
+          entry.time = (mark == capture.marks.begin()) ? 0 : std::prev(mark)->second;
+          entry.offset = offset;
+          entry.capture = id;
+          entry.size = static_cast<uint16_t>(size);
+          entry.unit = header->address;
+          entry.function = static_cast<uint8_t>(header->function);
+          entry.response = (static_cast<uint8_t>(header->function) & 0x80) || !is_request(pkg);
+          if (ambiguous)
+            ret.ambiguous.push_back(ret.entries.size());
+          add_entries(pkg, entry, ret.entries);
+        }
+        offset += size;
+      }
+      return ret;
+    }
+
+    /**
+     * \brief decide the direction of the ambiguous frames of all parts in capture order
+     * On tcp a frame is a response if a request with the same unit, function and transaction id is outstanding.
+     * On rtu it is a response if it follows a request of the same unit and function.
+     */
+    static void assign_directions(const trace_capture& capture, std::vector<indexed_part>& parts) {
+      // on rtu at most one request is outstanding on the line
+      std::set<uint_least32_t> outstanding;
+      for (indexed_part& part : parts) {
+        auto next = part.ambiguous.begin();
+        for (size_t i = 0; i < part.entries.size(); i++) {
+          trace_entry& entry = part.entries[i];
+          if ((i > 0) && (part.entries[i - 1].offset == entry.offset))
+            continue;
+          bool ambiguous = (next != part.ambiguous.end()) && (*next == i);
+          if (ambiguous)
+            next++;
+          uint_least32_t key = (static_cast<uint_least32_t>(entry.unit) << 8) | (entry.function & 0x7f);
+          if (capture.tcp) {
+            const char* frame = capture.data + entry.offset;
+            key = (key << 16) | (static_cast<uint8_t>(frame[0]) << 8) | static_cast<uint8_t>(frame[1]);
+          }
+          bool response = entry.response || (ambiguous && outstanding.count(key));
+          if (!response) {
+            if (!capture.tcp)
+              outstanding.clear();
+            outstanding.insert(key);
+            continue;
+          }
+          outstanding.erase(key);
+          if (ambiguous) {
+            entry.response = true;
+            entry.access = trace_access::none;
+            entry.table = trace_table::none;
+            entry.first = 0;
+            entry.count = 0;
+          }
+        }
+      }
+    }
+
+    /**
+     * \brief append the matching entries of one unit
+     */
+    static void query(const std::vector<trace_entry>& bucket, const trace_query& q, std::vector<trace_entry>& ret) {
+      auto it = std::lower_bound(bucket.begin(), bucket.end(), q.from, [](const trace_entry& e, const int_least64_t time) { return e.time < time; });
+      bool any_address = (q.first == 0) && (q.last == 0xffff);
+      for (; (it != bucket.end()) && (it->time <= q.to); ++it) {
+        if ((q.function && (*q.function != it->function)) || (q.access && (*q.access != it->access)) || (q.table && (*q.table != it->table)))
+          continue;
+        if (!any_address && (!it->count || (it->first > q.last) || (it->first + it->count - 1 < q.first)))
+          continue;
+        ret.push_back(*it);
+      }
+    }
+
+    static bool is_request(const single_packet& pkg) {
+      return std::visit(
+          [](const auto& p) {
+            using T = typename std::decay<decltype(p)>::type;
+            if constexpr (std::is_base_of<packet, T>::value && !std::is_same<T, error_response>::value && !std::is_same<T, packet_error>::value &&
+                          !std::is_same<T, internal_error>::value && !std::is_same<T, unknown_packet_error>::value)
+              return !packet_traits<T>::response;
+            else
+              return false;
+          },
+          pkg);
+    }
+
+    /**
+     * \brief run a function for all units, spread over the threads
+     */
+    template <typename function_type> void parallel_units(function_type function) {
+      std::vector<std::thread> workers;
+      for (unsigned t = 0; t < threads_; t++)
+        workers.emplace_back([this, t, &function] {
+          for (size_t unit = t; unit < 256; unit += threads_)
+            function(unit);
+        });
+      for (std::thread& worker : workers)
+        worker.join();
+    }
+
+    const unsigned threads_;
+    std::vector<trace_capture> captures_;
+    std::array<std::vector<trace_entry>, 256> units_;
+  };
+} // namespace cbus
@@ -0,0 +1,174 @@
+#pragma once
+
+#include "becker.hpp"
+#include "bus.hpp"
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace cbus {
+  /**
+   * \brief Multiplexes many unit ids over a single bus
+   * Received packets are routed through a flat table indexed by the unit id.
+   * Outgoing requests are queued per unit and sent round robin, limited to a number of outstanding requests per unit,
+   * so a slow unit does not delay the others. For slave buses the config address has to be 0 to receive all units.
+   * Only for Modbus-TCP buses, a rtu line can only carry one outstanding request and needs the rtu_scheduler.
+   */
+  template <typename device_type> class unit_mux {
+  public:
+    /**
+     * \brief callback receiving the packets of a unit
+     */
+    using handler_type = std::function<void(const single_packet&)>;
+
+    /**
+     * \brief construct new multiplexer
+     * \param target the tcp bus to send on, has to outlive the multiplexer
+     * \param max_in_flight maximum number of outstanding requests per unit
+     * \param max_queued maximum number of queued requests per unit
+     */
+    unit_mux(bus<device_type>& target, const uint_least32_t max_in_flight = 1, const size_t max_queued = 64)
+        : bus_(target), max_in_flight_(max_in_flight), max_queued_(max_queued) {
+      becker::bassert(target.tcp_format(), __FILE__, __LINE__, "the unit multiplexer needs a tcp bus");
+      becker::bassert(max_in_flight > 0, __FILE__, __LINE__, "at least one request per unit has to be allowed");
+    }
+
+    /**
+     * \brief set the handler of a unit
+     * \param unit the unit id
+     * \param handler the handler, an empty function removes it
+     */
+    void set_handler(const uint8_t unit, const handler_type& handler) { units_[unit].handler = handler; }
+
+    /**
+     * \brief set the handler for units without own handler
+     * \param handler the handler, an empty function drops those packets
+     */
+    void set_default_handler(const handler_type& handler) { default_handler_ = handler; }
+
+    /**
+     * \brief route a packet received by the bus, usable as packet emission
+     * \param pkg the received packet
+     * A packet with the transaction id of an outstanding request completes it.
+     * Unsolicited packets and late responses to abandoned requests are routed without releasing a request.
+     */
+    void dispatch(const single_packet& pkg) {
+      const packet* header = get_header(pkg);
+      if (!header)
+        return;
+      unit_state& unit = units_[header->address];
+      auto outstanding = std::find(unit.outstanding.begin(), unit.outstanding.end(), header->transaction_id);
+      bool released = outstanding != unit.outstanding.end();
+      if (released)
+        unit.outstanding.erase(outstanding);
+      if (unit.handler)
+        unit.handler(pkg);
+      else if (default_handler_)
+        default_handler_(pkg);
+      if (released)
+        pump();
+    }
+
+    /**
+     * \brief queue a request
+     * \param request the request
+     * \return false if the queue of the unit is full
+     */
+    template <typename packet_type> bool submit(const packet_type& request) {
+      unit_state& unit = units_[request.address];
+      if (unit.queue.size() >= max_queued_)
+        return false;
+      unit.queue.emplace_back(request.transaction_id, bus_.serialize(request));
+      if (!unit.active) {
+        unit.active = true;
+        active_.push_back(request.address);
+      }
+      pump();
+      return true;
+    }
+
+    /**
+     * \brief give up the oldest outstanding request of a unit, e.g. after a timeout
+     * \param unit the unit id
+     */
+    void abandon(const uint8_t unit) {
+      if (!units_[unit].outstanding.empty()) {
+        units_[unit].outstanding.erase(units_[unit].outstanding.begin());
+        pump();
+      }
+    }
+
+    /**
+     * \brief give up an outstanding request, e.g. after a timeout
+     * \param unit the unit id
+     * \param transaction_id the transaction id of the request
+     */
+    void abandon(const uint8_t unit, const uint16_t transaction_id) {
+      std::vector<uint16_t>& outstanding = units_[unit].outstanding;
+      auto it = std::find(outstanding.begin(), outstanding.end(), transaction_id);
+      if (it != outstanding.end()) {
+        outstanding.erase(it);
+        pump();
+      }
+    }
+
+    /**
+     * \brief number of outstanding requests of a unit
+     */
+    uint_least32_t in_flight(const uint8_t unit) const { return static_cast<uint_least32_t>(units_[unit].outstanding.size()); }
+
+    /**
+     * \brief number of queued requests of a unit
+     */
+    size_t queued(const uint8_t unit) const { return units_[unit].queue.size(); }
+
+  private:
+    struct unit_state {
+      handler_type handler;
+      std::deque<std::pair<uint16_t, std::string>> queue;
+      std::vector<uint16_t> outstanding;
+      bool active = false;
+    };
+
+    /**
+     * \brief send one request per unit and round while units have capacity
+     * All frames are joined into a single device write, which is only valid because the bus is tcp.
+     */
+    void pump() {
+      buffer_.clear();
+      bool progress = true;
+      while (progress) {
+        progress = false;
+        for (size_t i = active_.size(); i > 0; i--) {
+          uint8_t id = active_.front();
+          active_.pop_front();
+          unit_state& unit = units_[id];
+          if (unit.outstanding.size() < max_in_flight_) {
+            unit.outstanding.push_back(unit.queue.front().first);
+            buffer_.append(unit.queue.front().second);
+            unit.queue.pop_front();
+            progress = true;
+          }
+          if (unit.queue.empty())
+            unit.active = false;
+          else
+            active_.push_back(id);
+        }
+      }
+      if (!buffer_.empty())
+        bus_.send_frame(buffer_);
+    }
+
+    bus<device_type>& bus_;
+    const uint_least32_t max_in_flight_;
+    const size_t max_queued_;
+    std::array<unit_state, 256> units_;
+    std::deque<uint8_t> active_;
+    handler_type default_handler_;
+    std::string buffer_;
+  };
+} // namespace cbus
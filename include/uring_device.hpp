@@ -0,0 +1,462 @@
+#pragma once
+
+#include "becker.hpp"
+#include "view.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+namespace cbus {
+  /**
+   * \brief Device for sockets, serial ports and ptys driven by io_uring
+   * Receiving uses a multishot receive on sockets and a re-armed read otherwise, both selecting from a provided buffer ring,
+   * so data is passed to the bus without a syscall per frame. All data sent between two polls is written with a single request.
+   * With a batch handler all data received during one poll is passed in a single call, the buffers are handed back to the kernel afterwards.
+   * If io_uring or provided buffer rings are unavailable the device falls back to non-blocking read and write calls.
+   * The device is driven by calling poll, it is not thread safe.
+   * Needs the io_uring headers of Linux 5.19 or newer, so it is not part of cbus.hpp and has to be included directly.
+   */
+  class uring_device {
+  public:
+    /**
+     * \brief construct new device
+     * \param fd the connected file descriptor, the device takes ownership
+     * \param use_uring try to use io_uring, false forces the fallback
+     * \param buffer_count number of receive buffers, a power of two
+     * \param buffer_size size of each receive buffer
+     */
+    uring_device(const int fd, const bool use_uring = true, const unsigned buffer_count = 64, const unsigned buffer_size = 4096)
+        : fd_(fd), buffer_count_(buffer_count), buffer_size_(buffer_size) {
+      becker::bassert((buffer_count > 0) && (buffer_count <= 32768) && !(buffer_count & (buffer_count - 1)), __FILE__, __LINE__,
+                      "buffer count has to be a power of two");
+      struct stat info;
+      if (fstat(fd, &info) != 0)
+        throw std::system_error(errno, std::generic_category(), "fstat");
+      socket_ = S_ISSOCK(info.st_mode);
+      buffers_.resize(static_cast<size_t>(buffer_count) * buffer_size);
+      if (!use_uring || !setup_ring()) {
+        teardown_ring();
+        int flags = fcntl(fd, F_GETFL);
+        if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0))
+          throw std::system_error(errno, std::generic_category(), "fcntl");
+      }
+    }
+
+    uring_device(const uring_device&) = delete;
+    uring_device& operator=(const uring_device&) = delete;
+
+    ~uring_device() {
+      handler_ = nullptr;
+      batch_handler_ = nullptr;
+      if (ring_fd_ >= 0) {
+        cancel(tag_receive);
+        cancel(tag_send);
+        for (uint_least32_t i = 0; (i < 100) && (receive_armed_ || send_in_flight_); i++) {
+          if (!enter(1))
+            break;
+          reap();
+        }
+      }
+      teardown_ring();
+      ::close(fd_);
+    }
+
+    /**
+     * \brief register the handler receiving data, called from poll
+     * \param handler the handler
+     */
+    void register_handler(std::function<void(const std::string&)> handler) { handler_ = handler; }
+
+    /**
+     * \brief register a handler receiving all data of a poll at once, used instead of the handler
+     * \param handler the handler, an empty function restores passing the data chunk by chunk
+     */
+    void register_batch_handler(std::function<void(const received_chunk*, size_t)> handler) { batch_handler_ = handler; }
+
+    /**
+     * \brief queue data, it is written on the next poll
+     * \param data the data
+     */
+    void send(std::string data) {
+      if (open_)
+        pending_.append(data);
+    }
+
+    /**
+     * \brief write queued data and process received data
+     * \param timeout_ms time to wait for events, 0 to not block, -1 to wait forever
+     * \return false if the device is closed
+     */
+    bool poll(const int timeout_ms = 0) {
+      if (!open_)
+        return false;
+      if (ring_fd_ < 0)
+        return poll_fallback(timeout_ms);
+      if (!receive_armed_ && !paused_)
+        arm_receive();
+      start_send();
+      if (!enter(0))
+        return open_;
+      if ((reap() == 0) && (timeout_ms != 0)) {
+        pollfd ring{ring_fd_, POLLIN, 0};
+        ::poll(&ring, 1, timeout_ms);
+        reap();
+      }
+      if (sq_pending_)
+        enter(0);
+      return open_;
+    }
+
+    /**
+     * \brief stop or continue reading, data already received by the kernel is still passed to the handler
+     * \param paused true to stop reading
+     */
+    void pause_receive(const bool paused) {
+      if (paused && !paused_ && receive_armed_ && (ring_fd_ >= 0))
+        cancel(tag_receive);
+      paused_ = paused;
+    }
+
+    /**
+     * \brief check if the device is still usable
+     */
+    bool open() const { return open_; }
+
+    /**
+     * \brief check if io_uring is used or the fallback
+     */
+    bool uses_uring() const { return ring_fd_ >= 0; }
+
+    /**
+     * \brief number of bytes queued or in flight for sending
+     */
+    size_t unsent() const { return pending_.size() + in_flight_.size(); }
+
+  private:
+    static constexpr uint64_t tag_receive = 1;
+    static constexpr uint64_t tag_send = 2;
+    static constexpr uint64_t tag_cancel = 3;
+    static constexpr unsigned entries = 8;
+
+    bool setup_ring() {
+      io_uring_params params;
+      std::memset(&params, 0, sizeof(params));
+      ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+      if (ring_fd_ < 0)
+        return false;
+      sq_entries_ = params.sq_entries;
+      sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+      cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+      sq_ring_ = map(ring_fd_, sq_size_, IORING_OFF_SQ_RING);
+      if (!sq_ring_)
+        return false;
+      if (params.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ring_ = sq_ring_;
+      else if (!(cq_ring_ = map(ring_fd_, cq_size_, IORING_OFF_CQ_RING)))
+        return false;
+      sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+      sqes_ = static_cast<io_uring_sqe*>(map(ring_fd_, sqes_size_, IORING_OFF_SQES));
+      if (!sqes_)
+        return false;
+      char* sq = static_cast<char*>(sq_ring_);
+      char* cq = static_cast<char*>(cq_ring_);
+      sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+      sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+      sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+      unsigned* array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+      for (unsigned i = 0; i < params.sq_entries; i++)
+        array[i] = i;
+      cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+      cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+      cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+      cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+      buf_ring_size_ = buffer_count_ * sizeof(io_uring_buf);
+      buf_ring_ = static_cast<io_uring_buf_ring*>(map(-1, buf_ring_size_, 0));
+      if (!buf_ring_)
+        return false;
+      io_uring_buf_reg reg;
+      std::memset(&reg, 0, sizeof(reg));
+      reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+      reg.ring_entries = buffer_count_;
+      reg.bgid = 0;
+      if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+        return false;
+      for (unsigned i = 0; i < buffer_count_; i++)
+        recycle(static_cast<uint16_t>(i));
+      return true;
+    }
+
+    void teardown_ring() {
+      if (sqes_)
+        munmap(sqes_, sqes_size_);
+      if (cq_ring_ && (cq_ring_ != sq_ring_))
+        munmap(cq_ring_, cq_size_);
+      if (sq_ring_)
+        munmap(sq_ring_, sq_size_);
+      if (ring_fd_ >= 0)
+        ::close(ring_fd_);
+      if (buf_ring_)
+        munmap(buf_ring_, buf_ring_size_);
+      sqes_ = nullptr;
+      sq_ring_ = cq_ring_ = nullptr;
+      buf_ring_ = nullptr;
+      ring_fd_ = -1;
+    }
+
+    static void* map(const int fd, const size_t size, const uint64_t offset) {
+      void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, (fd < 0) ? (MAP_PRIVATE | MAP_ANONYMOUS) : (MAP_SHARED | MAP_POPULATE), fd,
+                       static_cast<off_t>(offset));
+      return (ptr == MAP_FAILED) ? nullptr : ptr;
+    }
+
+    /**
+     * \brief hand a receive buffer back to the kernel
+     */
+    void recycle(const uint16_t id) {
+      // bufs of io_uring_buf_ring is misplaced when the uapi header is compiled as c++, so index the ring directly
+      io_uring_buf& buf = reinterpret_cast<io_uring_buf*>(buf_ring_)[buf_tail_ & (buffer_count_ - 1)];
+      buf.addr = reinterpret_cast<uint64_t>(buffers_.data() + static_cast<size_t>(id) * buffer_size_);
+      buf.len = buffer_size_;
+      buf.bid = id;
+      __atomic_store_n(&buf_ring_->tail, ++buf_tail_, __ATOMIC_RELEASE);
+    }
+
+    /**
+     * \brief get the next submission entry, it is passed to the kernel with the next enter
+     */
+    io_uring_sqe* next_sqe() {
+      unsigned tail = *sq_tail_;
+      if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+        return nullptr;
+      io_uring_sqe* sqe = &sqes_[tail & sq_mask_];
+      std::memset(sqe, 0, sizeof(*sqe));
+      __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+      sq_pending_++;
+      return sqe;
+    }
+
+    void arm_receive() {
+      io_uring_sqe* sqe = next_sqe();
+      if (!sqe)
+        return;
+      if (socket_) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+      } else {
+        sqe->opcode = IORING_OP_READ;
+        sqe->off = static_cast<uint64_t>(-1);
+        sqe->len = buffer_size_;
+      }
+      sqe->fd = fd_;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = 0;
+      sqe->user_data = tag_receive;
+      receive_armed_ = true;
+    }
+
+    void start_send() {
+      if (send_in_flight_ || (in_flight_.empty() && pending_.empty()))
+        return;
+      io_uring_sqe* sqe = next_sqe();
+      if (!sqe)
+        return;
+      if (in_flight_.empty())
+        in_flight_.swap(pending_);
+      else {
+        in_flight_.append(pending_);
+        pending_.clear();
+      }
+      sqe->opcode = socket_ ? IORING_OP_SEND : IORING_OP_WRITE;
+      sqe->fd = fd_;
+      sqe->addr = reinterpret_cast<uint64_t>(in_flight_.data());
+      sqe->len = static_cast<uint32_t>(in_flight_.size());
+      if (socket_)
+        sqe->msg_flags = MSG_NOSIGNAL;
+      else
+        sqe->off = static_cast<uint64_t>(-1);
+      sqe->user_data = tag_send;
+      send_in_flight_ = true;
+    }
+
+    void cancel(const uint64_t tag) {
+      io_uring_sqe* sqe = next_sqe();
+      if (!sqe)
+        return;
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->addr = tag;
+      sqe->user_data = tag_cancel;
+    }
+
+    /**
+     * \brief submit queued entries
+     * \param wait number of completions to wait for
+     */
+    bool enter(const unsigned wait) {
+      long ret;
+      do
+        ret = syscall(__NR_io_uring_enter, ring_fd_, sq_pending_, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+      while ((ret < 0) && (errno == EINTR));
+      if (ret < 0) {
+        open_ = false;
+        return false;
+      }
+      sq_pending_ -= std::min(sq_pending_, static_cast<unsigned>(ret));
+      return true;
+    }
+
+    /**
+     * \brief process all completions
+     * \return number of completions
+     */
+    size_t reap() {
+      size_t count = 0;
+      unsigned head = *cq_head_;
+      while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+        io_uring_cqe cqe = cqes_[head & cq_mask_];
+        __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+        count++;
+        if (cqe.user_data == tag_receive)
+          received(cqe);
+        else if (cqe.user_data == tag_send)
+          sent(cqe);
+      }
+      // re-arm only after the batch handed its buffers back, on -ENOBUFS the receive would fail again at once
+      deliver_batch();
+      if (open_ && !receive_armed_ && !paused_)
+        arm_receive();
+      return count;
+    }
+
+    void received(const io_uring_cqe& cqe) {
+      if (!(cqe.flags & IORING_CQE_F_MORE))
+        receive_armed_ = false;
+      if (cqe.res > 0) {
+        uint16_t id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        if (batch_handler_) {
+          batch_.push_back(received_chunk{buffers_.data() + static_cast<size_t>(id) * buffer_size_, static_cast<size_t>(cqe.res), std::nullopt});
+          batch_ids_.push_back(id);
+        } else {
+          data_.assign(buffers_.data() + static_cast<size_t>(id) * buffer_size_, static_cast<size_t>(cqe.res));
+          recycle(id);
+          if (handler_)
+            handler_(data_);
+        }
+      } else if ((cqe.res != -ENOBUFS) && (cqe.res != -ECANCELED))
+        open_ = false;
+    }
+
+    /**
+     * \brief pass the collected chunks to the batch handler and hand their buffers back
+     */
+    void deliver_batch() {
+      if (batch_.empty())
+        return;
+      if (batch_handler_)
+        batch_handler_(batch_.data(), batch_.size());
+      for (uint16_t id : batch_ids_)
+        recycle(id);
+      batch_.clear();
+      batch_ids_.clear();
+    }
+
+    void sent(const io_uring_cqe& cqe) {
+      send_in_flight_ = false;
+      if (cqe.res < 0) {
+        open_ = false;
+        return;
+      }
+      in_flight_.erase(0, static_cast<size_t>(cqe.res));
+      if (open_)
+        start_send();
+    }
+
+    bool poll_fallback(const int timeout_ms) {
+      pollfd events{fd_, static_cast<short>((paused_ ? 0 : POLLIN) | (unsent() ? POLLOUT : 0)), 0};
+      if (::poll(&events, 1, timeout_ms) < 0)
+        return open_ = (errno == EINTR);
+      if (events.revents & (POLLERR | POLLNVAL))
+        return open_ = false;
+      if (!pending_.empty()) {
+        ssize_t ret = socket_ ? ::send(fd_, pending_.data(), pending_.size(), MSG_NOSIGNAL) : ::write(fd_, pending_.data(), pending_.size());
+        if (ret > 0)
+          pending_.erase(0, static_cast<size_t>(ret));
+        else if ((ret < 0) && (errno != EAGAIN) && (errno != EINTR))
+          return open_ = false;
+      }
+      while (!paused_) {
+        char* buffer = buffers_.data() + batch_.size() * buffer_size_;
+        ssize_t ret = ::read(fd_, buffer, buffer_size_);
+        if ((ret > 0) && batch_handler_) {
+          batch_.push_back(received_chunk{buffer, static_cast<size_t>(ret), std::nullopt});
+          if (batch_.size() == buffer_count_)
+            deliver_batch();
+        } else if (ret > 0) {
+          data_.assign(buffer, static_cast<size_t>(ret));
+          if (handler_)
+            handler_(data_);
+        } else if ((ret < 0) && (errno == EINTR))
+          continue;
+        else {
+          if ((ret == 0) || (errno != EAGAIN))
+            open_ = false;
+          break;
+        }
+      }
+      deliver_batch();
+      return open_;
+    }
+
+    const int fd_;
+    const unsigned buffer_count_;
+    const unsigned buffer_size_;
+    bool socket_ = false;
+    bool open_ = true;
+    bool paused_ = false;
+    std::function<void(const std::string&)> handler_;
+    std::function<void(const received_chunk*, size_t)> batch_handler_;
+    std::vector<received_chunk> batch_;
+    std::vector<uint16_t> batch_ids_;
+    std::vector<char> buffers_;
+    std::string data_;
+    std::string pending_;
+    std::string in_flight_;
+
+    int ring_fd_ = -1;
+    void* sq_ring_ = nullptr;
+    void* cq_ring_ = nullptr;
+    size_t sq_size_ = 0;
+    size_t cq_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned sq_pending_ = 0;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+    io_uring_buf_ring* buf_ring_ = nullptr;
+    size_t buf_ring_size_ = 0;
+    uint16_t buf_tail_ = 0;
+    bool receive_armed_ = false;
+    bool send_in_flight_ = false;
+  };
+} // namespace cbus
@@ -0,0 +1,201 @@
+#pragma once
+
+#include "becker.hpp"
+#include "contents.hpp"
+#include <string.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace cbus {
+  /**
+   * \brief Order of the bytes of a multi register value on the wire
+   * A is the most significant byte of the value. abcd is plain big endian, cdab swaps the registers,
+   * badc swaps the bytes inside each register and dcba is plain little endian.
+   * For 64 bit values the register order is reversed completely by cdab and dcba.
+   */
+  enum class word_order { abcd, cdab, badc, dcba };
+
+  namespace detail {
+    /**
+     * \brief get a register from a source without further decoding
+     */
+    template <typename registers_type> inline uint16_t register_at(const registers_type& registers, const size_t index) { return registers[index]; }
+
+    /**
+     * \brief decode values with a fixed word and byte swap
+     * The order is resolved outside of the loop, so the loop body is branch free and can be vectorized by the compiler.
+     */
+    template <typename T, bool swap_words, bool swap_bytes, typename registers_type>
+    void decode_block(const registers_type& registers, const size_t first_register, const size_t value_count, T* output) {
+      constexpr size_t width = sizeof(T) / 2;
+      using raw_type = typename std::conditional<width == 1, uint16_t, typename std::conditional<width == 2, uint32_t, uint64_t>::type>::type;
+      for (size_t value = 0; value < value_count; value++) {
+        raw_type raw = 0;
+        const size_t base = first_register + value * width;
+        for (size_t i = 0; i < width; i++) {
+          uint16_t reg = register_at(registers, base + (swap_words ? (width - 1 - i) : i));
+          if (swap_bytes)
+            reg = static_cast<uint16_t>((reg >> 8) | (reg << 8));
+          raw = static_cast<raw_type>((static_cast<uint64_t>(raw) << 16) | reg);
+        }
+        memcpy(&output[value], &raw, sizeof(T));
+      }
+    }
+
+    /**
+     * \brief encode values with a fixed word and byte swap
+     */
+    template <typename T, bool swap_words, bool swap_bytes> void encode_block(const T* values, const size_t value_count, uint16_t* output) {
+      constexpr size_t width = sizeof(T) / 2;
+      using raw_type = typename std::conditional<width == 1, uint16_t, typename std::conditional<width == 2, uint32_t, uint64_t>::type>::type;
+      for (size_t value = 0; value < value_count; value++) {
+        raw_type raw;
+        memcpy(&raw, &values[value], sizeof(T));
+        for (size_t i = 0; i < width; i++) {
+          uint16_t reg = static_cast<uint16_t>(static_cast<uint64_t>(raw) >> (16 * (width - 1 - i)));
+          if (swap_bytes)
+            reg = static_cast<uint16_t>((reg >> 8) | (reg << 8));
+          output[value * width + (swap_words ? (width - 1 - i) : i)] = reg;
+        }
+      }
+    }
+
+    template <typename T> constexpr void check_value_type() {
+      static_assert(std::is_trivially_copyable<T>::value && ((sizeof(T) == 2) || (sizeof(T) == 4) || (sizeof(T) == 8)), "values have to be 16, 32 or 64 bit wide");
+    }
+  } // namespace detail
+
+  /**
+   * \brief decode a block of registers into typed values
+   * \param registers register source with operator[], e.g. register_data of a response or a register_view
+   * \param first_register index of the first register to decode
+   * \param value_count number of values to decode
+   * \param order byte order of the values
+   * \param output storage for value_count values
+   */
+  template <typename T, typename registers_type>
+  void decode_values(const registers_type& registers, const size_t first_register, const size_t value_count, const word_order order, T* output) {
+    detail::check_value_type<T>();
+    becker::bassert(first_register + value_count * (sizeof(T) / 2) <= registers.size(), __FILE__, __LINE__, "not enough registers to decode");
+    switch (order) {
+    case word_order::abcd:
+      detail::decode_block<T, false, false>(registers, first_register, value_count, output);
+      break;
+    case word_order::cdab:
+      detail::decode_block<T, true, false>(registers, first_register, value_count, output);
+      break;
+    case word_order::badc:
+      detail::decode_block<T, false, true>(registers, first_register, value_count, output);
+      break;
+    case word_order::dcba:
+      detail::decode_block<T, true, true>(registers, first_register, value_count, output);
+      break;
+    }
+  }
+
+  /**
+   * \brief decode all registers into typed values
+   * \param registers register source with operator[], e.g. register_data of a response or a register_view
+   * \param order byte order of the values
+   * \return the decoded values, trailing registers not forming a complete value are ignored
+   */
+  template <typename T, typename registers_type> std::vector<T> decode_values(const registers_type& registers, const word_order order = word_order::abcd) {
+    std::vector<T> output(registers.size() / (sizeof(T) / 2));
+    decode_values<T>(registers, 0, output.size(), order, output.data());
+    return output;
+  }
+
+  /**
+   * \brief encode typed values into registers
+   * \param values the values to encode
+   * \param value_count number of values
+   * \param order byte order of the values
+   * \param output storage for value_count * sizeof(T) / 2 registers
+   */
+  template <typename T> void encode_values(const T* values, const size_t value_count, const word_order order, uint16_t* output) {
+    detail::check_value_type<T>();
+    switch (order) {
+    case word_order::abcd:
+      detail::encode_block<T, false, false>(values, value_count, output);
+      break;
+    case word_order::cdab:
+      detail::encode_block<T, true, false>(values, value_count, output);
+      break;
+    case word_order::badc:
+      detail::encode_block<T, false, true>(values, value_count, output);
+      break;
+    case word_order::dcba:
+      detail::encode_block<T, true, true>(values, value_count, output);
+      break;
+    }
+  }
+
+  /**
+   * \brief encode typed values into registers
+   * \param values the values to encode
+   * \param order byte order of the values
+   * \return the registers
+   */
+  template <typename T> std::vector<uint16_t> encode_values(const std::vector<T>& values, const word_order order = word_order::abcd) {
+    std::vector<uint16_t> output(values.size() * (sizeof(T) / 2));
+    encode_values<T>(values.data(), values.size(), order, output.data());
+    return output;
+  }
+
+  /**
+   * \brief decode an ascii string stored with two characters per register
+   * \param registers register source with operator[]
+   * \param first_register index of the first register of the string
+   * \param register_count number of registers of the string
+   * \param order badc and dcba store the first character in the low byte
+   * \return the string up to the first NUL character
+   */
+  template <typename registers_type>
+  std::string decode_string(const registers_type& registers, const size_t first_register, const size_t register_count, const word_order order = word_order::abcd) {
+    becker::bassert(first_register + register_count <= registers.size(), __FILE__, __LINE__, "not enough registers to decode");
+    const bool swap_bytes = (order == word_order::badc) || (order == word_order::dcba);
+    std::string output(register_count * 2, '\0');
+    for (size_t i = 0; i < register_count; i++) {
+      uint16_t reg = detail::register_at(registers, first_register + i);
+      output[2 * i] = static_cast<char>(swap_bytes ? (reg & 0xff) : (reg >> 8));
+      output[2 * i + 1] = static_cast<char>(swap_bytes ? (reg >> 8) : (reg & 0xff));
+    }
+    size_t end = output.find('\0');
+    if (end != std::string::npos)
+      output.resize(end);
+    return output;
+  }
+
+  /**
+   * \brief encode an ascii string with two characters per register
+   * \param text the string, truncated or padded with NUL to the register count
+   * \param register_count number of registers to produce
+   * \param order badc and dcba store the first character in the low byte
+   * \return the registers
+   */
+  inline std::vector<uint16_t> encode_string(const std::string& text, const size_t register_count, const word_order order = word_order::abcd) {
+    const bool swap_bytes = (order == word_order::badc) || (order == word_order::dcba);
+    std::vector<uint16_t> output(register_count);
+    for (size_t i = 0; i < register_count; i++) {
+      uint8_t first = (2 * i < text.size()) ? static_cast<uint8_t>(text[2 * i]) : 0;
+      uint8_t second = (2 * i + 1 < text.size()) ? static_cast<uint8_t>(text[2 * i + 1]) : 0;
+      output[i] = swap_bytes ? static_cast<uint16_t>((second << 8) | first) : static_cast<uint16_t>((first << 8) | second);
+    }
+    return output;
+  }
+
+  /**
+   * \brief build a write request for typed values
+   * \param transaction_id The id of the transaction
+   * \param address The address of the target
+   * \param first_register index of the first register to write
+   * \param values the values to write
+   * \param order byte order of the values
+   */
+  template <typename T>
+  write_holding_registers_request make_write_request(const uint16_t transaction_id, const uint8_t address, const uint16_t first_register, const std::vector<T>& values,
+                                                     const word_order order = word_order::abcd) {
+    return write_holding_registers_request(transaction_id, address, first_register, encode_values(values, order));
+  }
+} // namespace cbus
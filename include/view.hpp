@@ -0,0 +1,170 @@
+#pragma once
+
+#include "becker.hpp"
+#include <iterator>
+#include <optional>
+#include <string>
+
+namespace cbus {
+  /**
+   * \brief Read-only view over big-endian register values still stored inside a receive buffer
+   * The values are decoded on access, no intermediate container is created.
+   * The view is only valid as long as the buffer it points into, so it must not be stored beyond the handler call.
+   */
+  class register_view {
+  public:
+    /**
+     * \brief iterator decoding one register per dereference
+     */
+    class const_iterator {
+    public:
+      using iterator_category = std::random_access_iterator_tag;
+      using value_type = uint16_t;
+      using difference_type = std::ptrdiff_t;
+      using pointer = void;
+      using reference = uint16_t;
+
+      /**
+       * \brief construct new iterator
+       * \param data pointer to the high byte of the register
+       */
+      explicit const_iterator(const unsigned char* data = nullptr) : data_(data) {}
+      uint16_t operator*() const { return static_cast<uint16_t>((data_[0] << 8) | data_[1]); }
+      uint16_t operator[](difference_type n) const { return *(*this + n); }
+      const_iterator& operator++() {
+        data_ += 2;
+        return *this;
+      }
+      const_iterator operator++(int) {
+        const_iterator old = *this;
+        data_ += 2;
+        return old;
+      }
+      const_iterator& operator--() {
+        data_ -= 2;
+        return *this;
+      }
+      const_iterator operator--(int) {
+        const_iterator old = *this;
+        data_ -= 2;
+        return old;
+      }
+      const_iterator& operator+=(difference_type n) {
+        data_ += 2 * n;
+        return *this;
+      }
+      const_iterator& operator-=(difference_type n) {
+        data_ -= 2 * n;
+        return *this;
+      }
+      const_iterator operator+(difference_type n) const { return const_iterator(data_ + 2 * n); }
+      const_iterator operator-(difference_type n) const { return const_iterator(data_ - 2 * n); }
+      difference_type operator-(const const_iterator& other) const { return (data_ - other.data_) / 2; }
+      bool operator==(const const_iterator& other) const { return data_ == other.data_; }
+      bool operator!=(const const_iterator& other) const { return data_ != other.data_; }
+      bool operator<(const const_iterator& other) const { return data_ < other.data_; }
+
+    private:
+      const unsigned char* data_;
+    };
+
+    /**
+     * \brief construct empty view
+     */
+    register_view() = default;
+
+    /**
+     * \brief construct new view
+     * \param data pointer to the first byte of the big-endian register payload
+     * \param count number of registers in the payload
+     */
+    register_view(const char* data, size_t count) : data_(reinterpret_cast<const unsigned char*>(data)), count_(count) {}
+
+    /**
+     * \brief number of registers
+     */
+    size_t size() const { return count_; }
+
+    /**
+     * \brief check if the view contains no registers
+     */
+    bool empty() const { return count_ == 0; }
+
+    /**
+     * \brief decode a single register without bounds check
+     * \param index register index inside the view
+     */
+    uint16_t operator[](size_t index) const { return static_cast<uint16_t>((data_[2 * index] << 8) | data_[2 * index + 1]); }
+
+    /**
+     * \brief decode a single register
+     * \param index register index inside the view
+     */
+    uint16_t at(size_t index) const {
+      becker::bassert(index < count_, __FILE__, __LINE__, "register index out of range");
+      return (*this)[index];
+    }
+
+    const_iterator begin() const { return const_iterator(data_); }
+    const_iterator end() const { return const_iterator(data_ + 2 * count_); }
+
+    /**
+     * \brief decode all registers into application storage
+     * \param target output iterator receiving size() values
+     * \return iterator behind the last written value
+     */
+    template <typename output_iterator> output_iterator copy_to(output_iterator target) const {
+      for (size_t i = 0; i < count_; i++)
+        *target++ = (*this)[i];
+      return target;
+    }
+
+    /**
+     * \brief raw big-endian payload
+     */
+    const char* data() const { return reinterpret_cast<const char*>(data_); }
+
+  private:
+    const unsigned char* data_ = nullptr;
+    size_t count_ = 0;
+  };
+
+  /**
+   * \brief Locate the register payload of a read registers response without copying it
+   * \param content the content following the function code
+   * \param size set to the number of content bytes belonging to the packet
+   * \param view set to the registers inside content
+   * \return false if the content is incomplete or invalid, the normal parser has to handle it then
+   */
+  inline bool find_register_payload(const std::string& content, uint_least64_t& size, register_view& view) {
+    if (content.size() < 1)
+      return false;
+    uint8_t len = static_cast<uint8_t>(content[0]);
+    if ((len % 2) != 0)
+      return false;
+    if (content.size() < (1u + len))
+      return false;
+    size = len + 1;
+    view = register_view(content.data() + 1, len / 2);
+    return true;
+  }
+
+  /**
+   * \brief View of a chunk of received data passed in a batch
+   * The data is only valid during the call it is passed to.
+   */
+  struct received_chunk {
+    /**
+     * \brief the received bytes
+     */
+    const char* data;
+    /**
+     * \brief number of received bytes
+     */
+    size_t size;
+    /**
+     * \brief receive time in the unit of config::now, if the device knows it
+     */
+    std::optional<int_least64_t> timestamp;
+  };
+} // namespace cbus
@@ -0,0 +1,244 @@
+#pragma once
+
+#include "becker.hpp"
+#include "bus.hpp"
+#include <array>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <optional>
+#include <vector>
+
+namespace cbus {
+  /**
+   * \brief Combines register writes to adjacent addresses into write_holding_registers_request frames
+   * Writes to the same unit are collected for a configurable window. Overlapping writes use the value of the last writer.
+   * When a combined frame is answered each original requester gets a response shaped like its own request.
+   * All packets received by the bus have to be passed to received, poll has to be called regularly.
+   * On tcp responses are matched by transaction id. On rtu only one combined frame is sent at a time, the next one follows its response or timeout.
+   */
+  template <typename device_type> class write_combiner {
+  public:
+    /**
+     * \brief callback receiving the response for the original request
+     */
+    using callback_type = std::function<void(const single_packet&)>;
+
+    /**
+     * \brief construct new write combiner
+     * \param target the bus to send on, has to outlive the combiner
+     * \param now A lambda returning the current time, in the arbitrary time unit of window and timeout
+     * \param window time writes to a unit are collected before they are sent
+     * \param max_registers maximum number of registers in a single frame
+     * \param timeout time to wait for the response of a combined frame, its requesters then get a gateway_no_response error
+     */
+    write_combiner(bus<device_type>& target, const std::function<int_least64_t()> now, const int_least64_t window, const uint16_t max_registers = 123,
+                   const int_least64_t timeout = 1000)
+        : bus_(target), now_(now), window_(window), max_registers_(max_registers), timeout_(timeout) {
+      becker::bassert((max_registers > 0) && (max_registers <= 123), __FILE__, __LINE__, "invalid register limit");
+    }
+
+    /**
+     * \brief queue a single register write
+     * \param request the write
+     * \param callback called with a write_single_holding_register_response or error_response
+     */
+    void submit(const write_single_holding_register_request& request, const callback_type& callback) {
+      add(std::make_shared<requester>(request, request.register_index, 1, request.register_value, callback), &request.register_value);
+    }
+
+    /**
+     * \brief queue a multiple register write
+     * \param request the write
+     * \param callback called with a write_holding_registers_response or error_response
+     */
+    void submit(const write_holding_registers_request& request, const callback_type& callback) {
+      becker::bassert(request.first_register + request.register_content.size() <= 0x10000, __FILE__, __LINE__, "register range out of bounds");
+      if (request.register_content.empty())
+        return;
+      add(std::make_shared<requester>(request, request.first_register, request.register_content.size(), 0, callback), request.register_content.data());
+    }
+
+    /**
+     * \brief fail frames without response within the timeout and send all units whose window expired
+     */
+    void poll() {
+      int_least64_t now = now_();
+      std::list<frame> expired;
+      for (auto it = in_flight_.begin(); it != in_flight_.end();) {
+        auto next = std::next(it);
+        if (now - it->sent >= timeout_)
+          expired.splice(expired.end(), in_flight_, it);
+        it = next;
+      }
+      for (const frame& f : expired)
+        answer(f.requesters, error_code::gateway_no_response);
+      send_queued();
+      for (unit_state& state : units_) {
+        if (!state.requesters.empty() && (now - state.first_submit >= window_))
+          flush(state);
+      }
+    }
+
+    /**
+     * \brief send all queued writes immediately
+     */
+    void flush() {
+      for (unit_state& state : units_) {
+        if (!state.requesters.empty())
+          flush(state);
+      }
+    }
+
+    /**
+     * \brief pass a packet received by the bus
+     * \param pkg the received packet
+     * \return true if the packet answered a combined frame
+     */
+    bool received(const single_packet& pkg) {
+      const write_holding_registers_response* response = std::get_if<write_holding_registers_response>(&pkg);
+      const error_response* error = std::get_if<error_response>(&pkg);
+      if (error && (static_cast<uint8_t>(error->function) != (static_cast<uint8_t>(function_code::write_holding_registers) | 0x80)))
+        error = nullptr;
+      if (!response && !error)
+        return false;
+      const packet* header = get_header(pkg);
+      for (auto it = in_flight_.begin(); it != in_flight_.end(); it++) {
+        if ((it->unit != header->address) || (bus_.tcp_format() && (it->transaction_id != header->transaction_id)))
+          continue;
+        if (response && (response->first_register != it->first))
+          continue;
+        std::vector<std::shared_ptr<requester>> requesters = std::move(it->requesters);
+        in_flight_.erase(it);
+        if (error)
+          answer(requesters, error->error);
+        else
+          answer(requesters, std::nullopt);
+        send_queued();
+        return true;
+      }
+      return false;
+    }
+
+    /**
+     * \brief number of combined frames waiting to be sent or for their response
+     */
+    size_t in_flight() const { return in_flight_.size() + queued_.size(); }
+
+  private:
+    struct requester {
+      requester(const packet& p_header, const uint16_t p_first, const size_t p_count, const uint16_t p_value, const callback_type& p_callback)
+          : header(p_header), first(p_first), count(p_count), value(p_value), callback(p_callback) {}
+      packet header;
+      uint16_t first;
+      size_t count;
+      uint16_t value;
+      callback_type callback;
+      size_t frames = 0;
+      bool failed = false;
+      error_code error = error_code::slave_device_failure;
+    };
+
+    struct unit_state {
+      std::map<uint16_t, uint16_t> values;
+      std::vector<std::shared_ptr<requester>> requesters;
+      int_least64_t first_submit = 0;
+    };
+
+    struct frame {
+      uint8_t unit;
+      uint16_t first;
+      uint16_t transaction_id;
+      std::vector<uint16_t> content;
+      std::vector<std::shared_ptr<requester>> requesters;
+      int_least64_t sent = 0;
+    };
+
+    void add(const std::shared_ptr<requester>& r, const uint16_t* values) {
+      unit_state& state = units_[r->header.address];
+      if (state.requesters.empty())
+        state.first_submit = now_();
+      for (size_t i = 0; i < r->count; i++)
+        state.values[r->first + i] = values[i];
+      state.requesters.push_back(r);
+    }
+
+    /**
+     * \brief send the combined writes of a unit
+     */
+    void flush(unit_state& state) {
+      uint8_t unit = state.requesters.front()->header.address;
+      auto it = state.values.begin();
+      while (it != state.values.end()) {
+        uint16_t first = it->first;
+        std::vector<uint16_t> content;
+        while ((it != state.values.end()) && (it->first == first + content.size()) && (content.size() < max_registers_)) {
+          content.push_back(it->second);
+          it++;
+        }
+        frame f{unit, first, transaction_id_++, std::move(content), {}};
+        for (const std::shared_ptr<requester>& r : state.requesters) {
+          if ((r->first < first + f.content.size()) && (first < r->first + r->count)) {
+            r->frames++;
+            f.requesters.push_back(r);
+          }
+        }
+        queued_.push_back(std::move(f));
+      }
+      state.values.clear();
+      state.requesters.clear();
+      send_queued();
+    }
+
+    /**
+     * \brief send queued frames, on rtu only if no other frame waits for its response
+     */
+    void send_queued() {
+      while (!queued_.empty() && (bus_.tcp_format() || in_flight_.empty())) {
+        in_flight_.splice(in_flight_.end(), queued_, queued_.begin());
+        frame& f = in_flight_.back();
+        f.sent = now_();
+        bus_.send(write_holding_registers_request(f.transaction_id, f.unit, f.first, f.content));
+      }
+    }
+
+    /**
+     * \brief account the response of a frame to its requesters
+     * \param requesters the requesters covered by the frame
+     * \param error the error of the frame, if it failed
+     */
+    void answer(const std::vector<std::shared_ptr<requester>>& requesters, const std::optional<error_code> error) {
+      for (const std::shared_ptr<requester>& r : requesters) {
+        if (error && !r->failed) {
+          r->failed = true;
+          r->error = *error;
+        }
+        if (--r->frames == 0)
+          complete(*r);
+      }
+    }
+
+    /**
+     * \brief answer an original requester
+     */
+    void complete(const requester& r) {
+      if (r.failed)
+        r.callback(error_response(r.header.transaction_id, r.header.address, r.header.function, r.error));
+      else if (r.header.function == function_code::write_single_holding_register)
+        r.callback(write_single_holding_register_response(r.header, r.first, r.value));
+      else
+        r.callback(write_holding_registers_response(r.header, r.first, r.count));
+    }
+
+    bus<device_type>& bus_;
+    const std::function<int_least64_t()> now_;
+    const int_least64_t window_;
+    const uint16_t max_registers_;
+    const int_least64_t timeout_;
+    std::array<unit_state, 256> units_;
+    std::list<frame> queued_;
+    std::list<frame> in_flight_;
+    uint16_t transaction_id_ = 0;
+  };
+} // namespace cbus
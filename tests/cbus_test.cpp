@@ -2,7 +2,18 @@
 
 #include "cbus.hpp"
 #include "doctest.h"
+#include "slave_farm.hpp"
 #include <string>
+#ifdef CBUS_TEST_POSIX
+#include "shm_image.hpp"
+#endif
+#ifdef CBUS_TEST_SERIAL
+#include "serial_device.hpp"
+#endif
+#ifdef CBUS_TEST_URING
+#include "uring_device.hpp"
+#include <termios.h>
+#endif
 
 struct virtual_bus {
   void register_handler(std::function<void(const std::string&)> feed) { virtual_bus::feed = feed; }
@@ -214,3 +225,1383 @@ TEST_CASE("test invalid protocol id") {
   std::string data("\x00\x00\x00\x01\x00\x06\x00\x01\x01\x00\x00\x01", 5);
   vbus->feed(data);
 }
+
+TEST_CASE("test register handler receives rtu registers without emission") {
+  uint64_t time = 0;
+  uint_least32_t cnt = 0;
+  uint_least32_t streamed = 0;
+  cbus::config cfg;
+  cfg.now = [&time] { return time; };
+  cfg.close_on_timeout = true;
+  cfg.use_tcp_format = false;
+  cfg.is_master = true;
+  cfg.address = 0;
+  std::shared_ptr<virtual_bus> vbus = std::make_shared<virtual_bus>();
+  cbus::bus<virtual_bus> b(vbus, cfg, [&cnt](const cbus::single_packet&) { cnt++; });
+  b.set_register_handler([&streamed](const cbus::packet& header, const cbus::register_view& registers) {
+    streamed++;
+    CHECK(header.address == 1);
+    CHECK(header.function == cbus::function_code::read_input_registers);
+    CHECK(registers.size() == 1);
+    CHECK(registers.at(0) == 0xffff);
+  });
+  std::string data("\x01\x04\x02\xff\xff\xb8\x80", 7);
+  vbus->feed(data);
+  CHECK(b.open());
+  CHECK(cnt == 0);
+  CHECK(streamed == 1);
+}
+
+TEST_CASE("test register handler copies tcp registers into application storage") {
+  uint64_t time = 0;
+  uint_least32_t cnt = 0;
+  uint16_t table[3] = {0, 0, 0};
+  cbus::config cfg;
+  cfg.now = [&time] { return time; };
+  cfg.use_tcp_format = true;
+  cfg.is_master = true;
+  cfg.address = 0;
+  std::shared_ptr<virtual_bus> vbus = std::make_shared<virtual_bus>();
+  cbus::bus<virtual_bus> b(vbus, cfg, [&cnt](const cbus::single_packet&) { cnt++; });
+  b.set_register_handler([&table](const cbus::packet& header, const cbus::register_view& registers) {
+    CHECK(header.transaction_id == 7);
+    registers.copy_to(table);
+  });
+  vbus->feed(std::string("\x00\x07\x00\x00\x00\x09\x01\x03\x06\x00\x01\x12\x34\xab\xcd", 15));
+  vbus->feed(std::string("\x00\x08\x00\x00\x00\x06\x01\x06\x00\x10\x00\x02", 12));
+  CHECK(b.open());
+  CHECK(table[0] == 0x0001);
+  CHECK(table[1] == 0x1234);
+  CHECK(table[2] == 0xabcd);
+  CHECK(cnt == 1);
+}
+
+TEST_CASE("test spsc queue drops when full") {
+  cbus::spsc_queue<std::string> queue(3);
+  CHECK(queue.capacity() == 4);
+  for (uint_least32_t i = 0; i < 6; i++)
+    queue.push(std::to_string(i));
+  CHECK(queue.full());
+  CHECK(queue.pushed() == 4);
+  CHECK(queue.dropped() == 2);
+  std::string drained;
+  CHECK(queue.drain([&drained](std::string& v) { drained += v; }, 3) == 3);
+  CHECK(drained == "012");
+  CHECK(queue.size() == 1);
+  CHECK(queue.push("x"));
+  CHECK(queue.drain([&drained](std::string& v) { drained += v; }) == 2);
+  CHECK(drained == "0123x");
+}
+
+TEST_CASE("test spsc queue hands packets to another thread") {
+  uint64_t time = 0;
+  cbus::config cfg;
+  cfg.now = [&time] { return time; };
+  cfg.use_tcp_format = true;
+  cfg.is_master = false;
+  cfg.address = 0x42;
+  std::shared_ptr<cbus::spsc_queue<cbus::single_packet>> queue = std::make_shared<cbus::spsc_queue<cbus::single_packet>>(1024);
+  std::shared_ptr<virtual_bus> vbus = std::make_shared<virtual_bus>();
+  cbus::bus<virtual_bus> b(vbus, cfg, cbus::make_queue_emission(queue));
+  uint_least32_t received = 0;
+  std::thread consumer([&queue, &received] {
+    while (received < 100)
+      received += queue->drain([](cbus::single_packet& pkg) { CHECK(std::get<cbus::read_coils_request>(pkg).coil_count == 1); });
+  });
+  std::string data("\x00\x00\x00\x00\x00\x06\x42\x01\x01\x00\x00\x01", 12);
+  for (uint_least32_t i = 0; i < 100; i++)
+    vbus->feed(data);
+  consumer.join();
+  CHECK(received == 100);
+  CHECK(queue->dropped() == 0);
+}
+
+TEST_CASE("test send queue batches frames from multiple threads") {
+  uint64_t time = 0;
+  cbus::config cfg;
+  cfg.now = [&time] { return time; };
+  cfg.use_tcp_format = true;
+  cfg.is_master = true;
+  cfg.address = 0;
+  std::shared_ptr<virtual_bus> vbus = std::make_shared<virtual_bus>();
+  cbus::bus<virtual_bus> b(vbus, cfg, [](const cbus::single_packet&) {});
+  cbus::send_queue<virtual_bus> queue(b);
+  CHECK(queue.flush() == 0);
+  CHECK(vbus->buf.size() == 0);
+  std::vector<std::thread> producers;
+  for (uint16_t t = 0; t < 4; t++)
+    producers.emplace_back([&queue, t] {
+      for (uint16_t i = 0; i < 50; i++)
+        queue.enqueue(cbus::write_single_holding_register_request(t * 100 + i, 1, t, i));
+    });
+  for (std::thread& producer : producers)
+    producer.join();
+  CHECK(!queue.empty());
+  CHECK(queue.flush() == 200);
+  CHECK(queue.empty());
+  REQUIRE(vbus->buf.size() == 1);
+  CHECK(vbus->buf.at(0).size() == 200 * 12);
+  uint16_t last_value[4] = {0, 0, 0, 0};
+  bool ordered = true;
+  for (size_t offset = 0; offset < vbus->buf.at(0).size(); offset += 12) {
+    uint16_t index = cbus::get_u16(__FILE__, __LINE__, vbus->buf.at(0), offset + 8);
+    uint16_t value = cbus::get_u16(__FILE__, __LINE__, vbus->buf.at(0), offset + 10);
+    if (value && (value != last_value[index] + 1))
+      ordered = false;
+    last_value[index] = value;
+  }
+  CHECK(ordered);
+}
+
+TEST_CASE("test send queue keeps rtu frames separate") {
+  uint64_t time = 0;
+  cbus::config cfg;
+  cfg.now = [&time] { return time; };
+  cfg.use_tcp_format = false;
+  cfg.is_master = true;
+  cfg.address = 0;
+  std::shared_ptr<virtual_bus> vbus = std::make_shared<virtual_bus>();
+  cbus::bus<virtual_bus> b(vbus, cfg, [](const cbus::single_packet&) {});
+  cbus::send_queue<virtual_bus> queue(b);
+  queue.enqueue(cbus::write_single_holding_register_request(0, 1, 2, 3));
+  queue.enqueue(cbus::write_single_holding_register_request(0, 1, 2, 4));
+  queue.enqueue(cbus::write_single_holding_register_request(0, 1, 2, 5));
+  CHECK(queue.flush() == 3);
+  REQUIRE(vbus->buf.size() == 3);
+  for (size_t i = 0; i < 3; i++) {
+    CHECK(vbus->buf.at(i).size() == 8);
+    CHECK(cbus::get_u16(__FILE__, __LINE__, vbus->buf.at(i), 4) == 3 + i);
+  }
+}
+
+TEST_CASE("test byte-at-a-time receive of rtu packets with garbage") {
+  uint64_t time = 0;
+  uint_least32_t cnt = 0;
+  cbus::config cfg;
+  cfg.now = [&time] { return time; };
+  cfg.use_tcp_format = false;
+  cfg.is_master = true;
+  cfg.address = 0;
+  std::shared_ptr<virtual_bus> vbus = std::make_shared<virtual_bus>();
+  cbus::bus<virtual_bus> b(vbus, cfg, [&cnt](const cbus::single_packet& pkg) {
+    cnt++;
+    CHECK(std::holds_alternative<cbus::read_input_registers_response>(pkg));
+  });
+  std::string frame("\x01\x04\x02\xff\xff\xb8\x80", 7);
+  std::string data = std::string("\x03\x01\x55", 3) + frame + frame + std::string("\x04\xff", 2) + frame;
+  for (char c : data)
+    vbus->feed(std::string(1, c));
+  CHECK(b.open());
+  CHECK(cnt == 3);
+}
+
+TEST_CASE("test byte-at-a-time receive of tcp packets") {
+  uint64_t time = 0;
+  uint_least32_t cnt = 0;
+  cbus::config cfg;
+  cfg.now = [&time] { return time; };
+  cfg.close_on_timeout = true;
+  cfg.use_tcp_format = true;
+  cfg.is_master = false;
+  cfg.address = 0x42;
+  std::shared_ptr<virtual_bus> vbus = std::make_shared<virtual_bus>();
+  cbus::bus<virtual_bus> b(vbus, cfg, [&cnt](const cbus::single_packet& pkg) {
+    CHECK(std::get<cbus::read_coils_request>(pkg).transaction_id == cnt);
+    cnt++;
+  });
+  std::string data;
+  for (uint16_t i = 0; i < 20; i++)
+    data += cbus::serialize_frame(cbus::read_coils_request(i, 0x42, 0x100, 1), true);
+  for (char c : data)
+    vbus->feed(std::string(1, c));
+  CHECK(b.open());
+  CHECK(cnt == 20);
+}
+
+TEST_CASE("test frame template resend") {
+  uint64_t time = 0;
+  cbus::config cfg;
+  cfg.now = [&time] { return time; };
+  cfg.is_master = true;
+  cfg.address = 0;
+  cfg.use_tcp_format = true;
+  std::shared_ptr<virtual_bus> vbus = std::make_shared<virtual_bus>();
+  cbus::bus<virtual_bus> tcp(vbus, cfg, [](const cbus::single_packet&) {});
+  cbus::frame_template poll = tcp.compile(cbus::read_holding_registers_request(0, 1, 0x35, 0x27));
+  tcp.send(poll, 0x1234);
+  tcp.send(poll);
+  REQUIRE(vbus->buf.size() == 2);
+  CHECK(vbus->buf.at(0) == std::string("\x12\x34\x00\x00\x00\x06\x01\x03\x00\x35\x00\x27", 12));
+  CHECK(vbus->buf.at(1) == std::string("\x00\x00\x00\x00\x00\x06\x01\x03\x00\x35\x00\x27", 12));
+
+  cfg.use_tcp_format = false;
+  std::shared_ptr<virtual_bus> rbus = std::make_shared<virtual_bus>();
+  cbus::bus<virtual_bus> rtu(rbus, cfg, [](const cbus::single_packet&) {});
+  cbus::read_input_registers_request req(0, 1, 0x35, 0x27);
+  cbus::frame_template rtu_poll = rtu.compile(req);
+  rtu.send(rtu_poll, 0x1234);
+  REQUIRE(rbus->buf.size() == 1);
+  CHECK(rbus->buf.at(0) == rtu.serialize(req));
+  CHECK_THROWS(rtu.send(poll));
+}
+
+TEST_CASE("test typed value decoding") {
+  std::vector<uint16_t> abcd = {0x3f80, 0x0000, 0xc2f6, 0xe979};
+  std::vector<float> values = cbus::decode_values<float>(abcd);
+  REQUIRE(values.size() == 2);
+  CHECK(values.at(0) == 1.0f);
+  CHECK(values.at(1) == -123.456f);
+  CHECK(cbus::decode_values<float>(std::vector<uint16_t>{0x0000, 0x3f80}, cbus::word_order::cdab).at(0) == 1.0f);
+  CHECK(cbus::decode_values<float>(std::vector<uint16_t>{0x803f, 0x0000}, cbus::word_order::badc).at(0) == 1.0f);
+  CHECK(cbus::decode_values<float>(std::vector<uint16_t>{0x0000, 0x803f}, cbus::word_order::dcba).at(0) == 1.0f);
+  CHECK(cbus::decode_values<int64_t>(std::vector<uint16_t>{0x0708, 0x0506, 0x0304, 0x0102}, cbus::word_order::cdab).at(0) == 0x0102030405060708);
+  CHECK(cbus::decode_values<int32_t>(std::vector<uint16_t>{0xffff, 0xfffe}).at(0) == -2);
+
+  std::string payload("\x3f\x80\x00\x00\x00\x00\x00\x01", 8);
+  cbus::register_view view(payload.data(), 4);
+  uint32_t counters[2];
+  cbus::decode_values<uint32_t>(view, 0, 2, cbus::word_order::abcd, counters);
+  CHECK(counters[0] == 0x3f800000);
+  CHECK(counters[1] == 1);
+  CHECK_THROWS(cbus::decode_values<double>(view, 2, 1, cbus::word_order::abcd, reinterpret_cast<double*>(counters)));
+}
+
+TEST_CASE("test typed value encoding") {
+  std::vector<double> values = {3.5, -1e300, 0.0};
+  for (cbus::word_order order : {cbus::word_order::abcd, cbus::word_order::cdab, cbus::word_order::badc, cbus::word_order::dcba}) {
+    std::vector<uint16_t> registers = cbus::encode_values(values, order);
+    CHECK(registers.size() == 12);
+    CHECK(cbus::decode_values<double>(registers, order) == values);
+  }
+  cbus::write_holding_registers_request request = cbus::make_write_request<float>(1, 2, 100, {1.0f}, cbus::word_order::cdab);
+  CHECK(request.first_register == 100);
+  CHECK(request.register_content == std::vector<uint16_t>{0x0000, 0x3f80});
+  std::vector<uint16_t> text = cbus::encode_string("ABC", 3);
+  CHECK(text == std::vector<uint16_t>{0x4142, 0x4300, 0x0000});
+  CHECK(cbus::decode_string(text, 0, 3) == "ABC");
+  CHECK(cbus::decode_string(cbus::encode_string("ABCD", 2, cbus::word_order::badc), 0, 2, cbus::word_order::badc) == "ABCD");
+}
+
+TEST_CASE("test change detection on register blocks") {
+  cbus::change_detector detector;
+  cbus::block_key key{1, cbus::register_table::holding_registers, 100};
+  std::vector<uint16_t> registers(20, 0);
+  CHECK(detector.update(key, registers) == std::vector<cbus::changed_range>{{100, 20}});
+  CHECK(detector.update(key, registers).empty());
+  registers.at(3) = 1;
+  registers.at(4) = 1;
+  registers.at(19) = 7;
+  CHECK(detector.update(key, registers) == std::vector<cbus::changed_range>{{103, 2}, {119, 1}});
+  CHECK(detector.update(key, registers).empty());
+
+  std::vector<bool> coils(10, false);
+  cbus::block_key coil_key{1, cbus::register_table::coils, 0};
+  detector.update(coil_key, coils);
+  coils.at(9) = true;
+  CHECK(detector.update(coil_key, coils) == std::vector<cbus::changed_range>{{9, 1}});
+}
+
+TEST_CASE("test change detection deadbands") {
+  cbus::change_detector detector;
+  cbus::block_key key{1, cbus::register_table::input_registers, 0};
+  cbus::deadband_tag absolute{0, cbus::value_type::float32};
+  absolute.band = 0.5;
+  cbus::deadband_tag percent{2, cbus::value_type::uint16};
+  percent.band = 10;
+  percent.percent = true;
+  detector.add_deadband(key, absolute);
+  detector.add_deadband(key, percent);
+  std::vector<uint16_t> registers = cbus::encode_values<float>({10.0f});
+  registers.push_back(100);
+  detector.update(key, registers);
+  registers = cbus::encode_values<float>({10.3f});
+  registers.push_back(105);
+  CHECK(detector.update(key, registers).empty());
+  registers = cbus::encode_values<float>({10.6f});
+  registers.push_back(111);
+  CHECK(detector.update(key, registers) == std::vector<cbus::changed_range>{{0, 3}});
+}
+
+TEST_CASE("test timeseries store compresses and queries samples") {
+  cbus::timeseries_store store(100);
+  std::vector<uint16_t> registers = {10, 20, 30};
+  for (int_least64_t t = 0; t < 1000; t++) {
+    registers.at(0) = static_cast<uint16_t>(10 + (t % 3));
+    registers.at(2) = static_cast<uint16_t>(65535 - t);
+    store.append(5, 1000 + t * 1000 + ((t == 500) ? 7 : 0), registers);
+  }
+  CHECK(store.size() == 3000);
+  CHECK(store.encoded_size() < 3000 * 3);
+  std::vector<cbus::sample> samples = store.query(5, 1000 + 499 * 1000, 1000 + 501 * 1000 - 1);
+  REQUIRE(samples.size() == 2);
+  CHECK(samples.at(0).timestamp == 500000);
+  CHECK(samples.at(0).value == 10 + (499 % 3));
+  CHECK(samples.at(1).timestamp == 501007);
+  CHECK(store.query(7, 0, 2000000).back().value == 65535 - 999);
+  CHECK(store.query(6, 0, 2000000).size() == 1000);
+  CHECK(store.query(8, 0, 2000000).empty());
+  uint_least32_t tags = 0;
+  store.export_all([&tags](uint_least32_t tag, const std::vector<cbus::sample>& values) {
+    CHECK(tag >= 5);
+    CHECK(values.size() == 1000);
+    tags++;
+  });
+  CHECK(tags == 3);
+  CHECK_THROWS(store.append(5, 0, 1));
+}
+
+#ifdef CBUS_TEST_POSIX
+TEST_CASE("test shared memory image") {
+  std::string name = "/cbus_test_" + std::to_string(getpid());
+  cbus::shm_image owner(name, true);
+  cbus::shm_image reader(name, false);
+  owner.write_registers(cbus::shm_image::table::holding_registers, 60, {1, 2, 3, 4, 5, 6, 7, 8});
+  owner.write_coils(cbus::shm_image::table::coils, 510, {true, false, true});
+  CHECK(reader.read_registers(cbus::shm_image::table::holding_registers, 59, 10) == std::vector<uint16_t>{0, 1, 2, 3, 4, 5, 6, 7, 8, 0});
+  CHECK(reader.read_registers(cbus::shm_image::table::input_registers, 60, 2) == std::vector<uint16_t>{0, 0});
+  CHECK(reader.read_coils(cbus::shm_image::table::coils, 510, 3) == std::vector<bool>{true, false, true});
+  CHECK_THROWS(reader.write_registers(cbus::shm_image::table::holding_registers, 0, {1}));
+
+  CHECK(reader.queue_write(cbus::shm_image::table::input_registers, 0xfffe, std::vector<uint16_t>{9, 10}));
+  CHECK(reader.queue_write(cbus::shm_image::table::coils, 511, std::vector<bool>{true}));
+  CHECK(owner.read_registers(cbus::shm_image::table::input_registers, 0xfffe, 2) == std::vector<uint16_t>{0, 0});
+  CHECK(owner.apply_queued_writes() == 2);
+  CHECK(reader.read_registers(cbus::shm_image::table::input_registers, 0xfffe, 2) == std::vector<uint16_t>{9, 10});
+  CHECK(reader.read_coils(cbus::shm_image::table::coils, 511, 1) == std::vector<bool>{true});
+  uint_least32_t queued = 0;
+  while (reader.queue_write(cbus::shm_image::table::holding_registers, 0, std::vector<uint16_t>{1}))
+    queued++;
+  CHECK(queued == cbus::shm_image::queue_size);
+  CHECK(owner.apply_queued_writes() == cbus::shm_image::queue_size);
+}
+
+TEST_CASE("test slave bus answers from shared memory image") {
+  uint64_t time = 0;
+  cbus::config cfg;
+  cfg.now = [&time] { return time; };
+  cfg.use_tcp_format = true;
+  cfg.is_master = false;
+  cfg.address = 0x42;
+  cbus::shm_image image("/cbus_test_answer_" + std::to_string(getpid()), true);
+  image.write_registers(cbus::shm_image::table::holding_registers, 0x10, {0xabcd});
+  std::shared_ptr<virtual_bus> vbus = std::make_shared<virtual_bus>();
+  std::unique_ptr<cbus::bus<virtual_bus>> b;
+  b = std::make_unique<cbus::bus<virtual_bus>>(vbus, cfg, [&image, &b](const cbus::single_packet& pkg) {
+    CHECK(image.answer(pkg, [&b](const auto& response) { b->send(response); }));
+  });
+  vbus->feed(cbus::serialize_frame(cbus::read_holding_registers_request(3, 0x42, 0x10, 1), true));
+  vbus->feed(cbus::serialize_frame(cbus::write_single_holding_register_request(4, 0x42, 0x11, 7), true));
+  vbus->feed(cbus::serialize_frame(cbus::read_holding_registers_request(5, 0x42, 0xffff, 2), true));
+  image.write_coils(cbus::shm_image::table::coils, 1, {true, true});
+  vbus->feed(cbus::serialize_frame(cbus::read_coils_request(6, 0x42, 0, 9), true));
+  REQUIRE(vbus->buf.size() == 4);
+  CHECK(vbus->buf.at(0) == std::string("\x00\x03\x00\x00\x00\x05\x42\x03\x02\xab\xcd", 11));
+  CHECK(vbus->buf.at(1) == std::string("\x00\x04\x00\x00\x00\x06\x42\x06\x00\x11\x00\x07", 12));
+  CHECK(vbus->buf.at(2) == std::string("\x00\x05\x00\x00\x00\x03\x42\x83\x02", 9));
+  CHECK(vbus->buf.at(3) == std::string("\x00\x06\x00\x00\x00\x05\x42\x01\x02\x06\x00", 11));
+  CHECK(image.read_registers(cbus::shm_image::table::holding_registers, 0x11, 1).at(0) == 7);
+}
+#endif
+
+TEST_CASE("test rtu scheduler priorities, timeouts and back-off") {
+  int_least64_t time = 0;
+  cbus::config cfg;
+  cfg.now = [&time] { return time; };
+  cfg.use_tcp_format = false;
+  cfg.is_master = true;
+  cfg.address = 0;
+  std::shared_ptr<virtual_bus> vbus = std::make_shared<virtual_bus>();
+  cbus::rtu_scheduler<virtual_bus>* scheduler = nullptr;
+  cbus::bus<virtual_bus> b(vbus, cfg, [&scheduler](const cbus::single_packet& pkg) { scheduler->received(pkg); });
+  cbus::scheduler_config scfg;
+  scfg.now = [&time] { return time; };
+  scfg.response_timeout = 100;
+  scfg.turnaround_gap = 5;
+  scfg.backoff_base = 1000;
+  cbus::rtu_scheduler<virtual_bus> s(b, scfg);
+  scheduler = &s;
+  std::vector<std::string> results;
+  auto record = [&results](const std::string& name) {
+    return [&results, name](cbus::request_status status, const cbus::single_packet&) { results.push_back(name + ":" + std::to_string(static_cast<int>(status))); };
+  };
+  s.submit(cbus::read_input_registers_request(0, 1, 0, 1), record("poll1"));
+  s.submit(cbus::read_input_registers_request(0, 1, 0, 1), record("poll2"));
+  s.submit(cbus::write_single_holding_register_request(0, 2, 0, 1), record("write"));
+  CHECK(vbus->buf.size() == 1);
+  CHECK(s.busy());
+  CHECK(s.pending() == 2);
+  vbus->feed(std::string("\x01\x04\x02\xff\xff\xb8\x80", 7));
+  CHECK(results == std::vector<std::string>{"poll1:0"});
+  CHECK(vbus->buf.size() == 1);
+  time += 5;
+  s.poll();
+  REQUIRE(vbus->buf.size() == 2);
+  CHECK(vbus->buf.at(1).at(0) == 2);
+  time += 100;
+  s.poll();
+  CHECK(results == std::vector<std::string>{"poll1:0", "write:1"});
+  s.submit(cbus::write_single_holding_register_request(0, 2, 0, 1), record("write2"));
+  time += 5;
+  s.poll();
+  CHECK(results == std::vector<std::string>{"poll1:0", "write:1", "write2:2"});
+  REQUIRE(vbus->buf.size() == 3);
+  CHECK(vbus->buf.at(2).at(0) == 1);
+}
+
+TEST_CASE("test write combiner merges adjacent writes") {
+  int_least64_t time = 0;
+  cbus::config cfg;
+  cfg.now = [&time] { return time; };
+  cfg.use_tcp_format = true;
+  cfg.is_master = true;
+  cfg.address = 0;
+  std::shared_ptr<virtual_bus> vbus = std::make_shared<virtual_bus>();
+  cbus::write_combiner<virtual_bus>* combiner = nullptr;
+  cbus::bus<virtual_bus> b(vbus, cfg, [&combiner](const cbus::single_packet& pkg) { CHECK(combiner->received(pkg)); });
+  cbus::write_combiner<virtual_bus> c(b, [&time] { return time; }, 10, 3);
+  combiner = &c;
+  std::vector<cbus::single_packet> results;
+  auto record = [&results](const cbus::single_packet& pkg) { results.push_back(pkg); };
+  c.submit(cbus::write_single_holding_register_request(100, 1, 10, 1), record);
+  c.submit(cbus::write_single_holding_register_request(101, 1, 11, 2), record);
+  time += 5;
+  c.submit(cbus::write_holding_registers_request(102, 1, 12, {3, 4}), record);
+  c.submit(cbus::write_single_holding_register_request(103, 1, 12, 5), record);
+  c.submit(cbus::write_single_holding_register_request(104, 2, 0, 6), record);
+  c.poll();
+  CHECK(vbus->buf.empty());
+  time += 5;
+  c.poll();
+  CHECK(vbus->buf.size() == 2);
+  time += 5;
+  c.poll();
+  REQUIRE(vbus->buf.size() == 3);
+  CHECK(vbus->buf.at(0) == cbus::serialize_frame(cbus::write_holding_registers_request(0, 1, 10, {1, 2, 5}), true));
+  CHECK(vbus->buf.at(1) == cbus::serialize_frame(cbus::write_holding_registers_request(1, 1, 13, {4}), true));
+  CHECK(vbus->buf.at(2) == cbus::serialize_frame(cbus::write_holding_registers_request(2, 2, 0, {6}), true));
+  CHECK(c.in_flight() == 3);
+  vbus->feed(cbus::serialize_frame(cbus::write_holding_registers_response(0, 1, 10, 3), true));
+  CHECK(results.size() == 3);
+  vbus->feed(cbus::serialize_frame(cbus::error_response(1, 1, cbus::function_code::write_holding_registers, cbus::error_code::illegal_data_address), true));
+  vbus->feed(cbus::serialize_frame(cbus::write_holding_registers_response(2, 2, 0, 1), true));
+  CHECK(c.in_flight() == 0);
+  REQUIRE(results.size() == 5);
+  CHECK(std::get<cbus::write_single_holding_register_response>(results.at(0)).transaction_id == 100);
+  CHECK(std::get<cbus::write_single_holding_register_response>(results.at(1)).register_value == 2);
+  CHECK(std::get<cbus::write_single_holding_register_response>(results.at(2)).transaction_id == 103);
+  CHECK(std::get<cbus::error_response>(results.at(3)).transaction_id == 102);
+  CHECK(std::get<cbus::error_response>(results.at(3)).error == cbus::error_code::illegal_data_address);
+  CHECK(std::get<cbus::write_single_holding_register_response>(results.at(4)).address == 2);
+}
+
+TEST_CASE("test write combiner matches transaction ids and times out") {
+  int_least64_t time = 0;
+  cbus::config cfg;
+  cfg.now = [&time] { return time; };
+  cfg.use_tcp_format = true;
+  cfg.is_master = true;
+  cfg.address = 0;
+  std::shared_ptr<virtual_bus> vbus = std::make_shared<virtual_bus>();
+  cbus::write_combiner<virtual_bus>* combiner = nullptr;
+  cbus::bus<virtual_bus> b(vbus, cfg, [&combiner](const cbus::single_packet& pkg) { combiner->received(pkg); });
+  cbus::write_combiner<virtual_bus> c(b, [&time] { return time; }, 10, 123, 100);
+  combiner = &c;
+  std::vector<cbus::single_packet> results;
+  auto record = [&results](const cbus::single_packet& pkg) { results.push_back(pkg); };
+  c.submit(cbus::write_single_holding_register_request(100, 1, 10, 1), record);
+  c.submit(cbus::write_single_holding_register_request(101, 1, 20, 2), record);
+  c.flush();
+  REQUIRE(vbus->buf.size() == 2);
+  vbus->feed(cbus::serialize_frame(cbus::error_response(1, 1, cbus::function_code::write_holding_registers, cbus::error_code::illegal_data_address), true));
+  REQUIRE(results.size() == 1);
+  CHECK(std::get<cbus::error_response>(results.at(0)).transaction_id == 101);
+  CHECK(c.in_flight() == 1);
+  time += 99;
+  c.poll();
+  CHECK(results.size() == 1);
+  time += 1;
+  c.poll();
+  REQUIRE(results.size() == 2);
+  CHECK(std::get<cbus::error_response>(results.at(1)).transaction_id == 100);
+  CHECK(std::get<cbus::error_response>(results.at(1)).error == cbus::error_code::gateway_no_response);
+  CHECK(c.in_flight() == 0);
+}
+
+TEST_CASE("test write combiner sends one rtu frame at a time") {
+  int_least64_t time = 0;
+  cbus::config cfg;
+  cfg.now = [&time] { return time; };
+  cfg.use_tcp_format = false;
+  cfg.is_master = true;
+  cfg.address = 0;
+  std::shared_ptr<virtual_bus> vbus = std::make_shared<virtual_bus>();
+  cbus::write_combiner<virtual_bus>* combiner = nullptr;
+  cbus::bus<virtual_bus> b(vbus, cfg, [&combiner](const cbus::single_packet& pkg) { combiner->received(pkg); });
+  cbus::write_combiner<virtual_bus> c(b, [&time] { return time; }, 10, 123, 100);
+  combiner = &c;
+  std::vector<cbus::single_packet> results;
+  auto record = [&results](const cbus::single_packet& pkg) { results.push_back(pkg); };
+  c.submit(cbus::write_single_holding_register_request(0, 1, 0, 1), record);
+  c.submit(cbus::write_single_holding_register_request(0, 2, 0, 2), record);
+  c.submit(cbus::write_single_holding_register_request(0, 3, 0, 3), record);
+  c.flush();
+  CHECK(vbus->buf.size() == 1);
+  CHECK(c.in_flight() == 3);
+  vbus->feed(cbus::serialize_frame(cbus::write_holding_registers_response(0, 1, 0, 1), false));
+  REQUIRE(results.size() == 1);
+  REQUIRE(vbus->buf.size() == 2);
+  CHECK(vbus->buf.at(1) == cbus::serialize_frame(cbus::write_holding_registers_request(0, 2, 0, {2}), false));
+  time += 100;
+  c.poll();
+  REQUIRE(results.size() == 2);
+  CHECK(std::get<cbus::error_response>(results.at(1)).error == cbus::error_code::gateway_no_response);
+  REQUIRE(vbus->buf.size() == 3);
+  CHECK(vbus->buf.at(2) == cbus::serialize_frame(cbus::write_holding_registers_request(0, 3, 0, {3}), false));
+  vbus->feed(cbus::serialize_frame(cbus::write_holding_registers_response(0, 3, 0, 1), false));
+  CHECK(results.size() == 3);
+  CHECK(c.in_flight() == 0);
+}
+
+TEST_CASE("test response cache collapses and serves gateway requests") {
+  int_least64_t time = 0;
+  cbus::config slave_cfg;
+  slave_cfg.now = [&time] { return time; };
+  slave_cfg.use_tcp_format = true;
+  slave_cfg.is_master = false;
+  slave_cfg.address = 0;
+  cbus::config master_cfg = slave_cfg;
+  master_cfg.is_master = true;
+  cbus::response_cache cache([&time] { return time; }, 100);
+  std::shared_ptr<virtual_bus> clients = std::make_shared<virtual_bus>();
+  std::shared_ptr<virtual_bus> field = std::make_shared<virtual_bus>();
+  std::map<uint16_t, cbus::cache_key> forwarded;
+  uint16_t upstream_id = 0;
+  std::unique_ptr<cbus::bus<virtual_bus>> client_bus;
+  cbus::bus<virtual_bus> field_bus(field, master_cfg, [&](const cbus::single_packet& pkg) {
+    auto it = forwarded.find(cbus::get_header(pkg)->transaction_id);
+    REQUIRE(it != forwarded.end());
+    cache.complete(it->second, pkg);
+    forwarded.erase(it);
+  });
+  client_bus = std::make_unique<cbus::bus<virtual_bus>>(clients, slave_cfg, [&](const cbus::single_packet& pkg) {
+    cbus::cache_result result = cache.lookup(pkg, [&client_bus](const std::string& frame) { client_bus->send_frame(frame); });
+    if (result == cbus::cache_result::miss) {
+      const cbus::read_holding_registers_request& request = std::get<cbus::read_holding_registers_request>(pkg);
+      forwarded.emplace(upstream_id, *cbus::response_cache::key_of(pkg));
+      field_bus.send(cbus::read_holding_registers_request(upstream_id++, request.address, request.first_register, request.register_count));
+    }
+  });
+  clients->feed(cbus::serialize_frame(cbus::read_holding_registers_request(10, 1, 0, 2), true));
+  clients->feed(cbus::serialize_frame(cbus::read_holding_registers_request(11, 1, 0, 2), true));
+  CHECK(field->buf.size() == 1);
+  CHECK(clients->buf.empty());
+  field->feed(cbus::serialize_frame(cbus::read_holding_registers_response(0, 1, {0x1234, 0x5678}), true));
+  REQUIRE(clients->buf.size() == 2);
+  CHECK(clients->buf.at(0) == cbus::serialize_frame(cbus::read_holding_registers_response(10, 1, {0x1234, 0x5678}), true));
+  CHECK(clients->buf.at(1) == cbus::serialize_frame(cbus::read_holding_registers_response(11, 1, {0x1234, 0x5678}), true));
+  time += 50;
+  clients->feed(cbus::serialize_frame(cbus::read_holding_registers_request(12, 1, 0, 2), true));
+  CHECK(field->buf.size() == 1);
+  REQUIRE(clients->buf.size() == 3);
+  CHECK(cbus::get_u16(__FILE__, __LINE__, clients->buf.at(2), 0) == 12);
+  time += 50;
+  clients->feed(cbus::serialize_frame(cbus::read_holding_registers_request(13, 1, 0, 2), true));
+  CHECK(field->buf.size() == 2);
+  cache.fail(forwarded.begin()->second);
+  REQUIRE(clients->buf.size() == 4);
+  CHECK(clients->buf.at(3) == std::string("\x00\x0d\x00\x00\x00\x03\x01\x83\x0b", 9));
+  CHECK(cache.size() == 0);
+}
+
+TEST_CASE("test response cache replies survive nested lookups") {
+  int_least64_t time = 0;
+  cbus::response_cache cache([&time] { return time; }, 100);
+  cbus::cache_key key{1, cbus::function_code::read_holding_registers, 0, 1};
+  std::vector<std::string> frames;
+  auto nested = [&](const std::string& frame) {
+    std::string copy = frame;
+    cache.lookup(cbus::read_holding_registers_request(30, 1, 0, 1), [&frames](const std::string& inner) { frames.push_back(inner); });
+    CHECK(frame == copy);
+    frames.push_back(frame);
+  };
+  CHECK(cache.lookup(cbus::read_holding_registers_request(10, 1, 0, 1), nested) == cbus::cache_result::miss);
+  CHECK(cache.lookup(cbus::read_holding_registers_request(20, 1, 0, 1), nested) == cbus::cache_result::joined);
+  cache.complete(key, cbus::read_holding_registers_response(0, 1, {7}));
+  REQUIRE(frames.size() == 4);
+  CHECK(frames.at(0) == cbus::serialize_frame(cbus::read_holding_registers_response(30, 1, {7}), true));
+  CHECK(frames.at(1) == cbus::serialize_frame(cbus::read_holding_registers_response(10, 1, {7}), true));
+  CHECK(frames.at(3) == cbus::serialize_frame(cbus::read_holding_registers_response(20, 1, {7}), true));
+  CHECK(cache.lookup(cbus::read_holding_registers_request(40, 1, 0, 1), nested) == cbus::cache_result::hit);
+  REQUIRE(frames.size() == 6);
+  CHECK(frames.at(5) == cbus::serialize_frame(cbus::read_holding_registers_response(40, 1, {7}), true));
+}
+
+TEST_CASE("test unit mux routes units and limits outstanding requests") {
+  cbus::config cfg;
+  cfg.now = [] { return 0; };
+  cfg.use_tcp_format = true;
+  cfg.is_master = true;
+  std::shared_ptr<virtual_bus> dev = std::make_shared<virtual_bus>();
+  std::unique_ptr<cbus::unit_mux<virtual_bus>> mux;
+  cbus::bus<virtual_bus> b(dev, cfg, [&mux](const cbus::single_packet& pkg) { mux->dispatch(pkg); });
+  mux = std::make_unique<cbus::unit_mux<virtual_bus>>(b, 1, 2);
+  std::vector<uint16_t> unit_1, unit_2, other;
+  mux->set_handler(1, [&unit_1](const cbus::single_packet& pkg) { unit_1.push_back(cbus::get_header(pkg)->transaction_id); });
+  mux->set_handler(2, [&unit_2](const cbus::single_packet& pkg) { unit_2.push_back(cbus::get_header(pkg)->transaction_id); });
+  mux->set_default_handler([&other](const cbus::single_packet& pkg) { other.push_back(cbus::get_header(pkg)->address); });
+  CHECK(mux->submit(cbus::read_holding_registers_request(1, 1, 0, 1)));
+  CHECK(mux->submit(cbus::read_holding_registers_request(2, 1, 0, 1)));
+  CHECK(mux->submit(cbus::read_holding_registers_request(3, 1, 0, 1)));
+  CHECK_FALSE(mux->submit(cbus::read_holding_registers_request(4, 1, 0, 1)));
+  CHECK(mux->submit(cbus::read_holding_registers_request(5, 2, 0, 1)));
+  REQUIRE(dev->buf.size() == 2);
+  CHECK(mux->in_flight(1) == 1);
+  CHECK(mux->queued(1) == 2);
+  CHECK(mux->in_flight(2) == 1);
+  dev->feed(cbus::serialize_frame(cbus::read_holding_registers_response(5, 2, {7}), true));
+  CHECK(unit_2 == std::vector<uint16_t>{5});
+  CHECK(dev->buf.size() == 2);
+  dev->feed(cbus::serialize_frame(cbus::read_holding_registers_response(1, 1, {7}), true));
+  CHECK(unit_1 == std::vector<uint16_t>{1});
+  REQUIRE(dev->buf.size() == 3);
+  CHECK(dev->buf.at(2) == cbus::serialize_frame(cbus::read_holding_registers_request(2, 1, 0, 1), true));
+  mux->abandon(1);
+  REQUIRE(dev->buf.size() == 4);
+  CHECK(dev->buf.at(3) == cbus::serialize_frame(cbus::read_holding_registers_request(3, 1, 0, 1), true));
+  dev->feed(cbus::serialize_frame(cbus::read_holding_registers_response(9, 9, {7}), true));
+  CHECK(other == std::vector<uint16_t>{9});
+}
+
+TEST_CASE("test unit mux ignores late and unsolicited responses") {
+  cbus::config cfg;
+  cfg.now = [] { return 0; };
+  cfg.use_tcp_format = true;
+  cfg.is_master = true;
+  std::shared_ptr<virtual_bus> dev = std::make_shared<virtual_bus>();
+  std::unique_ptr<cbus::unit_mux<virtual_bus>> mux;
+  cbus::bus<virtual_bus> b(dev, cfg, [&mux](const cbus::single_packet& pkg) { mux->dispatch(pkg); });
+  mux = std::make_unique<cbus::unit_mux<virtual_bus>>(b, 2, 8);
+  std::vector<uint16_t> received;
+  mux->set_handler(1, [&received](const cbus::single_packet& pkg) { received.push_back(cbus::get_header(pkg)->transaction_id); });
+  for (uint16_t id = 1; id <= 4; id++)
+    CHECK(mux->submit(cbus::read_holding_registers_request(id, 1, 0, 1)));
+  CHECK(dev->buf.size() == 2);
+  CHECK(mux->in_flight(1) == 2);
+  dev->feed(cbus::serialize_frame(cbus::read_holding_registers_response(42, 1, {7}), true));
+  CHECK(mux->in_flight(1) == 2);
+  CHECK(dev->buf.size() == 2);
+  mux->abandon(1, 1);
+  REQUIRE(dev->buf.size() == 3);
+  CHECK(dev->buf.at(2) == cbus::serialize_frame(cbus::read_holding_registers_request(3, 1, 0, 1), true));
+  dev->feed(cbus::serialize_frame(cbus::read_holding_registers_response(1, 1, {7}), true));
+  CHECK(mux->in_flight(1) == 2);
+  CHECK(dev->buf.size() == 3);
+  dev->feed(cbus::serialize_frame(cbus::read_holding_registers_response(3, 1, {7}), true));
+  CHECK(mux->in_flight(1) == 2);
+  REQUIRE(dev->buf.size() == 4);
+  CHECK(dev->buf.at(3) == cbus::serialize_frame(cbus::read_holding_registers_request(4, 1, 0, 1), true));
+  CHECK(received == std::vector<uint16_t>{42, 1, 3});
+}
+
+TEST_CASE("test unit mux rejects rtu buses") {
+  cbus::config cfg;
+  cfg.now = [] { return 0; };
+  cfg.use_tcp_format = false;
+  cfg.is_master = true;
+  std::shared_ptr<virtual_bus> dev = std::make_shared<virtual_bus>();
+  cbus::bus<virtual_bus> b(dev, cfg, [](const cbus::single_packet&) {});
+  CHECK_THROWS(std::make_unique<cbus::unit_mux<virtual_bus>>(b));
+  CHECK(dev->buf.empty());
+}
+
+#ifdef CBUS_TEST_URING
+TEST_CASE("test uring device on socket pairs and ptys") {
+  cbus::config cfg;
+  cfg.now = [] { return 0; };
+  cfg.use_tcp_format = true;
+  cfg.is_master = true;
+  for (bool use_uring : {true, false}) {
+    int fds[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    std::shared_ptr<cbus::uring_device> dev = std::make_shared<cbus::uring_device>(fds[0], use_uring);
+    CHECK((use_uring || !dev->uses_uring()));
+    std::vector<cbus::single_packet> received;
+    cbus::bus<cbus::uring_device> b(dev, cfg, [&received](const cbus::single_packet& pkg) { received.push_back(pkg); });
+    b.send(cbus::read_holding_registers_request(1, 2, 3, 4));
+    b.send(cbus::read_holding_registers_request(2, 2, 3, 4));
+    CHECK(dev->poll(0));
+    std::string request = cbus::serialize_frame(cbus::read_holding_registers_request(1, 2, 3, 4), true) +
+                          cbus::serialize_frame(cbus::read_holding_registers_request(2, 2, 3, 4), true);
+    std::string written(request.size(), '\0');
+    CHECK(read(fds[1], &written[0], written.size()) == static_cast<ssize_t>(written.size()));
+    CHECK(written == request);
+    std::string response = cbus::serialize_frame(cbus::read_holding_registers_response(1, 2, {0x1234}), true);
+    CHECK(write(fds[1], response.data(), response.size()) == static_cast<ssize_t>(response.size()));
+    for (uint_least32_t i = 0; (i < 10) && received.empty(); i++)
+      CHECK(dev->poll(100));
+    REQUIRE(received.size() == 1);
+    CHECK(std::get<cbus::read_holding_registers_response>(received.at(0)).register_data == std::vector<uint16_t>{0x1234});
+    close(fds[1]);
+    for (uint_least32_t i = 0; (i < 10) && dev->open(); i++)
+      dev->poll(100);
+    CHECK_FALSE(dev->open());
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    REQUIRE(master >= 0);
+    REQUIRE(grantpt(master) == 0);
+    REQUIRE(unlockpt(master) == 0);
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    REQUIRE(slave >= 0);
+    termios tio;
+    REQUIRE(tcgetattr(slave, &tio) == 0);
+    cfmakeraw(&tio);
+    REQUIRE(tcsetattr(slave, TCSANOW, &tio) == 0);
+    cbus::uring_device pty(master, use_uring);
+    std::string data;
+    pty.register_handler([&data](const std::string& chunk) { data += chunk; });
+    CHECK(write(slave, "\x01\x02\x03", 3) == 3);
+    for (uint_least32_t i = 0; (i < 10) && (data.size() < 3); i++)
+      CHECK(pty.poll(100));
+    CHECK(data == "\x01\x02\x03");
+    pty.send("\x04\x05");
+    CHECK(pty.poll(0));
+    char back[2];
+    CHECK(read(slave, back, 2) == 2);
+    CHECK(std::string(back, 2) == "\x04\x05");
+    close(slave);
+  }
+}
+#endif
+
+#ifdef CBUS_TEST_SERIAL
+TEST_CASE("test serial device round trip over a pty") {
+  cbus::serial_config serial;
+  serial.baud = 9600;
+  CHECK(cbus::serial_device::character_time(serial) == 1145834);
+  CHECK(cbus::serial_device::inter_character_timeout(serial) == 1718751);
+  serial.baud = 115200;
+  CHECK(cbus::serial_device::inter_character_timeout(serial) == 750000);
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  REQUIRE(master >= 0);
+  REQUIRE(grantpt(master) == 0);
+  REQUIRE(unlockpt(master) == 0);
+  int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  REQUIRE(slave >= 0);
+  std::shared_ptr<cbus::serial_device> dev = std::make_shared<cbus::serial_device>(slave, serial);
+  cbus::config cfg;
+  cfg.now = [] { return 0; };
+  cfg.use_tcp_format = false;
+  cfg.is_master = true;
+  std::vector<cbus::single_packet> received;
+  cbus::bus<cbus::serial_device> b(dev, cfg, [&received](const cbus::single_packet& pkg) { received.push_back(pkg); });
+  b.send(cbus::read_holding_registers_request(0, 5, 0x10, 2));
+  std::string request = cbus::serialize_frame(cbus::read_holding_registers_request(0, 5, 0x10, 2), false);
+  std::string written(request.size(), '\0');
+  CHECK(read(master, &written[0], written.size()) == static_cast<ssize_t>(written.size()));
+  CHECK(written == request);
+  std::string response = cbus::serialize_frame(cbus::read_holding_registers_response(0, 5, {1, 2}), false);
+  CHECK(write(master, response.data(), 4) == 4);
+  CHECK(dev->poll(100));
+  CHECK(received.empty());
+  CHECK(write(master, response.data() + 4, response.size() - 4) == static_cast<ssize_t>(response.size() - 4));
+  CHECK(dev->poll(100));
+  REQUIRE(received.size() == 1);
+  CHECK(std::get<cbus::read_holding_registers_response>(received.at(0)).register_data == std::vector<uint16_t>{1, 2});
+  close(master);
+  for (uint_least32_t i = 0; (i < 10) && dev->open(); i++)
+    dev->poll(100);
+  CHECK_FALSE(dev->open());
+}
+#endif
+
+TEST_CASE("test slave farm answers tcp and rtu requests with faults") {
+  int_least64_t time = 0;
+  cbus::slave_farm farm([&time] { return time; });
+  std::shared_ptr<virtual_bus> tcp = std::make_shared<virtual_bus>();
+  std::shared_ptr<virtual_bus> rtu = std::make_shared<virtual_bus>();
+  size_t tcp_id = farm.attach(tcp, true);
+  size_t rtu_id = farm.attach(rtu, false);
+  cbus::simulated_slave_config cfg;
+  cfg.unit = 1;
+  cfg.registers = 10;
+  cbus::simulated_slave& first = farm.add_slave(tcp_id, cfg);
+  first.holding_registers().at(2) = 0x1234;
+  cfg.unit = 2;
+  cfg.faults.error_rate = 1;
+  cfg.faults.error = cbus::error_code::slave_device_busy;
+  farm.add_slave(tcp_id, cfg);
+  cfg.unit = 3;
+  cfg.faults.error_rate = 0;
+  cfg.delay = 10;
+  farm.add_slave(rtu_id, cfg);
+
+  std::string requests = cbus::serialize_frame(cbus::read_holding_registers_request(7, 1, 2, 1), true) +
+                         cbus::serialize_frame(cbus::read_holding_registers_request(8, 2, 2, 1), true) +
+                         cbus::serialize_frame(cbus::read_holding_registers_request(9, 1, 9, 2), true) +
+                         cbus::serialize_frame(cbus::read_holding_registers_request(10, 4, 0, 1), true);
+  tcp->feed(requests.substr(0, 5));
+  CHECK(tcp->buf.empty());
+  tcp->feed(requests.substr(5));
+  REQUIRE(tcp->buf.size() == 3);
+  CHECK(tcp->buf.at(0) == cbus::serialize_frame(cbus::read_holding_registers_response(7, 1, {0x1234}), true));
+  CHECK(tcp->buf.at(1) == cbus::serialize_frame(cbus::error_response(8, 2, cbus::function_code::read_holding_registers, cbus::error_code::slave_device_busy), true));
+  CHECK(tcp->buf.at(2) == cbus::serialize_frame(cbus::error_response(9, 1, cbus::function_code::read_holding_registers, cbus::error_code::illegal_data_address), true));
+
+  rtu->feed("\xff" + cbus::serialize_frame(cbus::write_single_holding_register_request(0, 3, 4, 0xbeef), false));
+  CHECK(rtu->buf.empty());
+  CHECK(farm.pending() == 1);
+  time += 10;
+  farm.poll();
+  REQUIRE(rtu->buf.size() == 1);
+  CHECK(rtu->buf.at(0) == cbus::serialize_frame(cbus::write_single_holding_register_response(0, 3, 4, 0xbeef), false));
+  CHECK(farm.requests() == 4);
+}
+
+TEST_CASE("test filter skips frames before decoding") {
+  for (bool tcp : {true, false}) {
+    cbus::config cfg;
+    cfg.now = [] { return 0; };
+    cfg.use_tcp_format = tcp;
+    cfg.is_master = true;
+    cfg.filter.block_all().allow_unit(1).allow_unit(3).allow_function(3);
+    std::vector<cbus::single_packet> received;
+    std::shared_ptr<virtual_bus> dev = std::make_shared<virtual_bus>();
+    cbus::bus<virtual_bus> b(dev, cfg, [&received](const cbus::single_packet& pkg) { received.push_back(pkg); });
+    dev->feed(cbus::serialize_frame(cbus::read_holding_registers_response(1, 2, {1}), tcp) +
+              cbus::serialize_frame(cbus::read_input_registers_response(2, 1, {2}), tcp) +
+              cbus::serialize_frame(cbus::read_holding_registers_response(3, 1, {3}), tcp) +
+              cbus::serialize_frame(cbus::error_response(4, 3, cbus::function_code::read_holding_registers, cbus::error_code::illegal_data_address), tcp));
+    REQUIRE(received.size() == 2);
+    CHECK(std::get<cbus::read_holding_registers_response>(received.at(0)).register_data == std::vector<uint16_t>{3});
+    CHECK(std::get<cbus::error_response>(received.at(1)).address == 3);
+    CHECK(b.open());
+  }
+}
+
+TEST_CASE("test typed handlers decode only handled packets") {
+  for (bool tcp : {true, false}) {
+    cbus::config cfg;
+    cfg.now = [] { return 0; };
+    cfg.use_tcp_format = tcp;
+    cfg.is_master = true;
+    std::shared_ptr<virtual_bus> dev = std::make_shared<virtual_bus>();
+    cbus::bus<virtual_bus> b(dev, cfg, nullptr);
+    std::vector<uint16_t> registers;
+    std::vector<cbus::error_code> errors;
+    b.set_handler<cbus::read_holding_registers_response>([&registers](const cbus::read_holding_registers_response& pkg) { registers = pkg.register_data; });
+    b.set_handler<cbus::error_response>([&errors](const cbus::error_response& pkg) { errors.push_back(pkg.error); });
+    CHECK_THROWS(b.set_handler<cbus::read_coils_request>([](const cbus::read_coils_request&) {}));
+    dev->feed(cbus::serialize_frame(cbus::read_input_registers_response(1, 1, {1}), tcp) +
+              cbus::serialize_frame(cbus::read_holding_registers_response(2, 1, {2, 3}), tcp) +
+              cbus::serialize_frame(cbus::error_response(3, 1, cbus::function_code::write_holding_registers, cbus::error_code::slave_device_busy), tcp));
+    CHECK(registers == std::vector<uint16_t>{2, 3});
+    CHECK(errors == std::vector<cbus::error_code>{cbus::error_code::slave_device_busy});
+    b.set_handler<cbus::read_holding_registers_response>(nullptr);
+    dev->feed(cbus::serialize_frame(cbus::read_holding_registers_response(4, 1, {4}), tcp));
+    CHECK(registers == std::vector<uint16_t>{2, 3});
+    CHECK(b.open());
+  }
+}
+
+TEST_CASE("test table driven codec round trips all function codes") {
+  std::vector<bool> coils{true, false, true, true, false, false, false, true, true, false};
+  for (bool tcp : {true, false}) {
+    cbus::config cfg;
+    cfg.now = [] { return 0; };
+    cfg.use_tcp_format = tcp;
+    cfg.is_master = true;
+    std::vector<cbus::single_packet> received;
+    std::shared_ptr<virtual_bus> dev = std::make_shared<virtual_bus>();
+    cbus::bus<virtual_bus> b(dev, cfg, [&received](const cbus::single_packet& pkg) { received.push_back(pkg); });
+    dev->feed(cbus::serialize_frame(cbus::read_discrete_inputs_response(1, 1, coils), tcp) + cbus::serialize_frame(cbus::write_single_coil_response(2, 1, 7, true), tcp) +
+              cbus::serialize_frame(cbus::write_multiple_coils_response(3, 1, 8, 10), tcp) + cbus::serialize_frame(cbus::mask_write_register_response(4, 1, 9, 0xf0f0, 0x0102), tcp) +
+              cbus::serialize_frame(cbus::read_write_registers_response(5, 1, {0x1234, 0x5678}), tcp) +
+              cbus::serialize_frame(cbus::error_response(6, 1, cbus::function_code::read_write_registers, cbus::error_code::illegal_data_value), tcp));
+    REQUIRE(received.size() == 6);
+    std::vector<bool> padded = std::get<cbus::read_discrete_inputs_response>(received.at(0)).input_data;
+    REQUIRE(padded.size() == 16);
+    CHECK(std::vector<bool>(padded.begin(), padded.begin() + 10) == coils);
+    CHECK(std::get<cbus::write_single_coil_response>(received.at(1)).coil_value);
+    CHECK(std::get<cbus::write_multiple_coils_response>(received.at(2)).coil_count == 10);
+    CHECK(std::get<cbus::mask_write_register_response>(received.at(3)).or_mask == 0x0102);
+    CHECK(std::get<cbus::read_write_registers_response>(received.at(4)).register_data == std::vector<uint16_t>{0x1234, 0x5678});
+    CHECK(std::get<cbus::error_response>(received.at(5)).error == cbus::error_code::illegal_data_value);
+    CHECK(b.open());
+  }
+
+  cbus::config cfg;
+  cfg.now = [] { return 0; };
+  cfg.is_master = false;
+  cfg.address = 1;
+  std::vector<cbus::single_packet> received;
+  std::shared_ptr<virtual_bus> dev = std::make_shared<virtual_bus>();
+  cbus::bus<virtual_bus> b(dev, cfg, [&received](const cbus::single_packet& pkg) { received.push_back(pkg); });
+  dev->feed(cbus::serialize_frame(cbus::read_discrete_inputs_request(1, 1, 3, 10), true) + cbus::serialize_frame(cbus::write_single_coil_request(2, 1, 7, false), true) +
+            cbus::serialize_frame(cbus::write_multiple_coils_request(3, 1, 8, coils), true) + cbus::serialize_frame(cbus::mask_write_register_request(4, 1, 9, 0xf0f0, 0x0102), true) +
+            cbus::serialize_frame(cbus::read_write_registers_request(5, 1, 10, 2, 20, {0xabcd}), true));
+  REQUIRE(received.size() == 5);
+  CHECK(std::get<cbus::read_discrete_inputs_request>(received.at(0)).input_count == 10);
+  CHECK(!std::get<cbus::write_single_coil_request>(received.at(1)).coil_value);
+  CHECK(std::get<cbus::write_multiple_coils_request>(received.at(2)).coil_data == coils);
+  CHECK(std::get<cbus::mask_write_register_request>(received.at(3)).and_mask == 0xf0f0);
+  const cbus::read_write_registers_request& rw = std::get<cbus::read_write_registers_request>(received.at(4));
+  CHECK(rw.read_count == 2);
+  CHECK(rw.write_first == 20);
+  CHECK(rw.write_data == std::vector<uint16_t>{0xabcd});
+
+  std::string request = cbus::serialize_frame(cbus::read_write_registers_request(6, 1, 0, 1, 0, {1, 2}), false);
+  CHECK(cbus::predict_rtu_size(request.data(), 4, false) == 11);
+  CHECK(cbus::predict_rtu_size(request.data(), request.size(), false) == request.size());
+  std::string oversized("\x01\x03\xfc", 3);
+  CHECK(cbus::predict_rtu_size(oversized.data(), oversized.size(), true) == 0);
+  CHECK(cbus::describe_function(0x97).supported);
+  CHECK(!cbus::describe_function(0x07).supported);
+}
+
+struct pausable_bus : virtual_bus {
+  void pause_receive(bool p) { paused = p; }
+  bool paused = false;
+};
+
+TEST_CASE("test receive budget overflow policies and pausing") {
+  std::vector<uint16_t> registers(100);
+  auto frame = [&registers](uint16_t id) { return cbus::serialize_frame(cbus::read_holding_registers_response(id, 1, registers), true); };
+  for (cbus::overflow_policy policy : {cbus::overflow_policy::drop_oldest_frame, cbus::overflow_policy::drop_newest}) {
+    cbus::config cfg;
+    cfg.now = [] { return 0; };
+    cfg.is_master = true;
+    cfg.receive_budget = 500;
+    cfg.overflow = policy;
+    std::vector<uint16_t> ids;
+    std::shared_ptr<pausable_bus> dev = std::make_shared<pausable_bus>();
+    cbus::bus<pausable_bus> b(dev, cfg, [&ids](const cbus::single_packet& pkg) { ids.push_back(cbus::get_header(pkg)->transaction_id); });
+    b.pause_receive();
+    CHECK(dev->paused);
+    dev->feed(frame(1) + frame(2) + frame(3));
+    CHECK(ids.empty());
+    CHECK(b.buffered() == 2 * frame(1).size());
+    b.resume_receive();
+    CHECK(!dev->paused);
+    CHECK(ids == ((policy == cbus::overflow_policy::drop_oldest_frame) ? std::vector<uint16_t>{2, 3} : std::vector<uint16_t>{1, 2}));
+    CHECK(b.statistics().overflows == 1);
+    CHECK(b.statistics().frames_dropped == 1);
+    CHECK(b.open());
+  }
+
+  // a frame larger than the budget is dropped as a whole, the stream stays in sync
+  cbus::config cfg;
+  cfg.now = [] { return 0; };
+  cfg.is_master = true;
+  cfg.receive_budget = 100;
+  std::vector<uint16_t> ids;
+  std::shared_ptr<virtual_bus> dev = std::make_shared<virtual_bus>();
+  cbus::bus<virtual_bus> b(dev, cfg, [&ids](const cbus::single_packet& pkg) { ids.push_back(cbus::get_header(pkg)->transaction_id); });
+  std::string big = frame(1);
+  dev->feed(big.substr(0, 150));
+  CHECK(b.buffered() == 0);
+  dev->feed(big.substr(150) + cbus::serialize_frame(cbus::read_holding_registers_response(2, 1, {1}), true));
+  CHECK(ids == std::vector<uint16_t>{2});
+  CHECK(b.statistics().bytes_dropped == big.size());
+
+  // rtu drops bytes, candidates behind the dropped data still resync
+  cfg.use_tcp_format = false;
+  cfg.receive_budget = 16;
+  ids.clear();
+  std::shared_ptr<virtual_bus> rtu_dev = std::make_shared<virtual_bus>();
+  cbus::bus<virtual_bus> rtu(rtu_dev, cfg, [&ids](const cbus::single_packet&) { ids.push_back(0); });
+  rtu_dev->feed(std::string(40, '\xff'));
+  CHECK(rtu.buffered() <= 16);
+  rtu_dev->feed(cbus::serialize_frame(cbus::read_holding_registers_response(0, 1, {1}), false));
+  CHECK(ids.size() == 1);
+
+  // a shared budget limits several buses, the close policy closes the one exceeding it
+  std::shared_ptr<cbus::memory_budget> shared = std::make_shared<cbus::memory_budget>(300);
+  cfg.use_tcp_format = true;
+  cfg.receive_budget = 8192;
+  cfg.shared_budget = shared;
+  cfg.overflow = cbus::overflow_policy::close;
+  std::shared_ptr<virtual_bus> dev1 = std::make_shared<virtual_bus>();
+  std::shared_ptr<virtual_bus> dev2 = std::make_shared<virtual_bus>();
+  {
+    cbus::bus<virtual_bus> b1(dev1, cfg, [](const cbus::single_packet&) {});
+    cbus::bus<virtual_bus> b2(dev2, cfg, [](const cbus::single_packet&) {});
+    dev1->feed(big.substr(0, 200));
+    CHECK(shared->used() == 200);
+    dev2->feed(big.substr(0, 150));
+    CHECK(!b2.open());
+    CHECK(b2.error_string() == "receive buffer overflow");
+    CHECK(b1.open());
+    CHECK(shared->used() == 200);
+  }
+  CHECK(shared->used() == 0);
+}
+
+TEST_CASE("test batch feed with receive timestamps") {
+  uint_least32_t now_calls = 0;
+  cbus::config cfg;
+  cfg.now = [&now_calls] {
+    now_calls++;
+    return 0;
+  };
+  cfg.is_master = true;
+  cfg.silence_timeout = 100;
+  std::vector<uint16_t> ids;
+  std::shared_ptr<virtual_bus> dev = std::make_shared<virtual_bus>();
+  cbus::bus<virtual_bus> b(dev, cfg, [&ids](const cbus::single_packet& pkg) { ids.push_back(cbus::get_header(pkg)->transaction_id); });
+  std::string first = cbus::serialize_frame(cbus::read_holding_registers_response(1, 1, {1, 2}), true);
+  std::string second = cbus::serialize_frame(cbus::read_holding_registers_response(2, 1, {3}), true);
+  std::string third = cbus::serialize_frame(cbus::read_holding_registers_response(3, 1, {4}), true);
+  // the partial third frame is followed by a silence, so it is discarded before the rest of the batch
+  std::vector<cbus::received_chunk> chunks{{first.data(), 5, 1000}, {first.data() + 5, first.size() - 5, 1010}, {second.data(), second.size(), 1020},
+                                           {third.data(), 4, 1030}, {second.data(), second.size(), 1500}};
+  b.feed_batch(chunks);
+  CHECK(ids == std::vector<uint16_t>{1, 2, 2});
+  CHECK(now_calls == 0);
+  CHECK(b.buffered() == 0);
+  b.feed_batch({{third.data(), third.size(), std::nullopt}, {third.data(), third.size(), std::nullopt}});
+  CHECK(ids == std::vector<uint16_t>{1, 2, 2, 3, 3});
+  CHECK(now_calls == 1);
+
+#ifdef CBUS_TEST_URING
+  // the uring device passes everything received in one poll as a batch
+  for (bool use_uring : {true, false}) {
+    int fds[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    std::shared_ptr<cbus::uring_device> uring = std::make_shared<cbus::uring_device>(fds[0], use_uring);
+    ids.clear();
+    cbus::bus<cbus::uring_device> ub(uring, cfg, [&ids](const cbus::single_packet& pkg) { ids.push_back(cbus::get_header(pkg)->transaction_id); });
+    uring->poll(0);
+    std::string frames = first + second + third;
+    REQUIRE(write(fds[1], frames.data(), frames.size()) == static_cast<ssize_t>(frames.size()));
+    for (int i = 0; (i < 20) && (ids.size() < 3); i++)
+      uring->poll(10);
+    CHECK(ids == std::vector<uint16_t>{1, 2, 3});
+    close(fds[1]);
+  }
+#endif
+}
+
+TEST_CASE("test parallel trace analyzer indexes tcp and rtu captures") {
+  for (bool tcp : {true, false}) {
+    cbus::trace_recorder recorder(tcp);
+    for (uint16_t i = 0; i < 500; i++) {
+      uint8_t unit = static_cast<uint8_t>(1 + i % 8);
+      int_least64_t time = 1000 * i;
+      recorder.record(cbus::serialize_frame(cbus::read_holding_registers_request(i, unit, 100, 10), tcp), time);
+      recorder.record(cbus::serialize_frame(cbus::read_holding_registers_response(i, unit, std::vector<uint16_t>(10, i)), tcp), time + 1);
+      recorder.record(cbus::serialize_frame(cbus::write_single_holding_register_request(i, unit, 4000 + i % 3, i), tcp), time + 2);
+      recorder.record(cbus::serialize_frame(cbus::write_holding_registers_response(i, unit, 3990, 20), tcp), time + 3);
+      if (i == 250)
+        recorder.record(std::string("\x42\x17\x00\x00\x00", 5), time + 4);
+    }
+    cbus::trace_capture capture = recorder.capture();
+    CHECK(cbus::trace_analyzer::split(capture, 4).size() == 4);
+    cbus::trace_analyzer parallel(4);
+    cbus::trace_analyzer single(1);
+    parallel.add(capture);
+    single.add(capture);
+    CHECK(parallel.size() == single.size());
+    CHECK(parallel.size() >= 1990);
+
+    // writes to register 4000 on unit 7, the write responses are not counted as writes
+    cbus::trace_query q;
+    q.unit = 7;
+    q.access = cbus::trace_access::write;
+    q.table = cbus::trace_table::holding_registers;
+    q.first = q.last = 4000;
+    q.from = 100000;
+    q.to = 199999;
+    std::vector<cbus::trace_entry> found = parallel.query(q);
+    CHECK(found.size() == single.query(q).size());
+    size_t requests = 0;
+    for (const cbus::trace_entry& entry : found) {
+      CHECK(entry.unit == 7);
+      CHECK(entry.time >= q.from);
+      CHECK(entry.time <= q.to);
+      CHECK_FALSE(entry.response);
+      requests++;
+      cbus::single_packet pkg = parallel.decode(entry);
+      REQUIRE(std::holds_alternative<cbus::write_single_holding_register_request>(pkg));
+      CHECK(std::get<cbus::write_single_holding_register_request>(pkg).register_index == 4000);
+    }
+    CHECK(requests == 5);
+    CHECK(found.size() == requests);
+  }
+}
+
+TEST_CASE("test trace analyzer tells echoed write responses from requests") {
+  for (bool tcp : {true, false}) {
+    cbus::trace_recorder recorder(tcp);
+    // a capture starting with the echo of a request recorded before it, on rtu only distinguishable if the next request is for another unit
+    recorder.record(cbus::serialize_frame(cbus::write_single_holding_register_response(9, tcp ? 1 : 3, 10, 5), tcp), 0);
+    for (uint16_t i = 0; i < 100; i++) {
+      uint8_t unit = static_cast<uint8_t>(1 + i % 2);
+      recorder.record(cbus::serialize_frame(cbus::write_single_holding_register_request(i, unit, 10, i), tcp), 10 * i + 1);
+      recorder.record(cbus::serialize_frame(cbus::write_single_holding_register_response(i, unit, 10, i), tcp), 10 * i + 2);
+      recorder.record(cbus::serialize_frame(cbus::write_holding_registers_request(i, unit, 8, {1, 2, 3}), tcp), 10 * i + 3);
+      recorder.record(cbus::serialize_frame(cbus::write_holding_registers_response(i, unit, 8, 3), tcp), 10 * i + 4);
+    }
+    cbus::trace_capture capture = recorder.capture();
+    cbus::trace_analyzer analyzer(4);
+    analyzer.add(capture);
+    cbus::trace_query q;
+    q.access = cbus::trace_access::write;
+    q.table = cbus::trace_table::holding_registers;
+    q.first = q.last = 10;
+    q.from = 1;
+    std::vector<cbus::trace_entry> found = analyzer.query(q);
+    CHECK(found.size() == 200);
+    bool sorted = true;
+    for (size_t i = 1; i < found.size(); i++)
+      sorted = sorted && (found[i - 1].time <= found[i].time);
+    CHECK(sorted);
+    q.unit = 2;
+    found = analyzer.query(q);
+    REQUIRE(found.size() == 100);
+    cbus::single_packet pkg = analyzer.decode(found.at(2));
+    REQUIRE(std::holds_alternative<cbus::write_single_holding_register_request>(pkg));
+    CHECK(std::get<cbus::write_single_holding_register_request>(pkg).register_value == 3);
+    q.access = std::nullopt;
+    q.table = std::nullopt;
+    q.first = 0;
+    q.last = 0xffff;
+    q.function = static_cast<uint8_t>(cbus::function_code::write_single_holding_register);
+    found = analyzer.query(q);
+    REQUIRE(found.size() == 100);
+    CHECK(found.at(0).time == 11);
+    CHECK(found.at(0).response == false);
+    CHECK(found.at(1).response == true);
+    CHECK(std::holds_alternative<cbus::write_single_holding_register_response>(analyzer.decode(found.at(1))));
+  }
+}
+
+TEST_CASE("test adaptive poll controller in deterministic simulation") {
+  struct result {
+    std::vector<int_least64_t> intervals;
+    double estimated;
+    double line;
+    double delay;
+    double timeouts;
+  };
+  auto run = [](const bool adaptive, const uint_least64_t seed) {
+    cbus::poll_simulation sim(1, 200, seed);
+    sim.set_slave(1, 10, 0);
+    sim.set_slave(2, 40, 0.3);
+    sim.set_change_rate(1, 0, 10, 1.0 / 300);
+    sim.set_change_rate(1, 100, 10, 1.0 / 30000);
+    sim.set_change_rate(2, 0, 10, 1.0 / 3000);
+    cbus::poll_controller_config cfg;
+    cfg.now = [&sim]() { return sim.now(); };
+    cfg.utilisation = 0.3;
+    cfg.timeout_cost = 200;
+    cbus::poll_controller<cbus::poll_simulation> controller(sim, cfg);
+    cbus::poll_range range;
+    range.count = 10;
+    range.min_interval = adaptive ? 50 : 660;
+    range.max_interval = adaptive ? 20000 : 660;
+    size_t seen = 0;
+    std::vector<size_t> ids;
+    ids.push_back(controller.add(range, [&seen](const std::vector<uint16_t>& data) { seen += (data.size() == 10); }));
+    range.first = 100;
+    ids.push_back(controller.add(range, {}));
+    range.unit = 2;
+    range.first = 0;
+    range.input_registers = true;
+    ids.push_back(controller.add(range, {}));
+    sim.run(controller, 2000000);
+    CHECK(seen > 0);
+    result ret;
+    for (size_t id : ids) {
+      ret.intervals.push_back(controller.stats(id).interval);
+      CHECK(controller.stats(id).interval >= range.min_interval);
+      CHECK(controller.stats(id).interval <= range.max_interval);
+    }
+    ret.estimated = controller.utilisation();
+    ret.line = sim.line_utilisation();
+    ret.delay = sim.detection_delay();
+    ret.timeouts = controller.stats(ids[2]).timeout_rate;
+    return ret;
+  };
+  result adaptive = run(true, 42);
+  result fixed = run(false, 42);
+  INFO("adaptive " << adaptive.line << " " << adaptive.delay << " fixed " << fixed.line << " " << fixed.delay);
+  // fast changing range polled more often than the slow one of the same slave
+  CHECK(adaptive.intervals[0] < adaptive.intervals[1]);
+  CHECK(adaptive.estimated <= 0.31);
+  CHECK(adaptive.line <= 0.35);
+  CHECK(adaptive.timeouts > 0.1);
+  CHECK(adaptive.timeouts < 0.6);
+  // fixed intervals using as much of the line see changes later
+  CHECK(fixed.line >= adaptive.line);
+  CHECK(adaptive.delay < fixed.delay);
+
+  result again = run(true, 42);
+  CHECK(again.intervals == adaptive.intervals);
+  CHECK(again.delay == adaptive.delay);
+  CHECK(again.line == adaptive.line);
+}
+
+TEST_CASE("test interval set and dirty ranges of shared memory image") {
+  cbus::interval_set set;
+  set.insert(10, 5);
+  set.insert(20, 5);
+  set.insert(15, 5);
+  set.insert(40, 2);
+  set.insert(39, 1);
+  set.insert(0xfff0, 16);
+  set.insert(30, 0);
+  CHECK(set.size() == 3);
+  CHECK(set.contains(10));
+  CHECK(set.contains(24));
+  CHECK_FALSE(set.contains(25));
+  CHECK_FALSE(set.contains(38));
+  CHECK(set.drain() == std::vector<cbus::changed_range>{{10, 15}, {39, 3}, {0xfff0, 16}});
+  CHECK(set.empty());
+  set.insert(5, 10);
+  set.insert(0, 0x10000);
+  CHECK(set.drain() == std::vector<cbus::changed_range>{{0, 0xffff}, {0xffff, 1}});
+
+#ifdef CBUS_TEST_POSIX
+  uint64_t time = 0;
+  cbus::config cfg;
+  cfg.now = [&time] { return time; };
+  cfg.use_tcp_format = true;
+  cfg.is_master = false;
+  cfg.address = 0x42;
+  std::string name = "/cbus_test_dirty_" + std::to_string(getpid());
+  cbus::shm_image image(name, true);
+  cbus::shm_image client(name, false);
+  std::shared_ptr<virtual_bus> vbus = std::make_shared<virtual_bus>();
+  std::unique_ptr<cbus::bus<virtual_bus>> b;
+  b = std::make_unique<cbus::bus<virtual_bus>>(vbus, cfg, [&image, &b](const cbus::single_packet& pkg) {
+    CHECK(image.answer(pkg, [&b](const auto& response) { b->send(response); }));
+  });
+  image.write_registers(cbus::shm_image::table::holding_registers, 0, {1, 2, 3});
+  CHECK_FALSE(image.dirty(cbus::shm_image::table::holding_registers));
+  vbus->feed(cbus::serialize_frame(cbus::write_holding_registers_request(1, 0x42, 100, {1, 2, 3, 4}), true));
+  vbus->feed(cbus::serialize_frame(cbus::write_single_holding_register_request(2, 0x42, 104, 5), true));
+  vbus->feed(cbus::serialize_frame(cbus::write_single_holding_register_request(3, 0x42, 7, 5), true));
+  vbus->feed(cbus::serialize_frame(cbus::read_holding_registers_request(4, 0x42, 0, 10), true));
+  CHECK(vbus->buf.size() == 4);
+  CHECK(client.queue_write(cbus::shm_image::table::coils, 3, std::vector<bool>{true, true}));
+  CHECK(client.queue_write(cbus::shm_image::table::holding_registers, 98, std::vector<uint16_t>{9, 9}));
+  CHECK(image.apply_queued_writes() == 2);
+  CHECK(image.dirty(cbus::shm_image::table::holding_registers));
+  CHECK_FALSE(image.dirty(cbus::shm_image::table::input_registers));
+  CHECK(image.drain_dirty(cbus::shm_image::table::holding_registers) == std::vector<cbus::changed_range>{{7, 1}, {98, 7}});
+  CHECK(image.drain_dirty(cbus::shm_image::table::coils) == std::vector<cbus::changed_range>{{3, 2}});
+  CHECK(image.drain_dirty(cbus::shm_image::table::holding_registers).empty());
+  CHECK_FALSE(image.dirty(cbus::shm_image::table::coils));
+#endif
+}
+
+TEST_CASE("test sniffer matches requests and responses on rtu and tcp") {
+  int_least64_t time = 0;
+  cbus::config cfg;
+  cfg.now = [&time] { return time; };
+  cfg.use_tcp_format = false;
+  cfg.sniffer = true;
+  cfg.silence_timeout = 100;
+  std::shared_ptr<virtual_bus> vbus = std::make_shared<virtual_bus>();
+  std::vector<size_t> packets;
+  std::vector<cbus::sniffed_transaction> transactions;
+  cbus::bus<virtual_bus> b(vbus, cfg, [&packets](const cbus::single_packet& pkg) { packets.push_back(pkg.index()); });
+  b.set_transaction_handler([&transactions](const cbus::sniffed_transaction& t) { transactions.push_back(t); });
+  auto rtu = [](const auto& pkg) { return cbus::serialize_frame(pkg, false); };
+
+  vbus->feed(rtu(cbus::read_holding_registers_request(0, 1, 0, 2)));
+  time = 10;
+  vbus->feed(rtu(cbus::read_holding_registers_response(0, 1, {7, 8})));
+  // request and response in one chunk after line noise, the coil count gives the response length
+  time = 20;
+  vbus->feed(std::string("\x00\x55", 2) + rtu(cbus::read_coils_request(0, 2, 0, 10)) + rtu(cbus::read_coils_response(0, 2, std::vector<bool>(16, true))));
+  // an unanswered write is superseded by the next request, which gets an exception
+  time = 30;
+  vbus->feed(rtu(cbus::write_holding_registers_request(0, 3, 5, {1, 2, 3})));
+  time = 40;
+  vbus->feed(rtu(cbus::read_input_registers_request(0, 1, 0, 1)));
+  time = 45;
+  vbus->feed(rtu(cbus::error_response(0, 1, cbus::function_code::read_input_registers, cbus::error_code::illegal_data_address)));
+  time = 50;
+  vbus->feed(rtu(cbus::write_holding_registers_request(0, 3, 5, {1, 2, 3})));
+  time = 55;
+  vbus->feed(rtu(cbus::write_holding_registers_response(0, 3, 5, 3)));
+
+  CHECK(packets == std::vector<size_t>{9, 8, 5, 4, 13, 7, 10, 13, 14});
+  REQUIRE(transactions.size() == 5);
+  CHECK(std::get<cbus::read_holding_registers_request>(transactions[0].request).register_count == 2);
+  REQUIRE(transactions[0].response);
+  CHECK(std::get<cbus::read_holding_registers_response>(*transactions[0].response).register_data == std::vector<uint16_t>{7, 8});
+  CHECK(transactions[0].request_time == 0);
+  CHECK(transactions[0].response_time == 10);
+  REQUIRE(transactions[1].response);
+  CHECK(std::get<cbus::read_coils_response>(*transactions[1].response).coil_data.size() == 16);
+  CHECK(transactions[2].request.index() == 13);
+  CHECK_FALSE(transactions[2].response);
+  CHECK(transactions[2].response_time == 40);
+  REQUIRE(transactions[3].response);
+  CHECK(std::get<cbus::error_response>(*transactions[3].response).error == cbus::error_code::illegal_data_address);
+  REQUIRE(transactions[4].response);
+  CHECK(transactions[4].request_time == 50);
+  CHECK(transactions[4].response_time == 55);
+
+  // a mirrored tcp port with two outstanding requests answered in reverse order
+  cfg.use_tcp_format = true;
+  std::shared_ptr<virtual_bus> tcp = std::make_shared<virtual_bus>();
+  transactions.clear();
+  cbus::bus<virtual_bus> mirror(tcp, cfg, {});
+  mirror.set_transaction_handler([&transactions](const cbus::sniffed_transaction& t) { transactions.push_back(t); });
+  time = 100;
+  tcp->feed(cbus::serialize_frame(cbus::read_input_registers_request(1, 5, 0, 1), true) + cbus::serialize_frame(cbus::read_input_registers_request(2, 6, 0, 1), true));
+  time = 110;
+  tcp->feed(cbus::serialize_frame(cbus::read_input_registers_response(2, 6, {2}), true));
+  time = 120;
+  tcp->feed(cbus::serialize_frame(cbus::read_input_registers_response(1, 5, {1}), true));
+  CHECK(mirror.open());
+  REQUIRE(transactions.size() == 2);
+  CHECK(transactions[0].request.index() == 7);
+  REQUIRE(transactions[0].response);
+  CHECK(std::get<cbus::read_input_registers_response>(*transactions[0].response).register_data == std::vector<uint16_t>{2});
+  CHECK(transactions[0].response_time == 110);
+  REQUIRE(transactions[1].response);
+  CHECK(std::get<cbus::read_input_registers_response>(*transactions[1].response).register_data == std::vector<uint16_t>{1});
+  CHECK(transactions[1].request_time == 100);
+}
+
+TEST_CASE("test tcp sniffer attaching mid-stream and seeing repeated transaction ids") {
+  int_least64_t time = 0;
+  cbus::config cfg;
+  cfg.now = [&time] { return time; };
+  cfg.use_tcp_format = true;
+  cfg.sniffer = true;
+  cfg.close_on_error = true;
+  std::shared_ptr<virtual_bus> tcp = std::make_shared<virtual_bus>();
+  std::vector<size_t> packets;
+  std::vector<cbus::sniffed_transaction> transactions;
+  cbus::bus<virtual_bus> b(tcp, cfg, [&packets](const cbus::single_packet& pkg) { packets.push_back(pkg.index()); });
+  b.set_transaction_handler([&transactions](const cbus::sniffed_transaction& t) { transactions.push_back(t); });
+
+  // responses to requests sent before the sniffer attached
+  tcp->feed(cbus::serialize_frame(cbus::read_holding_registers_response(7, 1, {1, 2}), true));
+  tcp->feed(cbus::serialize_frame(cbus::error_response(8, 1, cbus::function_code::read_holding_registers, cbus::error_code::slave_device_busy), true));
+  CHECK(b.open());
+  CHECK(transactions.empty());
+  // a client retry reusing the transaction id supersedes the first request
+  time = 10;
+  tcp->feed(cbus::serialize_frame(cbus::read_holding_registers_request(9, 1, 0, 2), true));
+  time = 20;
+  tcp->feed(cbus::serialize_frame(cbus::read_holding_registers_request(9, 1, 0, 2), true));
+  time = 30;
+  tcp->feed(cbus::serialize_frame(cbus::read_holding_registers_response(9, 1, {3, 4}), true));
+  // a frame fitting neither direction is skipped by its MBAP length
+  tcp->feed(std::string("\x00\x0a\x00\x00\x00\x03\x01\x03\x05", 9) + cbus::serialize_frame(cbus::read_holding_registers_request(11, 1, 0, 1), true));
+  CHECK(b.open());
+  CHECK(packets == std::vector<size_t>{8, 10, 9, 9, 8, 1, 9});
+  REQUIRE(transactions.size() == 2);
+  CHECK_FALSE(transactions[0].response);
+  CHECK(transactions[0].request_time == 10);
+  REQUIRE(transactions[1].response);
+  CHECK(transactions[1].request_time == 20);
+  CHECK(transactions[1].response_time == 30);
+  CHECK(std::get<cbus::read_holding_registers_response>(*transactions[1].response).register_data == std::vector<uint16_t>{3, 4});
+}
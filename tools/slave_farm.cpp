@@ -0,0 +1,262 @@
+#include "cbus.hpp"
+#include "slave_farm.hpp"
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace {
+  /**
+   * \brief non-blocking descriptor used as device, unsent data is kept until the descriptor is writable
+   */
+  struct fd_device {
+    explicit fd_device(const int p_fd) : fd(p_fd) {}
+    ~fd_device() { close(fd); }
+    void register_handler(std::function<void(const std::string&)> p_feed) { feed = p_feed; }
+    void send(std::string data) {
+      if (unsent.empty()) {
+        ssize_t ret = ::write(fd, data.data(), data.size());
+        if (ret == static_cast<ssize_t>(data.size()))
+          return;
+        data.erase(0, (ret > 0) ? static_cast<size_t>(ret) : 0);
+      }
+      unsent.append(data);
+    }
+    bool flush() {
+      while (!unsent.empty()) {
+        ssize_t ret = ::write(fd, unsent.data(), unsent.size());
+        if (ret <= 0)
+          return (ret < 0) && (errno == EAGAIN);
+        unsent.erase(0, static_cast<size_t>(ret));
+      }
+      return true;
+    }
+    int fd;
+    std::function<void(const std::string&)> feed;
+    std::string unsent;
+  };
+
+  /**
+   * \brief in memory device counting responses for the benchmark
+   */
+  struct counting_device {
+    void register_handler(std::function<void(const std::string&)> p_feed) { feed = p_feed; }
+    void send(const std::string&) { responses++; }
+    std::function<void(const std::string&)> feed;
+    uint_least64_t responses = 0;
+  };
+
+  struct options {
+    uint16_t tcp_port = 0;
+    uint_least32_t listeners = 1;
+    uint_least32_t units = 1;
+    uint_least32_t ptys = 0;
+    double bench = 0;
+    cbus::simulated_slave_config slave;
+  };
+
+  void usage() {
+    std::fprintf(stderr, "usage: cbus_slave_farm [--tcp PORT] [--listeners N] [--pty N] [--units N] [--registers N] [--delay US] [--jitter US]\n"
+                         "                       [--error-rate P] [--corrupt-rate P] [--truncate-rate P] [--drop-rate P] [--drift N] [--bench SECONDS]\n");
+    std::exit(1);
+  }
+
+  options parse(int argc, char** argv) {
+    options opt;
+    for (int i = 1; i < argc; i++) {
+      std::string arg = argv[i];
+      if (i + 1 >= argc)
+        usage();
+      const char* value = argv[++i];
+      if (arg == "--tcp")
+        opt.tcp_port = static_cast<uint16_t>(std::atoi(value));
+      else if (arg == "--listeners")
+        opt.listeners = static_cast<uint_least32_t>(std::atoi(value));
+      else if (arg == "--pty")
+        opt.ptys = static_cast<uint_least32_t>(std::atoi(value));
+      else if (arg == "--units")
+        opt.units = static_cast<uint_least32_t>(std::atoi(value));
+      else if (arg == "--registers")
+        opt.slave.registers = static_cast<uint16_t>(std::atoi(value));
+      else if (arg == "--delay")
+        opt.slave.delay = std::atoll(value);
+      else if (arg == "--jitter")
+        opt.slave.jitter = std::atoll(value);
+      else if (arg == "--error-rate")
+        opt.slave.faults.error_rate = std::atof(value);
+      else if (arg == "--corrupt-rate")
+        opt.slave.faults.corrupt_rate = std::atof(value);
+      else if (arg == "--truncate-rate")
+        opt.slave.faults.truncate_rate = std::atof(value);
+      else if (arg == "--drop-rate")
+        opt.slave.faults.drop_rate = std::atof(value);
+      else if (arg == "--drift")
+        opt.slave.drift = static_cast<uint16_t>(std::atoi(value));
+      else if (arg == "--bench")
+        opt.bench = std::atof(value);
+      else
+        usage();
+    }
+    if ((opt.units < 1) || (opt.units > 247))
+      usage();
+    return opt;
+  }
+
+  int_least64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  /**
+   * \brief answer requests of an in memory master as fast as possible and report the rate
+   */
+  int bench(options opt) {
+    opt.slave.delay = opt.slave.jitter = 0;
+    cbus::slave_farm farm(now_us);
+    std::shared_ptr<counting_device> dev = std::make_shared<counting_device>();
+    size_t id = farm.attach(dev, true);
+    std::string batch;
+    for (uint_least32_t unit = 1; unit <= opt.units; unit++) {
+      opt.slave.unit = static_cast<uint8_t>(unit);
+      farm.add_slave(id, opt.slave);
+      batch += cbus::serialize_frame(cbus::read_holding_registers_request(static_cast<uint16_t>(unit), static_cast<uint8_t>(unit), 0, 10), true);
+    }
+    int_least64_t start = now_us();
+    int_least64_t end = start + static_cast<int_least64_t>(opt.bench * 1e6);
+    int_least64_t now = start;
+    while (now < end) {
+      for (uint_least32_t i = 0; i < 1000; i++)
+        dev->feed(batch);
+      now = now_us();
+    }
+    std::printf("%llu requests in %.3f s, %.0f requests/s\n", static_cast<unsigned long long>(dev->responses), (now - start) / 1e6,
+                dev->responses * 1e6 / (now - start));
+    return 0;
+  }
+
+  int listen_tcp(const uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) || (listen(fd, 1024) != 0))
+      throw std::system_error(errno, std::generic_category(), "listen on port " + std::to_string(port));
+    return fd;
+  }
+} // namespace
+
+int main(int argc, char** argv) {
+  options opt = parse(argc, argv);
+  if (opt.bench > 0)
+    return bench(opt);
+  if (!opt.tcp_port && !opt.ptys)
+    usage();
+  cbus::slave_farm farm(now_us, static_cast<uint_least64_t>(now_us()));
+  int epoll = epoll_create1(0);
+  // listener descriptor to the slaves shared by all its connections
+  std::unordered_map<int, std::vector<cbus::simulated_slave*>> listeners;
+  // open descriptor to its device and endpoint
+  std::unordered_map<int, std::pair<std::shared_ptr<fd_device>, size_t>> devices;
+  auto watch = [epoll](const int fd, const uint32_t events) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &ev);
+  };
+  auto make_slaves = [&farm, &opt](const size_t endpoint) {
+    std::vector<cbus::simulated_slave*> slaves;
+    for (uint_least32_t unit = 1; unit <= opt.units; unit++) {
+      opt.slave.unit = static_cast<uint8_t>(unit);
+      slaves.push_back(&farm.add_slave(endpoint, opt.slave));
+    }
+    return slaves;
+  };
+
+  size_t template_endpoint = farm.attach(std::make_shared<counting_device>(), true);
+  for (uint_least32_t i = 0; i < opt.listeners && opt.tcp_port; i++) {
+    int fd = listen_tcp(static_cast<uint16_t>(opt.tcp_port + i));
+    listeners[fd] = make_slaves(template_endpoint);
+    watch(fd, EPOLLIN);
+    std::printf("tcp 127.0.0.1:%u units 1-%u\n", opt.tcp_port + i, opt.units);
+  }
+  for (uint_least32_t i = 0; i < opt.ptys; i++) {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if ((fd < 0) || (grantpt(fd) != 0) || (unlockpt(fd) != 0))
+      throw std::system_error(errno, std::generic_category(), "posix_openpt");
+    // keep the slave side open, so the master does not hang up while no master under test has it opened
+    int keep = open(ptsname(fd), O_RDWR | O_NOCTTY);
+    termios tio;
+    if ((keep < 0) || (tcgetattr(keep, &tio) != 0))
+      throw std::system_error(errno, std::generic_category(), "open pty");
+    cfmakeraw(&tio);
+    tcsetattr(keep, TCSANOW, &tio);
+    std::shared_ptr<fd_device> dev = std::make_shared<fd_device>(fd);
+    size_t endpoint = farm.attach(dev, false);
+    make_slaves(endpoint);
+    devices[fd] = {dev, endpoint};
+    watch(fd, EPOLLIN);
+    std::printf("rtu %s units 1-%u\n", ptsname(fd), opt.units);
+  }
+  std::fflush(stdout);
+
+  std::vector<epoll_event> events(1024);
+  std::vector<char> buffer(65536);
+  std::string data;
+  int_least64_t next_drift = now_us() + 1000000;
+  while (true) {
+    int count = epoll_wait(epoll, events.data(), static_cast<int>(events.size()), farm.pending() ? 1 : 100);
+    for (int i = 0; i < count; i++) {
+      int fd = events[i].data.fd;
+      auto listener = listeners.find(fd);
+      if (listener != listeners.end()) {
+        int client;
+        while ((client = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK)) >= 0) {
+          int one = 1;
+          setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+          std::shared_ptr<fd_device> dev = std::make_shared<fd_device>(client);
+          size_t endpoint = farm.attach(dev, true);
+          for (cbus::simulated_slave* slave : listener->second)
+            farm.add_slave(endpoint, *slave);
+          devices[client] = {dev, endpoint};
+          watch(client, EPOLLIN | EPOLLOUT | EPOLLET);
+        }
+        continue;
+      }
+      auto device = devices.find(fd);
+      if (device == devices.end())
+        continue;
+      bool open = device->second.first->flush();
+      while (open) {
+        ssize_t ret = read(fd, buffer.data(), buffer.size());
+        if (ret > 0) {
+          data.assign(buffer.data(), static_cast<size_t>(ret));
+          device->second.first->feed(data);
+        } else
+          open = (ret < 0) && ((errno == EAGAIN) || (errno == EINTR));
+        if (ret <= 0)
+          break;
+      }
+      if (!open) {
+        farm.detach(device->second.second);
+        epoll_ctl(epoll, EPOLL_CTL_DEL, fd, nullptr);
+        devices.erase(device);
+      }
+    }
+    farm.poll();
+    if (opt.slave.drift && (now_us() >= next_drift)) {
+      farm.drift();
+      next_drift += 1000000;
+    }
+  }
+}